@@ -0,0 +1,250 @@
+// IMA-ADPCM, which stores each 16-bit sample in 4 bits. Audio is kept in
+// blocks laid out as in WAV files (format 0x11), which the mixer decodes
+// one at a time as it plays, so compressed audio never has to be expanded
+// in memory.
+
+#define AUDIO_ADPCM_WAV_FORMAT 0x11
+// Block sizes for the audio we encode, per channel, as most tools use
+#define AUDIO_ADPCM_BLOCK_ALIGN 512
+
+typedef struct {
+  uint16_t channels;
+  // Bytes in each block, and the frames it decodes to
+  uint16_t blockAlign;
+  uint32_t blockFrames;
+  uint32_t blockCount;
+  uint8_t* blocks;
+} AUDIO_ADPCM;
+
+// A channel's place in the audio: the last block it decoded, as frames.
+typedef struct {
+  uint32_t block;
+  int16_t frames[];
+} AUDIO_ADPCM_DECODER;
+
+internal const int16_t AUDIO_ADPCM_STEPS[89] = {
+  7, 8, 9, 10, 11, 12, 13, 14, 16, 17, 19, 21, 23, 25, 28, 31, 34, 37, 41, 45,
+  50, 55, 60, 66, 73, 80, 88, 97, 107, 118, 130, 143, 157, 173, 190, 209, 230,
+  253, 279, 307, 337, 371, 408, 449, 494, 544, 598, 658, 724, 796, 876, 963,
+  1060, 1166, 1282, 1411, 1552, 1707, 1878, 2066, 2272, 2499, 2749, 3024, 3327,
+  3660, 4026, 4428, 4871, 5358, 5894, 6484, 7132, 7845, 8630, 9493, 10442,
+  11487, 12635, 13899, 15289, 16818, 18500, 20350, 22385, 24623, 27086, 29794,
+  32767
+};
+
+internal const int8_t AUDIO_ADPCM_INDICES[16] = {
+  -1, -1, -1, -1, 2, 4, 6, 8, -1, -1, -1, -1, 2, 4, 6, 8
+};
+
+// The decoder's state for one channel
+typedef struct {
+  int32_t predictor;
+  int32_t index;
+} AUDIO_ADPCM_STATE;
+
+internal int16_t
+AUDIO_ADPCM_expand(AUDIO_ADPCM_STATE* state, uint8_t nibble) {
+  int32_t step = AUDIO_ADPCM_STEPS[state->index];
+  int32_t diff = step >> 3;
+  if (nibble & 4) {
+    diff += step;
+  }
+  if (nibble & 2) {
+    diff += step >> 1;
+  }
+  if (nibble & 1) {
+    diff += step >> 2;
+  }
+  state->predictor += (nibble & 8) ? -diff : diff;
+  state->predictor = mid(INT16_MIN, state->predictor, INT16_MAX);
+  state->index = mid(0, state->index + AUDIO_ADPCM_INDICES[nibble], 88);
+  return state->predictor;
+}
+
+// The nibble which brings the decoder closest to |sample|. The state moves
+// on exactly as the decoder's will.
+internal uint8_t
+AUDIO_ADPCM_compress(AUDIO_ADPCM_STATE* state, int16_t sample) {
+  int32_t step = AUDIO_ADPCM_STEPS[state->index];
+  int32_t diff = sample - state->predictor;
+  uint8_t nibble = 0;
+  if (diff < 0) {
+    nibble = 8;
+    diff = -diff;
+  }
+  if (diff >= step) {
+    nibble |= 4;
+    diff -= step;
+  }
+  if (diff >= step >> 1) {
+    nibble |= 2;
+    diff -= step >> 1;
+  }
+  if (diff >= step >> 2) {
+    nibble |= 1;
+  }
+  AUDIO_ADPCM_expand(state, nibble);
+  return nibble;
+}
+
+internal uint32_t
+AUDIO_ADPCM_framesPerBlock(uint16_t blockAlign, uint16_t channels) {
+  // A header of 4 bytes per channel, with the first frame, and then two
+  // frames per byte of each channel.
+  return (blockAlign - 4 * channels) * 2 / channels + 1;
+}
+
+// Decodes |block| into |out|, as interleaved frames
+internal void
+AUDIO_ADPCM_decodeBlock(const AUDIO_ADPCM* adpcm, uint32_t block, int16_t* out) {
+  const uint8_t* in = adpcm->blocks + (size_t)block * adpcm->blockAlign;
+  uint16_t channels = adpcm->channels;
+  AUDIO_ADPCM_STATE state[2];
+  for (int c = 0; c < channels; c++) {
+    state[c].predictor = (int16_t)(in[0] | (in[1] << 8));
+    state[c].index = min(in[2], 88);
+    out[c] = state[c].predictor;
+    in += 4;
+  }
+  // Channels take turns, four bytes (eight frames) at a time
+  for (uint32_t frame = 1; frame < adpcm->blockFrames; frame += 8) {
+    for (int c = 0; c < channels; c++) {
+      for (int i = 0; i < 4; i++) {
+        uint8_t byte = *in++;
+        out[(frame + i * 2) * channels + c] = AUDIO_ADPCM_expand(&state[c], byte & 0xF);
+        out[(frame + i * 2 + 1) * channels + c] = AUDIO_ADPCM_expand(&state[c], byte >> 4);
+      }
+    }
+  }
+}
+
+// Compresses |length| interleaved frames of |channels| 16-bit samples. The
+// last block is padded out with silence.
+internal AUDIO_ADPCM*
+AUDIO_ADPCM_encode(const int16_t* samples, uint32_t length, uint16_t channels) {
+  AUDIO_ADPCM* adpcm = calloc(1, sizeof(AUDIO_ADPCM));
+  adpcm->channels = channels;
+  adpcm->blockAlign = AUDIO_ADPCM_BLOCK_ALIGN * channels;
+  adpcm->blockFrames = AUDIO_ADPCM_framesPerBlock(adpcm->blockAlign, channels);
+  adpcm->blockCount = (length + adpcm->blockFrames - 1) / adpcm->blockFrames;
+  adpcm->blocks = malloc(max(1, (size_t)adpcm->blockCount * adpcm->blockAlign));
+
+  // The step size carries over from block to block, so it doesn't have to
+  // find its way back up from the smallest at every block.
+  AUDIO_ADPCM_STATE state[2] = { { 0, 0 }, { 0, 0 } };
+  for (uint32_t block = 0; block < adpcm->blockCount; block++) {
+    uint8_t* out = adpcm->blocks + (size_t)block * adpcm->blockAlign;
+    uint32_t start = block * adpcm->blockFrames;
+    for (int c = 0; c < channels; c++) {
+      state[c].predictor = samples[(size_t)start * channels + c];
+      out[0] = state[c].predictor & 0xFF;
+      out[1] = (state[c].predictor >> 8) & 0xFF;
+      out[2] = state[c].index;
+      out[3] = 0;
+      out += 4;
+    }
+    for (uint32_t frame = 1; frame < adpcm->blockFrames; frame += 8) {
+      for (int c = 0; c < channels; c++) {
+        for (int i = 0; i < 8; i++) {
+          uint32_t index = start + frame + i;
+          int16_t sample = index < length ? samples[(size_t)index * channels + c] : 0;
+          uint8_t nibble = AUDIO_ADPCM_compress(&state[c], sample);
+          if (i % 2 == 0) {
+            *out = nibble;
+          } else {
+            *out++ |= nibble << 4;
+          }
+        }
+      }
+    }
+  }
+  return adpcm;
+}
+
+// Expands all of |adpcm| back into interleaved frames, including the
+// padding at the end of the last block.
+internal int16_t*
+AUDIO_ADPCM_decode(const AUDIO_ADPCM* adpcm) {
+  int16_t* samples = malloc(sizeof(int16_t) * adpcm->channels * max(1, (size_t)adpcm->blockCount * adpcm->blockFrames));
+  for (uint32_t block = 0; block < adpcm->blockCount; block++) {
+    AUDIO_ADPCM_decodeBlock(adpcm, block, samples + (size_t)block * adpcm->blockFrames * adpcm->channels);
+  }
+  return samples;
+}
+
+internal void
+AUDIO_ADPCM_free(AUDIO_ADPCM* adpcm) {
+  if (adpcm != NULL) {
+    free(adpcm->blocks);
+    free(adpcm);
+  }
+}
+
+internal uint16_t
+AUDIO_ADPCM_readU16(const uint8_t* in) {
+  return in[0] | (in[1] << 8);
+}
+
+internal uint32_t
+AUDIO_ADPCM_readU32(const uint8_t* in) {
+  return AUDIO_ADPCM_readU16(in) | ((uint32_t)AUDIO_ADPCM_readU16(in + 2) << 16);
+}
+
+// Reads a WAV file which was saved as IMA-ADPCM, keeping the blocks as
+// they are. Returns NULL if the file holds anything else, and sets |error|
+// if it is IMA-ADPCM we can't play.
+internal AUDIO_ADPCM*
+AUDIO_ADPCM_readWav(const char* fileBuffer, size_t length, uint32_t* frames, uint32_t* rate, const char** error) {
+  const uint8_t* in = (const uint8_t*)fileBuffer;
+  const uint8_t* format = NULL;
+  const uint8_t* data = NULL;
+  uint32_t dataSize = 0;
+  uint32_t factFrames = 0;
+  size_t offset = 12;
+  while (offset + 8 <= length) {
+    uint32_t size = AUDIO_ADPCM_readU32(in + offset + 4);
+    const uint8_t* chunk = in + offset + 8;
+    size_t available = length - offset - 8;
+    if (memcmp(in + offset, "fmt ", 4) == 0 && size >= 16 && available >= 16) {
+      format = chunk;
+    } else if (memcmp(in + offset, "fact", 4) == 0 && size >= 4 && available >= 4) {
+      factFrames = AUDIO_ADPCM_readU32(chunk);
+    } else if (memcmp(in + offset, "data", 4) == 0) {
+      data = chunk;
+      dataSize = min(size, available);
+    }
+    // Chunks are padded to an even size
+    offset += 8 + (size_t)size + (size & 1);
+  }
+  if (format == NULL || AUDIO_ADPCM_readU16(format) != AUDIO_ADPCM_WAV_FORMAT) {
+    return NULL;
+  }
+
+  uint16_t channels = AUDIO_ADPCM_readU16(format + 2);
+  uint16_t blockAlign = AUDIO_ADPCM_readU16(format + 12);
+  uint16_t bits = AUDIO_ADPCM_readU16(format + 14);
+  if (channels < 1 || channels > 2 || bits != 4 || blockAlign <= 4 * channels ||
+      blockAlign % (4 * channels) != 0 || data == NULL) {
+    *error = "Unsupported IMA-ADPCM WAV file";
+    return NULL;
+  }
+  // A partial block at the end can't be decoded, so it is dropped
+  if (dataSize / blockAlign == 0) {
+    *error = "IMA-ADPCM WAV file has no complete blocks";
+    return NULL;
+  }
+
+  AUDIO_ADPCM* adpcm = calloc(1, sizeof(AUDIO_ADPCM));
+  adpcm->channels = channels;
+  adpcm->blockAlign = blockAlign;
+  adpcm->blockFrames = AUDIO_ADPCM_framesPerBlock(blockAlign, channels);
+  adpcm->blockCount = dataSize / blockAlign;
+  adpcm->blocks = malloc(max(1, (size_t)adpcm->blockCount * blockAlign));
+  memcpy(adpcm->blocks, data, (size_t)adpcm->blockCount * blockAlign);
+  *frames = adpcm->blockCount * adpcm->blockFrames;
+  if (factFrames > 0) {
+    *frames = min(*frames, factFrames);
+  }
+  *rate = AUDIO_ADPCM_readU32(format + 4);
+  return adpcm;
+}
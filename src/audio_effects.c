@@ -0,0 +1,393 @@
+// Effects which can be applied to a bus of the mixer. They work on blocks
+// of float stereo, and keep whatever state they need between blocks.
+
+typedef enum {
+  AUDIO_EFFECT_NONE,
+  AUDIO_EFFECT_ONE_POLE_LOW_PASS,
+  AUDIO_EFFECT_ONE_POLE_HIGH_PASS,
+  AUDIO_EFFECT_LOW_PASS,
+  AUDIO_EFFECT_HIGH_PASS,
+  AUDIO_EFFECT_BAND_PASS,
+  AUDIO_EFFECT_DELAY,
+  AUDIO_EFFECT_REVERB,
+  AUDIO_EFFECT_COMPRESSOR,
+  AUDIO_EFFECT_LIMITER,
+  AUDIO_EFFECT_LAST
+} AUDIO_EFFECT_TYPE;
+
+#define AUDIO_EFFECT_MAX_PARAMS 5
+
+// Parameters, in the order scripts give them. These match AudioEffect.
+enum { AUDIO_FILTER_CUTOFF, AUDIO_FILTER_Q };
+enum { AUDIO_DELAY_TIME, AUDIO_DELAY_FEEDBACK, AUDIO_DELAY_MIX };
+enum { AUDIO_REVERB_ROOM_SIZE, AUDIO_REVERB_DAMPING, AUDIO_REVERB_MIX };
+enum { AUDIO_COMPRESSOR_THRESHOLD, AUDIO_COMPRESSOR_RATIO, AUDIO_COMPRESSOR_ATTACK, AUDIO_COMPRESSOR_RELEASE, AUDIO_COMPRESSOR_MAKEUP };
+enum { AUDIO_LIMITER_THRESHOLD, AUDIO_LIMITER_RELEASE };
+
+// The reverb is a small Schroeder-Moorer design: for each side, parallel
+// damped comb filters feeding allpass filters in series. Line lengths are
+// in frames at 44.1kHz, and the right side is spread slightly apart.
+#define AUDIO_REVERB_COMBS 4
+#define AUDIO_REVERB_ALLPASSES 2
+#define AUDIO_REVERB_SPREAD 23
+global_variable const uint32_t AUDIO_REVERB_COMB_TUNING[AUDIO_REVERB_COMBS] = { 1116, 1188, 1277, 1356 };
+global_variable const uint32_t AUDIO_REVERB_ALLPASS_TUNING[AUDIO_REVERB_ALLPASSES] = { 556, 441 };
+#define AUDIO_EFFECT_MAX_LINES (2 * (AUDIO_REVERB_COMBS + AUDIO_REVERB_ALLPASSES))
+
+typedef struct {
+  float* buffer;
+  uint32_t length;
+  uint32_t cursor;
+} AUDIO_DELAY_LINE;
+
+typedef struct {
+  AUDIO_EFFECT_TYPE type;
+  uint32_t rate;
+  float params[AUDIO_EFFECT_MAX_PARAMS];
+
+  // Filter coefficients, worked out from the parameters, and the state
+  // of the filter for each side.
+  float coeffs[5];
+  float state[2][2];
+
+  // Delay and reverb
+  AUDIO_DELAY_LINE lines[AUDIO_EFFECT_MAX_LINES];
+  uint32_t lineCount;
+  // The longest the delay can be set to, which is fixed when it is created
+  float maxTime;
+  float damping[2 * AUDIO_REVERB_COMBS];
+
+  // Compressor and limiter
+  float envelope;
+} AUDIO_EFFECT;
+
+internal uint32_t
+AUDIO_EFFECT_paramCount(AUDIO_EFFECT_TYPE type) {
+  switch (type) {
+    case AUDIO_EFFECT_ONE_POLE_LOW_PASS:
+    case AUDIO_EFFECT_ONE_POLE_HIGH_PASS:
+      return 1;
+    case AUDIO_EFFECT_LOW_PASS:
+    case AUDIO_EFFECT_HIGH_PASS:
+    case AUDIO_EFFECT_BAND_PASS:
+    case AUDIO_EFFECT_LIMITER:
+      return 2;
+    case AUDIO_EFFECT_DELAY:
+    case AUDIO_EFFECT_REVERB:
+      return 3;
+    case AUDIO_EFFECT_COMPRESSOR:
+      return 5;
+    default:
+      return 0;
+  }
+}
+
+// Time constant for an envelope which moves most of the way over |seconds|
+internal float
+AUDIO_EFFECT_timeCoefficient(float seconds, uint32_t rate) {
+  return expf(-1.0f / (max(seconds, 0.0001) * rate));
+}
+
+// Works out the coefficients from the parameters. This doesn't allocate,
+// so the mixer can call it when a parameter changes.
+internal void
+AUDIO_EFFECT_update(AUDIO_EFFECT* effect) {
+  float* p = effect->params;
+  float* c = effect->coeffs;
+  float rate = effect->rate;
+  switch (effect->type) {
+    case AUDIO_EFFECT_ONE_POLE_LOW_PASS:
+    case AUDIO_EFFECT_ONE_POLE_HIGH_PASS:
+      {
+        float cutoff = mid(10, p[AUDIO_FILTER_CUTOFF], rate * 0.45);
+        c[0] = 1 - expf(-2 * M_PI * cutoff / rate);
+      } break;
+    case AUDIO_EFFECT_LOW_PASS:
+    case AUDIO_EFFECT_HIGH_PASS:
+    case AUDIO_EFFECT_BAND_PASS:
+      {
+        // From the Audio EQ Cookbook, normalised so a0 is 1
+        float cutoff = mid(10, p[AUDIO_FILTER_CUTOFF], rate * 0.45);
+        float q = max(0.05, p[AUDIO_FILTER_Q]);
+        float w0 = 2 * M_PI * cutoff / rate;
+        float cosW0 = cosf(w0);
+        float alpha = sinf(w0) / (2 * q);
+        float a0 = 1 + alpha;
+        if (effect->type == AUDIO_EFFECT_LOW_PASS) {
+          c[0] = (1 - cosW0) / 2 / a0;
+          c[1] = (1 - cosW0) / a0;
+          c[2] = c[0];
+        } else if (effect->type == AUDIO_EFFECT_HIGH_PASS) {
+          c[0] = (1 + cosW0) / 2 / a0;
+          c[1] = -(1 + cosW0) / a0;
+          c[2] = c[0];
+        } else {
+          c[0] = alpha / a0;
+          c[1] = 0;
+          c[2] = -alpha / a0;
+        }
+        c[3] = -2 * cosW0 / a0;
+        c[4] = (1 - alpha) / a0;
+      } break;
+    case AUDIO_EFFECT_DELAY:
+      c[0] = mid(1, p[AUDIO_DELAY_TIME] * rate, effect->lines[0].length);
+      c[1] = mid(0, p[AUDIO_DELAY_FEEDBACK], 0.95);
+      c[2] = mid(0, p[AUDIO_DELAY_MIX], 1);
+      break;
+    case AUDIO_EFFECT_REVERB:
+      // Past about 0.98, the combs ring forever
+      c[0] = 0.7 + 0.28 * mid(0, p[AUDIO_REVERB_ROOM_SIZE], 1);
+      c[1] = 0.4 * mid(0, p[AUDIO_REVERB_DAMPING], 1);
+      c[2] = mid(0, p[AUDIO_REVERB_MIX], 1);
+      break;
+    case AUDIO_EFFECT_COMPRESSOR:
+      c[0] = p[AUDIO_COMPRESSOR_THRESHOLD];
+      c[1] = 1 - 1 / max(1, p[AUDIO_COMPRESSOR_RATIO]);
+      c[2] = AUDIO_EFFECT_timeCoefficient(p[AUDIO_COMPRESSOR_ATTACK], effect->rate);
+      c[3] = AUDIO_EFFECT_timeCoefficient(p[AUDIO_COMPRESSOR_RELEASE], effect->rate);
+      c[4] = p[AUDIO_COMPRESSOR_MAKEUP];
+      break;
+    case AUDIO_EFFECT_LIMITER:
+      c[0] = powf(10, min(0, p[AUDIO_LIMITER_THRESHOLD]) / 20);
+      c[1] = AUDIO_EFFECT_timeCoefficient(p[AUDIO_LIMITER_RELEASE], effect->rate);
+      break;
+    default:
+      break;
+  }
+}
+
+internal void
+AUDIO_EFFECT_freeLines(AUDIO_EFFECT* effect) {
+  for (uint32_t i = 0; i < effect->lineCount; i++) {
+    free(effect->lines[i].buffer);
+  }
+  effect->lineCount = 0;
+}
+
+internal void
+AUDIO_EFFECT_addLine(AUDIO_EFFECT* effect, uint32_t length) {
+  AUDIO_DELAY_LINE* line = &effect->lines[effect->lineCount++];
+  line->length = max(1, length);
+  line->buffer = calloc(line->length, sizeof(float));
+  line->cursor = 0;
+}
+
+// Sets up the effect for audio at |rate|, which clears its state. This
+// allocates, so it must not be called while the mixer can see the effect.
+internal void
+AUDIO_EFFECT_prepare(AUDIO_EFFECT* effect, uint32_t rate) {
+  effect->rate = rate;
+  AUDIO_EFFECT_freeLines(effect);
+  memset(effect->state, 0, sizeof(effect->state));
+  memset(effect->damping, 0, sizeof(effect->damping));
+  effect->envelope = 0;
+  if (effect->type == AUDIO_EFFECT_DELAY) {
+    uint32_t length = ceil(effect->maxTime * rate) + 1;
+    AUDIO_EFFECT_addLine(effect, length);
+    AUDIO_EFFECT_addLine(effect, length);
+  } else if (effect->type == AUDIO_EFFECT_REVERB) {
+    double scale = rate / 44100.0;
+    for (int side = 0; side < 2; side++) {
+      uint32_t spread = side * AUDIO_REVERB_SPREAD;
+      for (int i = 0; i < AUDIO_REVERB_COMBS; i++) {
+        AUDIO_EFFECT_addLine(effect, (AUDIO_REVERB_COMB_TUNING[i] + spread) * scale);
+      }
+      for (int i = 0; i < AUDIO_REVERB_ALLPASSES; i++) {
+        AUDIO_EFFECT_addLine(effect, (AUDIO_REVERB_ALLPASS_TUNING[i] + spread) * scale);
+      }
+    }
+  }
+  AUDIO_EFFECT_update(effect);
+}
+
+internal AUDIO_EFFECT*
+AUDIO_EFFECT_new(AUDIO_EFFECT_TYPE type, const float* params, uint32_t rate) {
+  AUDIO_EFFECT* effect = calloc(1, sizeof(AUDIO_EFFECT));
+  effect->type = type;
+  memcpy(effect->params, params, sizeof(float) * AUDIO_EFFECT_paramCount(type));
+  if (type == AUDIO_EFFECT_DELAY) {
+    // The delay can be changed later, up to a second or the time it
+    // started with, whichever is longer
+    effect->maxTime = mid(1, params[AUDIO_DELAY_TIME], 10);
+  }
+  AUDIO_EFFECT_prepare(effect, rate);
+  return effect;
+}
+
+internal void
+AUDIO_EFFECT_free(AUDIO_EFFECT* effect) {
+  AUDIO_EFFECT_freeLines(effect);
+  free(effect);
+}
+
+// Mixer side
+internal void
+AUDIO_EFFECT_setParam(AUDIO_EFFECT* effect, uint32_t index, float value) {
+  if (index < AUDIO_EFFECT_paramCount(effect->type)) {
+    effect->params[index] = value;
+    AUDIO_EFFECT_update(effect);
+  }
+}
+
+internal void
+AUDIO_EFFECT_onePole(AUDIO_EFFECT* effect, float* buffer, uint32_t frames) {
+  float a = effect->coeffs[0];
+  bool highPass = effect->type == AUDIO_EFFECT_ONE_POLE_HIGH_PASS;
+  for (int c = 0; c < 2; c++) {
+    float y = effect->state[c][0];
+    for (uint32_t i = 0; i < frames; i++) {
+      float x = buffer[i * 2 + c];
+      y += a * (x - y);
+      buffer[i * 2 + c] = highPass ? x - y : y;
+    }
+    effect->state[c][0] = y;
+  }
+}
+
+// Transposed direct form II, which keeps two values of state per side
+internal void
+AUDIO_EFFECT_biquad(AUDIO_EFFECT* effect, float* buffer, uint32_t frames) {
+  const float* k = effect->coeffs;
+  for (int c = 0; c < 2; c++) {
+    float z1 = effect->state[c][0];
+    float z2 = effect->state[c][1];
+    for (uint32_t i = 0; i < frames; i++) {
+      float x = buffer[i * 2 + c];
+      float y = k[0] * x + z1;
+      z1 = k[1] * x - k[3] * y + z2;
+      z2 = k[2] * x - k[4] * y;
+      buffer[i * 2 + c] = y;
+    }
+    effect->state[c][0] = z1;
+    effect->state[c][1] = z2;
+  }
+}
+
+internal void
+AUDIO_EFFECT_delay(AUDIO_EFFECT* effect, float* buffer, uint32_t frames) {
+  uint32_t delay = effect->coeffs[0];
+  float feedback = effect->coeffs[1];
+  float wet = effect->coeffs[2];
+  for (int c = 0; c < 2; c++) {
+    AUDIO_DELAY_LINE* line = &effect->lines[c];
+    uint32_t cursor = line->cursor;
+    for (uint32_t i = 0; i < frames; i++) {
+      float x = buffer[i * 2 + c];
+      uint32_t tap = cursor >= delay ? cursor - delay : cursor + line->length - delay;
+      float echo = line->buffer[tap];
+      line->buffer[cursor] = x + echo * feedback;
+      buffer[i * 2 + c] = x + (echo - x) * wet;
+      cursor = cursor + 1 == line->length ? 0 : cursor + 1;
+    }
+    line->cursor = cursor;
+  }
+}
+
+internal void
+AUDIO_EFFECT_reverb(AUDIO_EFFECT* effect, float* buffer, uint32_t frames) {
+  float feedback = effect->coeffs[0];
+  float damping = effect->coeffs[1];
+  float wet = effect->coeffs[2];
+  uint32_t linesPerSide = AUDIO_REVERB_COMBS + AUDIO_REVERB_ALLPASSES;
+  for (uint32_t i = 0; i < frames; i++) {
+    // Both sides are fed the same input, and the spread decorrelates them
+    float input = (buffer[i * 2] + buffer[i * 2 + 1]) * 0.015f;
+    for (int c = 0; c < 2; c++) {
+      AUDIO_DELAY_LINE* lines = effect->lines + c * linesPerSide;
+      float* store = effect->damping + c * AUDIO_REVERB_COMBS;
+      float out = 0;
+      for (int k = 0; k < AUDIO_REVERB_COMBS; k++) {
+        AUDIO_DELAY_LINE* line = &lines[k];
+        float delayed = line->buffer[line->cursor];
+        store[k] = delayed * (1 - damping) + store[k] * damping;
+        line->buffer[line->cursor] = input + store[k] * feedback;
+        line->cursor = line->cursor + 1 == line->length ? 0 : line->cursor + 1;
+        out += delayed;
+      }
+      for (int k = 0; k < AUDIO_REVERB_ALLPASSES; k++) {
+        AUDIO_DELAY_LINE* line = &lines[AUDIO_REVERB_COMBS + k];
+        float delayed = line->buffer[line->cursor];
+        line->buffer[line->cursor] = out + delayed * 0.5f;
+        line->cursor = line->cursor + 1 == line->length ? 0 : line->cursor + 1;
+        out = delayed - out;
+      }
+      // The input was scaled down to keep the combs stable, so make up
+      // most of that on the way out
+      float x = buffer[i * 2 + c];
+      buffer[i * 2 + c] = x * (1 - wet) + out * wet * 3;
+    }
+  }
+}
+
+// The level is followed by a peak envelope across both sides, so the
+// stereo image doesn't shift as the gain changes.
+internal void
+AUDIO_EFFECT_compressor(AUDIO_EFFECT* effect, float* buffer, uint32_t frames) {
+  float threshold = effect->coeffs[0];
+  float slope = effect->coeffs[1];
+  float attack = effect->coeffs[2];
+  float release = effect->coeffs[3];
+  float makeup = effect->coeffs[4];
+  float envelope = effect->envelope;
+  for (uint32_t i = 0; i < frames; i++) {
+    float level = max(fabsf(buffer[i * 2]), fabsf(buffer[i * 2 + 1]));
+    float k = level > envelope ? attack : release;
+    envelope = level + k * (envelope - level);
+    float levelDb = 20 * log10f(max(envelope, 1e-6));
+    float gainDb = makeup;
+    if (levelDb > threshold) {
+      gainDb -= (levelDb - threshold) * slope;
+    }
+    float gain = powf(10, gainDb / 20);
+    buffer[i * 2] *= gain;
+    buffer[i * 2 + 1] *= gain;
+  }
+  effect->envelope = envelope;
+}
+
+// A limiter reacts instantly, so nothing gets past the threshold
+internal void
+AUDIO_EFFECT_limiter(AUDIO_EFFECT* effect, float* buffer, uint32_t frames) {
+  float threshold = effect->coeffs[0];
+  float release = effect->coeffs[1];
+  float envelope = effect->envelope;
+  for (uint32_t i = 0; i < frames; i++) {
+    float level = max(fabsf(buffer[i * 2]), fabsf(buffer[i * 2 + 1]));
+    envelope = max(level, envelope * release);
+    if (envelope > threshold) {
+      float gain = threshold / envelope;
+      buffer[i * 2] *= gain;
+      buffer[i * 2 + 1] *= gain;
+    }
+  }
+  effect->envelope = envelope;
+}
+
+internal void
+AUDIO_EFFECT_process(AUDIO_EFFECT* effect, float* buffer, uint32_t frames) {
+  switch (effect->type) {
+    case AUDIO_EFFECT_ONE_POLE_LOW_PASS:
+    case AUDIO_EFFECT_ONE_POLE_HIGH_PASS:
+      AUDIO_EFFECT_onePole(effect, buffer, frames);
+      break;
+    case AUDIO_EFFECT_LOW_PASS:
+    case AUDIO_EFFECT_HIGH_PASS:
+    case AUDIO_EFFECT_BAND_PASS:
+      AUDIO_EFFECT_biquad(effect, buffer, frames);
+      break;
+    case AUDIO_EFFECT_DELAY:
+      AUDIO_EFFECT_delay(effect, buffer, frames);
+      break;
+    case AUDIO_EFFECT_REVERB:
+      AUDIO_EFFECT_reverb(effect, buffer, frames);
+      break;
+    case AUDIO_EFFECT_COMPRESSOR:
+      AUDIO_EFFECT_compressor(effect, buffer, frames);
+      break;
+    case AUDIO_EFFECT_LIMITER:
+      AUDIO_EFFECT_limiter(effect, buffer, frames);
+      break;
+    default:
+      break;
+  }
+}
@@ -0,0 +1,719 @@
+// Plays ProTracker-style MOD music. The module is parsed once when it is
+// loaded, and each channel playing it has a player of its own, which
+// sequences the patterns and renders the instruments straight into the
+// bus, like a synth voice.
+
+#define AUDIO_MODULE_SAMPLES 31
+#define AUDIO_MODULE_ORDERS 128
+#define AUDIO_MODULE_ROWS 64
+#define AUDIO_MODULE_MAX_CHANNELS 32
+#define AUDIO_MODULE_HEADER_SIZE 1084
+// Half the PAL Amiga clock: a period of P plays 3546894.6 / P samples a second
+#define AUDIO_MODULE_CLOCK 3546894.6
+#define AUDIO_MODULE_MIN_PERIOD 113
+#define AUDIO_MODULE_MAX_PERIOD 856
+// Songs which never end (or loop back on themselves) are only measured up to this
+#define AUDIO_MODULE_MAX_SECONDS 3600
+
+typedef struct {
+  int8_t* data;
+  uint32_t length;
+  uint32_t loopStart;
+  uint32_t loopLength;
+  // -8 to 7, in eighths of a semitone
+  int8_t finetune;
+  uint8_t volume;
+} AUDIO_MODULE_SAMPLE;
+
+// Module data never changes once loaded, so players on the mixer thread
+// can share it.
+typedef struct {
+  char title[21];
+  uint8_t channelCount;
+  uint8_t songLength;
+  uint8_t restart;
+  uint8_t orders[AUDIO_MODULE_ORDERS];
+  uint8_t patternCount;
+  // Four bytes per note, |channelCount| notes per row, 64 rows per pattern
+  uint8_t* patterns;
+  AUDIO_MODULE_SAMPLE samples[AUDIO_MODULE_SAMPLES];
+  // How long the song plays for before it ends, or comes back round
+  double seconds;
+} AUDIO_MODULE;
+
+typedef struct {
+  // The instrument notes are played with, and the one playing now
+  const AUDIO_MODULE_SAMPLE* instrument;
+  const AUDIO_MODULE_SAMPLE* sample;
+  bool active;
+  // 32.32 fixed point, in frames of the sample, and how far it moves on
+  // for each output frame.
+  uint64_t cursor;
+  uint64_t step;
+  // Periods as the pattern gives them, and as this tick plays them after
+  // arpeggio and vibrato.
+  int period;
+  int playPeriod;
+  int volume;
+  int playVolume;
+  // 0 is hard left, 1 hard right
+  float pan;
+
+  uint8_t effect;
+  uint8_t param;
+  // Effects remember their last parameters, for when they are given as 0
+  int portaTarget;
+  uint8_t portaSpeed;
+  uint8_t vibratoSpeed;
+  uint8_t vibratoDepth;
+  uint8_t vibratoPos;
+  uint8_t tremoloSpeed;
+  uint8_t tremoloDepth;
+  uint8_t tremoloPos;
+  uint8_t offset;
+  uint8_t loopRow;
+  uint8_t loopCount;
+  // A note held back by a note delay
+  uint8_t delayedSample;
+  int delayedPeriod;
+} AUDIO_MODULE_VOICE;
+
+typedef struct {
+  const AUDIO_MODULE* module;
+  uint32_t rate;
+  bool loop;
+  bool ended;
+  uint32_t speed;
+  uint32_t tempo;
+  uint32_t tick;
+  int order;
+  int row;
+  // Rows left to repeat for a pattern delay, and whether this is one
+  uint32_t delayRows;
+  bool repeatRow;
+  // Where the song goes after this row, if a note asked it to jump
+  bool jump;
+  int jumpOrder;
+  int breakRow;
+  int loopJump;
+  // Frames left in this tick, and the fraction of a frame carried over
+  uint32_t tickFrames;
+  double tickRemainder;
+  // Frames played, so a song which doesn't loop stops where it was measured to
+  uint64_t elapsed;
+  uint64_t endFrame;
+  AUDIO_MODULE_VOICE voices[AUDIO_MODULE_MAX_CHANNELS];
+  // The order and row playing, published by the mixer as (order << 8) | row
+  SDL_atomic_t songPosition;
+} AUDIO_MODULE_PLAYER;
+
+internal const uint8_t AUDIO_MODULE_SINE[32] = {
+  0, 24, 49, 74, 97, 120, 141, 161, 180, 197, 212, 224, 235, 244, 250, 253,
+  255, 253, 250, 244, 235, 224, 212, 197, 180, 161, 141, 120, 97, 74, 49, 24
+};
+
+internal uint16_t
+AUDIO_MODULE_readU16(const uint8_t* in) {
+  return (in[0] << 8) | in[1];
+}
+
+// The number of channels a module's signature stands for, or 0 if it
+// isn't one we know.
+internal uint8_t
+AUDIO_MODULE_channelsFor(const char* tag) {
+  if (memcmp(tag, "M.K.", 4) == 0 || memcmp(tag, "M!K!", 4) == 0 ||
+      memcmp(tag, "FLT4", 4) == 0 || memcmp(tag, "4CHN", 4) == 0) {
+    return 4;
+  }
+  if (memcmp(tag, "FLT8", 4) == 0 || memcmp(tag, "OCTA", 4) == 0 || memcmp(tag, "CD81", 4) == 0) {
+    return 8;
+  }
+  if (isdigit(tag[0]) && memcmp(tag + 1, "CHN", 3) == 0) {
+    return tag[0] - '0';
+  }
+  if (isdigit(tag[0]) && isdigit(tag[1]) && memcmp(tag + 2, "CH", 2) == 0) {
+    return (tag[0] - '0') * 10 + (tag[1] - '0');
+  }
+  return 0;
+}
+
+internal bool
+AUDIO_MODULE_detect(const char* fileBuffer, size_t length) {
+  return length >= AUDIO_MODULE_HEADER_SIZE && AUDIO_MODULE_channelsFor(fileBuffer + 1080) > 0;
+}
+
+internal const uint8_t*
+AUDIO_MODULE_note(const AUDIO_MODULE* module, int order, int row, int channel) {
+  size_t pattern = module->orders[order];
+  return module->patterns + ((pattern * AUDIO_MODULE_ROWS + row) * module->channelCount + channel) * 4;
+}
+
+internal void
+AUDIO_MODULE_free(AUDIO_MODULE* module) {
+  if (module != NULL) {
+    free(module->patterns);
+    free(module->samples[0].data);
+    free(module);
+  }
+}
+
+// Steps the song on by one row, following any jump asked for on the row
+// just played.
+internal void
+AUDIO_MODULE_PLAYER_nextRow(AUDIO_MODULE_PLAYER* player) {
+  const AUDIO_MODULE* module = player->module;
+  if (player->loopJump >= 0) {
+    // A pattern loop stays in the same pattern
+    player->row = player->loopJump;
+  } else if (player->jump) {
+    player->order = player->jumpOrder >= 0 ? player->jumpOrder : player->order + 1;
+    player->row = player->breakRow;
+  } else if (++player->row >= AUDIO_MODULE_ROWS) {
+    player->row = 0;
+    player->order++;
+  }
+  player->loopJump = -1;
+  player->jump = false;
+  player->jumpOrder = -1;
+  player->breakRow = 0;
+  if (player->order >= module->songLength) {
+    if (player->loop) {
+      player->order = module->restart < module->songLength ? module->restart : 0;
+    } else {
+      player->ended = true;
+    }
+  }
+}
+
+internal void
+AUDIO_MODULE_VOICE_trigger(AUDIO_MODULE_VOICE* voice, int period) {
+  voice->period = period;
+  voice->sample = voice->instrument;
+  voice->cursor = 0;
+  voice->vibratoPos = 0;
+  voice->tremoloPos = 0;
+  voice->active = voice->sample != NULL && voice->sample->length > 0;
+  if (voice->effect == 0x9) {
+    if (voice->param != 0) {
+      voice->offset = voice->param;
+    }
+    uint32_t offset = voice->offset * 256;
+    if (voice->active && offset >= voice->sample->length) {
+      voice->active = false;
+    }
+    voice->cursor = (uint64_t)offset << 32;
+  }
+}
+
+internal void
+AUDIO_MODULE_VOICE_selectSample(const AUDIO_MODULE* module, AUDIO_MODULE_VOICE* voice, uint8_t number) {
+  if (number > 0 && number <= AUDIO_MODULE_SAMPLES) {
+    voice->instrument = &module->samples[number - 1];
+    voice->volume = voice->instrument->volume;
+  }
+}
+
+internal void
+AUDIO_MODULE_VOICE_slideVolume(AUDIO_MODULE_VOICE* voice, uint8_t param) {
+  if (param >> 4) {
+    voice->volume = min(64, voice->volume + (param >> 4));
+  } else {
+    voice->volume = max(0, voice->volume - (param & 0xF));
+  }
+}
+
+internal void
+AUDIO_MODULE_VOICE_tonePorta(AUDIO_MODULE_VOICE* voice) {
+  if (voice->portaTarget == 0) {
+    return;
+  }
+  if (voice->period < voice->portaTarget) {
+    voice->period = min(voice->period + voice->portaSpeed, voice->portaTarget);
+  } else if (voice->period > voice->portaTarget) {
+    voice->period = max(voice->period - voice->portaSpeed, voice->portaTarget);
+  }
+  voice->playPeriod = voice->period;
+}
+
+internal void
+AUDIO_MODULE_VOICE_vibrato(AUDIO_MODULE_VOICE* voice) {
+  int delta = AUDIO_MODULE_SINE[voice->vibratoPos & 31] * voice->vibratoDepth / 128;
+  voice->playPeriod = voice->period + ((voice->vibratoPos & 32) ? -delta : delta);
+  voice->vibratoPos = (voice->vibratoPos + voice->vibratoSpeed) & 63;
+}
+
+// Reads the notes of the current row, and applies the effects which only
+// happen on its first tick.
+internal void
+AUDIO_MODULE_PLAYER_startRow(AUDIO_MODULE_PLAYER* player) {
+  const AUDIO_MODULE* module = player->module;
+  SDL_AtomicSet(&player->songPosition, (player->order << 8) | player->row);
+  for (int c = 0; c < module->channelCount; c++) {
+    AUDIO_MODULE_VOICE* voice = &player->voices[c];
+    const uint8_t* note = AUDIO_MODULE_note(module, player->order, player->row, c);
+    uint8_t number = (note[0] & 0xF0) | (note[2] >> 4);
+    int period = ((note[0] & 0x0F) << 8) | note[1];
+    uint8_t effect = note[2] & 0x0F;
+    uint8_t param = note[3];
+    uint8_t x = param >> 4;
+    uint8_t y = param & 0xF;
+    voice->effect = effect;
+    voice->param = param;
+
+    if (effect == 0xE && x == 0xD && y > 0) {
+      voice->delayedSample = number;
+      voice->delayedPeriod = period;
+    } else {
+      AUDIO_MODULE_VOICE_selectSample(module, voice, number);
+      if (period > 0) {
+        if (effect == 0x3 || effect == 0x5) {
+          voice->portaTarget = period;
+        } else {
+          AUDIO_MODULE_VOICE_trigger(voice, period);
+        }
+      }
+    }
+
+    switch (effect) {
+      case 0x3:
+        if (param != 0) {
+          voice->portaSpeed = param;
+        }
+        break;
+      case 0x4:
+        if (x != 0) {
+          voice->vibratoSpeed = x;
+        }
+        if (y != 0) {
+          voice->vibratoDepth = y;
+        }
+        break;
+      case 0x7:
+        if (x != 0) {
+          voice->tremoloSpeed = x;
+        }
+        if (y != 0) {
+          voice->tremoloDepth = y;
+        }
+        break;
+      case 0xB:
+        player->jump = true;
+        player->jumpOrder = param;
+        break;
+      case 0xC:
+        voice->volume = min(64, param);
+        break;
+      case 0xD:
+        player->jump = true;
+        // The row is given in decimal
+        player->breakRow = x * 10 + y;
+        if (player->breakRow >= AUDIO_MODULE_ROWS) {
+          player->breakRow = 0;
+        }
+        break;
+      case 0xE:
+        switch (x) {
+          case 0x1:
+            voice->period = max(AUDIO_MODULE_MIN_PERIOD, voice->period - y);
+            break;
+          case 0x2:
+            voice->period = min(AUDIO_MODULE_MAX_PERIOD, voice->period + y);
+            break;
+          case 0x6:
+            if (y == 0) {
+              voice->loopRow = player->row;
+            } else if (voice->loopCount == 0) {
+              voice->loopCount = y;
+              player->loopJump = voice->loopRow;
+            } else if (--voice->loopCount > 0) {
+              player->loopJump = voice->loopRow;
+            }
+            break;
+          case 0xA:
+            voice->volume = min(64, voice->volume + y);
+            break;
+          case 0xB:
+            voice->volume = max(0, voice->volume - y);
+            break;
+          case 0xC:
+            if (y == 0) {
+              voice->volume = 0;
+            }
+            break;
+          case 0xE:
+            if (!player->repeatRow) {
+              player->delayRows = y;
+            }
+            break;
+        }
+        break;
+      case 0xF:
+        // A speed of 0 would stop the song, which we leave to the game
+        if (param > 0 && param < 32) {
+          player->speed = param;
+        } else if (param >= 32) {
+          player->tempo = param;
+        }
+        break;
+    }
+  }
+}
+
+// The effects which carry on through the rest of the row's ticks
+internal void
+AUDIO_MODULE_PLAYER_continueRow(AUDIO_MODULE_PLAYER* player) {
+  const AUDIO_MODULE* module = player->module;
+  for (int c = 0; c < module->channelCount; c++) {
+    AUDIO_MODULE_VOICE* voice = &player->voices[c];
+    uint8_t param = voice->param;
+    uint8_t x = param >> 4;
+    uint8_t y = param & 0xF;
+    switch (voice->effect) {
+      case 0x0:
+        if (param != 0) {
+          int semitones = (int[]){ 0, x, y }[player->tick % 3];
+          voice->playPeriod = voice->period / pow(2.0, semitones / 12.0);
+        }
+        break;
+      case 0x1:
+        voice->period = max(AUDIO_MODULE_MIN_PERIOD, voice->period - param);
+        voice->playPeriod = voice->period;
+        break;
+      case 0x2:
+        voice->period = min(AUDIO_MODULE_MAX_PERIOD, voice->period + param);
+        voice->playPeriod = voice->period;
+        break;
+      case 0x3:
+        AUDIO_MODULE_VOICE_tonePorta(voice);
+        break;
+      case 0x4:
+        AUDIO_MODULE_VOICE_vibrato(voice);
+        break;
+      case 0x5:
+        AUDIO_MODULE_VOICE_tonePorta(voice);
+        AUDIO_MODULE_VOICE_slideVolume(voice, param);
+        break;
+      case 0x6:
+        AUDIO_MODULE_VOICE_vibrato(voice);
+        AUDIO_MODULE_VOICE_slideVolume(voice, param);
+        break;
+      case 0x7:
+        {
+          int delta = AUDIO_MODULE_SINE[voice->tremoloPos & 31] * voice->tremoloDepth / 64;
+          voice->playVolume = mid(0, voice->volume + ((voice->tremoloPos & 32) ? -delta : delta), 64);
+          voice->tremoloPos = (voice->tremoloPos + voice->tremoloSpeed) & 63;
+        }
+        break;
+      case 0xA:
+        AUDIO_MODULE_VOICE_slideVolume(voice, param);
+        break;
+      case 0xE:
+        if (x == 0x9 && y > 0 && player->tick % y == 0) {
+          voice->cursor = 0;
+          voice->active = voice->sample != NULL && voice->sample->length > 0;
+        } else if (x == 0xC && player->tick == y) {
+          voice->volume = 0;
+        } else if (x == 0xD && player->tick == y) {
+          AUDIO_MODULE_VOICE_selectSample(module, voice, voice->delayedSample);
+          if (voice->delayedPeriod > 0) {
+            AUDIO_MODULE_VOICE_trigger(voice, voice->delayedPeriod);
+          }
+        }
+        break;
+    }
+  }
+}
+
+// Plays one tick of the song, and works out how long it lasts
+internal void
+AUDIO_MODULE_PLAYER_tick(AUDIO_MODULE_PLAYER* player) {
+  const AUDIO_MODULE* module = player->module;
+  for (int c = 0; c < module->channelCount; c++) {
+    player->voices[c].playPeriod = player->voices[c].period;
+  }
+  if (player->tick == 0) {
+    if (!player->repeatRow) {
+      AUDIO_MODULE_PLAYER_startRow(player);
+    }
+  } else {
+    AUDIO_MODULE_PLAYER_continueRow(player);
+  }
+
+  for (int c = 0; c < module->channelCount; c++) {
+    AUDIO_MODULE_VOICE* voice = &player->voices[c];
+    if (voice->effect != 0x7) {
+      voice->playVolume = voice->volume;
+    }
+    if (voice->sample != NULL && voice->playPeriod > 0) {
+      double frequency = AUDIO_MODULE_CLOCK / voice->playPeriod * pow(2.0, voice->sample->finetune / 96.0);
+      voice->step = frequency / player->rate * AUDIO_RATE_ONE;
+    }
+  }
+
+  // A tick lasts 2.5 / tempo seconds
+  double frames = player->rate * 2.5 / player->tempo + player->tickRemainder;
+  player->tickFrames = max(1, (uint32_t)frames);
+  player->tickRemainder = frames - player->tickFrames;
+
+  if (++player->tick >= player->speed) {
+    player->tick = 0;
+    if (player->delayRows > 0) {
+      player->delayRows--;
+      player->repeatRow = true;
+    } else {
+      player->repeatRow = false;
+      AUDIO_MODULE_PLAYER_nextRow(player);
+    }
+  }
+}
+
+internal void
+AUDIO_MODULE_PLAYER_init(AUDIO_MODULE_PLAYER* player, const AUDIO_MODULE* module, uint32_t rate, bool loop) {
+  memset(player, 0, sizeof(AUDIO_MODULE_PLAYER));
+  player->module = module;
+  player->rate = rate;
+  player->loop = loop;
+  player->speed = 6;
+  player->tempo = 125;
+  player->jumpOrder = -1;
+  player->loopJump = -1;
+  player->endFrame = module->seconds * rate;
+  for (int c = 0; c < module->channelCount; c++) {
+    // Amiga channels go left, right, right, left
+    int side = c % 4;
+    player->voices[c].pan = (side == 0 || side == 3) ? 0.25f : 0.75f;
+  }
+}
+
+// Runs through the song without playing it, to find how long it lasts. A
+// song which jumps back to a row it has played already loops forever, so
+// it is measured up to there.
+internal double
+AUDIO_MODULE_measure(AUDIO_MODULE* module) {
+  AUDIO_MODULE_PLAYER* player = malloc(sizeof(AUDIO_MODULE_PLAYER));
+  // Any rate would do, as only the seconds are kept
+  AUDIO_MODULE_PLAYER_init(player, module, 44100, false);
+  uint8_t* visited = calloc(AUDIO_MODULE_ORDERS * AUDIO_MODULE_ROWS, 1);
+  double seconds = 0;
+  while (!player->ended && seconds < AUDIO_MODULE_MAX_SECONDS) {
+    if (player->tick == 0 && !player->repeatRow) {
+      bool looping = false;
+      for (int c = 0; c < module->channelCount; c++) {
+        looping |= player->voices[c].loopCount > 0;
+      }
+      uint8_t* seen = &visited[player->order * AUDIO_MODULE_ROWS + player->row];
+      if (*seen && !looping) {
+        break;
+      }
+      *seen = 1;
+    }
+    AUDIO_MODULE_PLAYER_tick(player);
+    seconds += 2.5 / player->tempo;
+  }
+  free(visited);
+  free(player);
+  return seconds;
+}
+
+// Parses a MOD file. This doesn't touch the VM, so it can run on a worker
+// thread. Returns an error message on failure.
+internal const char*
+AUDIO_MODULE_load(AUDIO_MODULE** result, const char* fileBuffer, size_t length) {
+  const uint8_t* in = (const uint8_t*)fileBuffer;
+  uint8_t channelCount = AUDIO_MODULE_channelsFor(fileBuffer + 1080);
+  if (length < AUDIO_MODULE_HEADER_SIZE || channelCount == 0 || channelCount > AUDIO_MODULE_MAX_CHANNELS) {
+    return "Unsupported MOD file";
+  }
+  uint8_t songLength = in[950];
+  if (songLength == 0 || songLength > AUDIO_MODULE_ORDERS) {
+    return "Invalid MOD file";
+  }
+
+  AUDIO_MODULE* module = calloc(1, sizeof(AUDIO_MODULE));
+  memcpy(module->title, fileBuffer, 20);
+  module->channelCount = channelCount;
+  module->songLength = songLength;
+  module->restart = in[951];
+  memcpy(module->orders, in + 952, AUDIO_MODULE_ORDERS);
+  // Every order counts, even past the end of the song
+  for (int i = 0; i < AUDIO_MODULE_ORDERS; i++) {
+    module->patternCount = max(module->patternCount, module->orders[i] + 1);
+  }
+
+  size_t patternSize = AUDIO_MODULE_ROWS * channelCount * 4;
+  size_t patternBytes = patternSize * module->patternCount;
+  if (length < AUDIO_MODULE_HEADER_SIZE + patternBytes) {
+    AUDIO_MODULE_free(module);
+    return "MOD file is missing pattern data";
+  }
+  module->patterns = malloc(patternBytes);
+  memcpy(module->patterns, in + AUDIO_MODULE_HEADER_SIZE, patternBytes);
+
+  // Sample data follows the patterns. Some files are cut short, so the
+  // samples are trimmed to what is there.
+  size_t offset = AUDIO_MODULE_HEADER_SIZE + patternBytes;
+  size_t available = length - offset;
+  size_t total = 0;
+  for (int i = 0; i < AUDIO_MODULE_SAMPLES; i++) {
+    const uint8_t* header = in + 20 + i * 30;
+    AUDIO_MODULE_SAMPLE* sample = &module->samples[i];
+    sample->length = AUDIO_MODULE_readU16(header + 22) * 2;
+    sample->length = min(sample->length, available - min(total, available));
+    total += sample->length;
+    sample->finetune = (int8_t)((header[24] & 0xF) << 4) >> 4;
+    sample->volume = min(64, header[25]);
+    sample->loopStart = AUDIO_MODULE_readU16(header + 26) * 2;
+    sample->loopLength = AUDIO_MODULE_readU16(header + 28) * 2;
+    // A loop of one word means no loop at all
+    if (sample->loopLength <= 2 || sample->loopStart >= sample->length) {
+      sample->loopStart = 0;
+      sample->loopLength = 0;
+    } else {
+      sample->loopLength = min(sample->loopLength, sample->length - sample->loopStart);
+    }
+  }
+
+  // All of the sample data lives in one block, owned by the first sample
+  int8_t* data = malloc(max(1, total));
+  memcpy(data, in + offset, total);
+  for (int i = 0; i < AUDIO_MODULE_SAMPLES; i++) {
+    module->samples[i].data = data;
+    data += module->samples[i].length;
+  }
+  module->seconds = AUDIO_MODULE_measure(module);
+  *result = module;
+  return NULL;
+}
+
+// Moves a player over to audio at |rate|, carrying on from the same point
+internal void
+AUDIO_MODULE_PLAYER_prepare(AUDIO_MODULE_PLAYER* player, uint32_t rate) {
+  if (player->rate == rate) {
+    return;
+  }
+  double scale = (double)rate / player->rate;
+  for (int c = 0; c < player->module->channelCount; c++) {
+    player->voices[c].step /= scale;
+  }
+  player->tickFrames = max(1, player->tickFrames * scale);
+  player->elapsed *= scale;
+  player->endFrame = player->module->seconds * rate;
+  player->rate = rate;
+}
+
+internal AUDIO_MODULE_PLAYER*
+AUDIO_MODULE_PLAYER_new(const AUDIO_MODULE* module, uint32_t rate, bool loop) {
+  AUDIO_MODULE_PLAYER* player = malloc(sizeof(AUDIO_MODULE_PLAYER));
+  AUDIO_MODULE_PLAYER_init(player, module, rate, loop);
+  return player;
+}
+
+internal uint64_t
+AUDIO_MODULE_SAMPLE_end(const AUDIO_MODULE_SAMPLE* sample) {
+  return (uint64_t)(sample->loopLength > 0 ? sample->loopStart + sample->loopLength : sample->length) << 32;
+}
+
+// Brings a cursor which has run past the end of a looped sample back
+// into the loop.
+internal uint64_t
+AUDIO_MODULE_SAMPLE_wrap(const AUDIO_MODULE_SAMPLE* sample, uint64_t cursor, uint64_t end) {
+  uint64_t loopLength = (uint64_t)sample->loopLength << 32;
+  return cursor - loopLength * ((cursor - end) / loopLength + 1);
+}
+
+// Moves a voice on by |frames| without reading the sample
+internal void
+AUDIO_MODULE_VOICE_skip(AUDIO_MODULE_VOICE* voice, uint32_t frames) {
+  const AUDIO_MODULE_SAMPLE* sample = voice->sample;
+  uint64_t end = AUDIO_MODULE_SAMPLE_end(sample);
+  voice->cursor += voice->step * frames;
+  if (voice->cursor >= end) {
+    if (sample->loopLength > 0) {
+      voice->cursor = AUDIO_MODULE_SAMPLE_wrap(sample, voice->cursor, end);
+    } else {
+      voice->active = false;
+    }
+  }
+}
+
+// Adds |frames| of one voice into the float stereo |out|, at a volume of
+// |level| with the gains ramping as in AUDIO_mixSpan.
+internal void
+AUDIO_MODULE_VOICE_mix(AUDIO_MODULE_VOICE* voice, float* restrict out, uint32_t frames,
+    float level, const float* gain, const float* step) {
+  const AUDIO_MODULE_SAMPLE* sample = voice->sample;
+  const int8_t* data = sample->data;
+  bool looped = sample->loopLength > 0;
+  uint64_t end = AUDIO_MODULE_SAMPLE_end(sample);
+  float left = level * (1 - voice->pan) * gain[0];
+  float right = level * voice->pan * gain[1];
+  float leftStep = level * (1 - voice->pan) * step[0];
+  float rightStep = level * voice->pan * step[1];
+  uint64_t cursor = voice->cursor;
+  for (uint32_t i = 0; i < frames; i++) {
+    if (cursor >= end) {
+      if (!looped) {
+        voice->active = false;
+        break;
+      }
+      cursor = AUDIO_MODULE_SAMPLE_wrap(sample, cursor, end);
+    }
+    uint32_t index = cursor >> 32;
+    float t = (uint32_t)cursor * (1.0f / AUDIO_RATE_ONE);
+    float a = data[index];
+    float b = 0;
+    if (index + 1 < end >> 32) {
+      b = data[index + 1];
+    } else if (looped) {
+      b = data[sample->loopStart];
+    }
+    float value = a + (b - a) * t;
+    out[i * 2] += value * left;
+    out[i * 2 + 1] += value * right;
+    left += leftStep;
+    right += rightStep;
+    cursor += voice->step;
+  }
+  voice->cursor = cursor;
+}
+
+// Adds up to |frames| of the song into the float stereo |out|, while the
+// gains ramp by |step| per frame. A virtual channel moves on without being
+// heard. Returns the number of frames before the song ended, which is
+// |frames| if it is still going.
+internal uint32_t
+AUDIO_MODULE_PLAYER_mix(AUDIO_MODULE_PLAYER* player, float* restrict out, uint32_t frames,
+    const float* gain, const float* step, bool silent) {
+  const AUDIO_MODULE* module = player->module;
+  // Two voices on each side at full volume reach full scale
+  float level = 2.0f / module->channelCount / 128.0f / 64.0f;
+  uint32_t done = 0;
+  while (done < frames) {
+    if (!player->loop && player->elapsed >= player->endFrame) {
+      player->ended = true;
+    }
+    if (player->tickFrames == 0) {
+      if (player->ended) {
+        break;
+      }
+      AUDIO_MODULE_PLAYER_tick(player);
+    }
+    uint32_t span = min(frames - done, player->tickFrames);
+    float spanGain[2] = { gain[0] + step[0] * done, gain[1] + step[1] * done };
+    for (int c = 0; c < module->channelCount; c++) {
+      AUDIO_MODULE_VOICE* voice = &player->voices[c];
+      if (!voice->active) {
+        continue;
+      }
+      if (silent || voice->playVolume == 0) {
+        AUDIO_MODULE_VOICE_skip(voice, span);
+      } else {
+        AUDIO_MODULE_VOICE_mix(voice, out + done * 2, span, level * voice->playVolume, spanGain, step);
+      }
+    }
+    player->tickFrames -= span;
+    player->elapsed += span;
+    done += span;
+  }
+  return done;
+}
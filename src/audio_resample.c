@@ -0,0 +1,200 @@
+// Sample rate conversion, so audio plays at the right pitch whatever rate
+// it was authored at. Loaded audio is converted once, up front, and streams
+// are converted a chunk at a time as they are decoded.
+
+typedef enum {
+  AUDIO_RESAMPLE_LINEAR,
+  AUDIO_RESAMPLE_SINC
+} AUDIO_RESAMPLE_MODE;
+
+global_variable AUDIO_RESAMPLE_MODE AUDIO_RESAMPLE_QUALITY = AUDIO_RESAMPLE_SINC;
+
+// The windowed-sinc filter reads this many input frames per output frame,
+// and is precomputed for this many fractional positions between frames.
+#define AUDIO_SINC_TAPS 16
+#define AUDIO_SINC_PHASES 256
+
+typedef struct {
+  AUDIO_RESAMPLE_MODE mode;
+  uint16_t channels;
+  // Input frames advanced per output frame, in 32.32 fixed point
+  uint64_t step;
+  // Where the next output frame falls in the input, in 32.32 fixed point
+  uint64_t position;
+  // Sinc only: AUDIO_SINC_PHASES + 1 rows of AUDIO_SINC_TAPS coefficients.
+  // For stereo, each coefficient is stored twice, to match the samples.
+  float* table;
+} AUDIO_RESAMPLER;
+
+// Frames of input needed before the frame under the read position
+internal size_t
+AUDIO_RESAMPLER_history(AUDIO_RESAMPLER* resampler) {
+  return resampler->mode == AUDIO_RESAMPLE_SINC ? AUDIO_SINC_TAPS / 2 - 1 : 0;
+}
+
+// Frames of input needed after the frame under the read position
+internal size_t
+AUDIO_RESAMPLER_reach(AUDIO_RESAMPLER* resampler) {
+  return resampler->mode == AUDIO_RESAMPLE_SINC ? AUDIO_SINC_TAPS / 2 : 1;
+}
+
+internal void
+AUDIO_RESAMPLER_init(AUDIO_RESAMPLER* resampler, AUDIO_RESAMPLE_MODE mode,
+    uint16_t channels, uint32_t inRate, uint32_t outRate) {
+  resampler->mode = mode;
+  resampler->channels = channels;
+  resampler->step = ((uint64_t)inRate << 32) / outRate;
+  resampler->position = (uint64_t)AUDIO_RESAMPLER_history(resampler) << 32;
+  resampler->table = NULL;
+  if (mode != AUDIO_RESAMPLE_SINC) {
+    return;
+  }
+
+  // When reducing the rate, the cutoff comes down with it, so content
+  // above the new Nyquist limit is filtered rather than aliased.
+  double cutoff = min(1.0, (double)outRate / inRate) * 0.95;
+  double half = AUDIO_SINC_TAPS / 2;
+  resampler->table = malloc(sizeof(float) * (AUDIO_SINC_PHASES + 1) * AUDIO_SINC_TAPS * channels);
+  for (int phase = 0; phase <= AUDIO_SINC_PHASES; phase++) {
+    double frac = (double)phase / AUDIO_SINC_PHASES;
+    double taps[AUDIO_SINC_TAPS];
+    double sum = 0;
+    for (int k = 0; k < AUDIO_SINC_TAPS; k++) {
+      double x = k - (half - 1) - frac;
+      double sinc = x == 0 ? 1.0 : sin(M_PI * cutoff * x) / (M_PI * cutoff * x);
+      // Blackman window across the width of the filter
+      double w = (x + half) / (2 * half);
+      double window = 0.42 - 0.5 * cos(2 * M_PI * w) + 0.08 * cos(4 * M_PI * w);
+      taps[k] = sinc * window;
+      sum += taps[k];
+    }
+    // Normalise each phase, so there is no ripple at DC
+    float* row = resampler->table + phase * AUDIO_SINC_TAPS * channels;
+    for (int k = 0; k < AUDIO_SINC_TAPS; k++) {
+      for (int c = 0; c < channels; c++) {
+        row[k * channels + c] = taps[k] / sum;
+      }
+    }
+  }
+}
+
+internal void
+AUDIO_RESAMPLER_free(AUDIO_RESAMPLER* resampler) {
+  free(resampler->table);
+  resampler->table = NULL;
+}
+
+internal int16_t
+AUDIO_RESAMPLER_clamp(float value) {
+  return (int16_t)mid(INT16_MIN, lrintf(value), INT16_MAX);
+}
+
+// Applies one row of the sinc filter to the |AUDIO_SINC_TAPS| frames
+// starting at |in|.
+internal void
+AUDIO_RESAMPLER_convolve(const int16_t* restrict in, const float* restrict row,
+    uint16_t channels, int16_t* restrict out) {
+#if defined(__SSE2__)
+  __m128 acc = _mm_setzero_ps();
+  for (int i = 0; i < AUDIO_SINC_TAPS * channels; i += 8) {
+    __m128i src = _mm_loadu_si128((const __m128i*)(in + i));
+    __m128 lo = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpacklo_epi16(src, src), 16));
+    __m128 hi = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpackhi_epi16(src, src), 16));
+    acc = _mm_add_ps(acc, _mm_mul_ps(lo, _mm_loadu_ps(row + i)));
+    acc = _mm_add_ps(acc, _mm_mul_ps(hi, _mm_loadu_ps(row + i + 4)));
+  }
+  // Stereo lanes are [L, R, L, R], so fold the top half onto the bottom
+  acc = _mm_add_ps(acc, _mm_movehl_ps(acc, acc));
+  float sums[4];
+  _mm_storeu_ps(sums, acc);
+  if (channels == 1) {
+    out[0] = AUDIO_RESAMPLER_clamp(sums[0] + sums[1]);
+  } else {
+    out[0] = AUDIO_RESAMPLER_clamp(sums[0]);
+    out[1] = AUDIO_RESAMPLER_clamp(sums[1]);
+  }
+#else
+  for (int c = 0; c < channels; c++) {
+    float sum = 0;
+    for (int k = 0; k < AUDIO_SINC_TAPS; k++) {
+      sum += in[k * channels + c] * row[k * channels + c];
+    }
+    out[c] = AUDIO_RESAMPLER_clamp(sum);
+  }
+#endif
+}
+
+// Converts as much of |in| as it can into |out|, returning the number of
+// frames written. |in| must begin with the history for the read position,
+// and output stops once there isn't enough input left to reach ahead.
+internal size_t
+AUDIO_RESAMPLER_process(AUDIO_RESAMPLER* resampler,
+    const int16_t* in, size_t inFrames, int16_t* out, size_t outCapacity) {
+  uint16_t channels = resampler->channels;
+  size_t history = AUDIO_RESAMPLER_history(resampler);
+  size_t reach = AUDIO_RESAMPLER_reach(resampler);
+  uint64_t position = resampler->position;
+  size_t written = 0;
+
+  while (written < outCapacity) {
+    size_t index = position >> 32;
+    if (index + reach >= inFrames) {
+      break;
+    }
+    uint32_t frac = (uint32_t)position;
+    if (resampler->mode == AUDIO_RESAMPLE_SINC) {
+      // Round to the nearest precomputed phase
+      size_t phase = ((uint64_t)frac * AUDIO_SINC_PHASES + (1u << 31)) >> 32;
+      const float* row = resampler->table + phase * AUDIO_SINC_TAPS * channels;
+      AUDIO_RESAMPLER_convolve(in + (index - history) * channels, row, channels, out + written * channels);
+    } else {
+      int64_t weight = frac >> 16;
+      for (int c = 0; c < channels; c++) {
+        int64_t a = in[index * channels + c];
+        int64_t b = in[(index + 1) * channels + c];
+        out[written * channels + c] = a + (((b - a) * weight) >> 16);
+      }
+    }
+    position += resampler->step;
+    written++;
+  }
+
+  resampler->position = position;
+  return written;
+}
+
+// The number of input frames at the front of the buffer which are no longer
+// needed, and can be dropped before the next call to process. The read
+// position is moved back to match.
+internal size_t
+AUDIO_RESAMPLER_consume(AUDIO_RESAMPLER* resampler) {
+  size_t history = AUDIO_RESAMPLER_history(resampler);
+  size_t index = resampler->position >> 32;
+  size_t consumed = index > history ? index - history : 0;
+  resampler->position -= (uint64_t)consumed << 32;
+  return consumed;
+}
+
+// Converts a whole buffer of audio in one go. Returns a new buffer, and
+// sets |outFrames| to its length.
+internal int16_t*
+AUDIO_resample(const int16_t* in, size_t inFrames, uint16_t channels,
+    uint32_t inRate, uint32_t outRate, AUDIO_RESAMPLE_MODE mode, size_t* outFrames) {
+  AUDIO_RESAMPLER resampler;
+  AUDIO_RESAMPLER_init(&resampler, mode, channels, inRate, outRate);
+
+  // Silence either side of the audio, so the filter never reads out of bounds
+  size_t history = AUDIO_RESAMPLER_history(&resampler);
+  size_t reach = AUDIO_RESAMPLER_reach(&resampler);
+  size_t paddedFrames = history + inFrames + reach;
+  int16_t* padded = calloc(paddedFrames * channels, sizeof(int16_t));
+  memcpy(padded + history * channels, in, sizeof(int16_t) * inFrames * channels);
+
+  size_t length = ((uint64_t)inFrames * outRate) / inRate;
+  int16_t* out = malloc(sizeof(int16_t) * max(1, length) * channels);
+  *outFrames = AUDIO_RESAMPLER_process(&resampler, padded, paddedFrames, out, length);
+
+  free(padded);
+  AUDIO_RESAMPLER_free(&resampler);
+  return out;
+}
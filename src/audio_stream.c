@@ -0,0 +1,397 @@
+// Streamed audio keeps the encoded file rather than decoding all of it up
+// front. Every channel playing a stream gets its own decoder, which a
+// background thread runs ahead of the mixer into a ring of frames.
+
+// Frames decoded in one go by the stream thread
+#define AUDIO_STREAM_CHUNK 1024
+// How long the stream thread sleeps for, if the mixer doesn't wake it
+#define AUDIO_STREAMER_INTERVAL 10
+
+typedef struct {
+  SDL_atomic_t refCount;
+  AUDIO_TYPE audioType;
+  FILE_STORAGE storage;
+  char* file;
+  size_t fileLength;
+
+  uint16_t channels;
+  uint32_t freq;
+  // Total length in frames
+  size_t length;
+  // WAV only: where the PCM data starts within the file
+  size_t dataOffset;
+} AUDIO_STREAM_SOURCE;
+
+typedef struct {
+  AUDIO_STREAM_SOURCE* source;
+  struct AUDIO_STREAMER_t* streamer;
+  stb_vorbis* vorbis;
+  // WAV only: the next frame to decode
+  size_t cursor;
+
+  SDL_atomic_t loop;
+  // Set once the decoder reaches the end of a source which doesn't loop
+  SDL_atomic_t ended;
+
+  // If the source isn't at the device rate, decoded frames wait in
+  // |pending| until the resampler has enough to work with.
+  bool resampling;
+  AUDIO_RESAMPLER resampler;
+  int16_t* pending;
+  size_t pendingFrames;
+  int16_t* resampled;
+  // The most frames a single decode can add to the ring
+  uint32_t chunkFrames;
+
+  // Decoded interleaved 16-bit stereo, with a single producer (the stream
+  // thread) and a single consumer (the mixer). The counters only ever
+  // increase, and are masked to find a place in the ring.
+  int16_t* ring;
+  uint32_t ringFrames;
+  SDL_atomic_t written;
+  SDL_atomic_t read;
+} AUDIO_STREAM;
+
+typedef struct AUDIO_STREAMER_t {
+  SDL_Thread* thread;
+  SDL_mutex* lock;
+  SDL_sem* wake;
+  SDL_atomic_t running;
+  AUDIO_STREAM** streams;
+  size_t count;
+  size_t capacity;
+} AUDIO_STREAMER;
+
+internal uint16_t
+AUDIO_STREAM_readU16(const char* bytes) {
+  const uint8_t* b = (const uint8_t*)bytes;
+  return b[0] | (b[1] << 8);
+}
+
+internal uint32_t
+AUDIO_STREAM_readU32(const char* bytes) {
+  const uint8_t* b = (const uint8_t*)bytes;
+  return b[0] | (b[1] << 8) | (b[2] << 16) | ((uint32_t)b[3] << 24);
+}
+
+internal const char*
+AUDIO_STREAM_SOURCE_parseWav(AUDIO_STREAM_SOURCE* source) {
+  const char* file = source->file;
+  size_t offset = 12;
+  bool hasFormat = false;
+  while (offset + 8 <= source->fileLength) {
+    const char* chunk = file + offset;
+    size_t size = AUDIO_STREAM_readU32(chunk + 4);
+    size_t body = offset + 8;
+    if (strncmp(chunk, "fmt ", 4) == 0 && size >= 16 && body + 16 <= source->fileLength) {
+      uint16_t format = AUDIO_STREAM_readU16(file + body);
+      source->channels = AUDIO_STREAM_readU16(file + body + 2);
+      source->freq = AUDIO_STREAM_readU32(file + body + 4);
+      uint16_t bitsPerSample = AUDIO_STREAM_readU16(file + body + 14);
+      if (format != 1 || bitsPerSample != 16 || source->channels < 1 || source->channels > 2) {
+        return "Only 16-bit PCM WAVE files can be streamed";
+      }
+      hasFormat = true;
+    } else if (strncmp(chunk, "data", 4) == 0 && hasFormat) {
+      size_t available = source->fileLength - body;
+      if (size > available) {
+        size = available;
+      }
+      source->dataOffset = body;
+      source->length = size / (sizeof(int16_t) * source->channels);
+      return NULL;
+    }
+    // Chunks are padded to an even length
+    offset = body + size + (size & 1);
+  }
+  return "Invalid WAVE file";
+}
+
+// Works out the format and length of the file, without decoding it.
+// Returns an error message, or NULL if the source can be streamed.
+internal const char*
+AUDIO_STREAM_SOURCE_init(AUDIO_STREAM_SOURCE* source) {
+  SDL_AtomicSet(&source->refCount, 1);
+  if (source->fileLength >= 12 &&
+      strncmp(source->file, "RIFF", 4) == 0 &&
+      strncmp(&source->file[8], "WAVE", 4) == 0) {
+    source->audioType = AUDIO_TYPE_WAV;
+    return AUDIO_STREAM_SOURCE_parseWav(source);
+  } else if (source->fileLength >= 4 && strncmp(source->file, "OggS", 4) == 0) {
+    source->audioType = AUDIO_TYPE_OGG;
+    int error;
+    stb_vorbis* vorbis = stb_vorbis_open_memory((const unsigned char*)source->file, source->fileLength, &error, NULL);
+    if (vorbis == NULL) {
+      return "Invalid OGG file";
+    }
+    stb_vorbis_info info = stb_vorbis_get_info(vorbis);
+    source->channels = info.channels;
+    source->freq = info.sample_rate;
+    source->length = stb_vorbis_stream_length_in_samples(vorbis);
+    stb_vorbis_close(vorbis);
+    return NULL;
+  }
+  source->audioType = AUDIO_TYPE_UNKNOWN;
+  return "Audio file was of an incompatible format";
+}
+
+internal void
+AUDIO_STREAM_SOURCE_release(AUDIO_STREAM_SOURCE* source) {
+  if (source != NULL && SDL_AtomicDecRef(&source->refCount)) {
+    FILE_STORAGE_release(source->storage, source->file, source->fileLength);
+    free(source);
+  }
+}
+
+// Decodes up to |frames| of interleaved stereo into |out|, returning
+// how many were decoded. Zero means the end of the source.
+internal uint32_t
+AUDIO_STREAM_decode(AUDIO_STREAM* stream, int16_t* out, uint32_t frames) {
+  AUDIO_STREAM_SOURCE* source = stream->source;
+  if (source->audioType == AUDIO_TYPE_OGG) {
+    return stb_vorbis_get_samples_short_interleaved(stream->vorbis, 2, out, frames * 2);
+  }
+
+  size_t remaining = source->length - stream->cursor;
+  if (frames > remaining) {
+    frames = remaining;
+  }
+  const int16_t* in = (const int16_t*)(source->file + source->dataOffset) + stream->cursor * source->channels;
+  for (uint32_t i = 0; i < frames; i++) {
+    out[i * 2] = in[i * source->channels];
+    out[i * 2 + 1] = in[i * source->channels + source->channels - 1];
+  }
+  stream->cursor += frames;
+  return frames;
+}
+
+internal void
+AUDIO_STREAM_rewind(AUDIO_STREAM* stream) {
+  if (stream->vorbis != NULL) {
+    stb_vorbis_seek_start(stream->vorbis);
+  }
+  stream->cursor = 0;
+}
+
+// Moves the decoder to |frame| of the source
+internal void
+AUDIO_STREAM_seek(AUDIO_STREAM* stream, size_t frame) {
+  frame = min(frame, stream->source->length);
+  if (stream->vorbis != NULL) {
+    stb_vorbis_seek(stream->vorbis, frame);
+  }
+  stream->cursor = frame;
+}
+
+internal void
+AUDIO_STREAM_write(AUDIO_STREAM* stream, const int16_t* frames, uint32_t count) {
+  uint32_t written = SDL_AtomicGet(&stream->written);
+  uint32_t start = written & (stream->ringFrames - 1);
+  uint32_t first = min(count, stream->ringFrames - start);
+  memcpy(stream->ring + start * 2, frames, sizeof(int16_t) * 2 * first);
+  memcpy(stream->ring, frames + first * 2, sizeof(int16_t) * 2 * (count - first));
+  SDL_AtomicSet(&stream->written, written + count);
+}
+
+// Queues decoded frames for the resampler, and passes on whatever it can
+// produce so far.
+internal void
+AUDIO_STREAM_resample(AUDIO_STREAM* stream, const int16_t* frames, uint32_t count) {
+  memcpy(stream->pending + stream->pendingFrames * 2, frames, sizeof(int16_t) * 2 * count);
+  stream->pendingFrames += count;
+
+  size_t produced = AUDIO_RESAMPLER_process(&stream->resampler,
+      stream->pending, stream->pendingFrames, stream->resampled, stream->chunkFrames);
+  AUDIO_STREAM_write(stream, stream->resampled, produced);
+
+  size_t consumed = AUDIO_RESAMPLER_consume(&stream->resampler);
+  stream->pendingFrames -= consumed;
+  memmove(stream->pending, stream->pending + consumed * 2, sizeof(int16_t) * 2 * stream->pendingFrames);
+}
+
+// Decodes until at least |target| frames are buffered, or the ring is full.
+internal void
+AUDIO_STREAM_fill(AUDIO_STREAM* stream, uint32_t target) {
+  int16_t scratch[AUDIO_STREAM_CHUNK * 2];
+  if (SDL_AtomicGet(&stream->ended) && SDL_AtomicGet(&stream->loop)) {
+    // Looping was turned on after we had already reached the end.
+    AUDIO_STREAM_rewind(stream);
+    SDL_AtomicSet(&stream->ended, 0);
+  }
+
+  while (!SDL_AtomicGet(&stream->ended)) {
+    uint32_t written = SDL_AtomicGet(&stream->written);
+    uint32_t buffered = written - (uint32_t)SDL_AtomicGet(&stream->read);
+    if (buffered >= target || stream->ringFrames - buffered < stream->chunkFrames) {
+      break;
+    }
+
+    uint32_t frames = AUDIO_STREAM_decode(stream, scratch, AUDIO_STREAM_CHUNK);
+    if (frames == 0) {
+      if (SDL_AtomicGet(&stream->loop) && stream->source->length > 0) {
+        AUDIO_STREAM_rewind(stream);
+      } else {
+        if (stream->resampling) {
+          // Flush the tail of the audio through the filter
+          memset(scratch, 0, sizeof(int16_t) * 2 * AUDIO_RESAMPLER_reach(&stream->resampler));
+          AUDIO_STREAM_resample(stream, scratch, AUDIO_RESAMPLER_reach(&stream->resampler));
+        }
+        SDL_AtomicSet(&stream->ended, 1);
+      }
+      continue;
+    }
+
+    if (stream->resampling) {
+      AUDIO_STREAM_resample(stream, scratch, frames);
+    } else {
+      AUDIO_STREAM_write(stream, scratch, frames);
+    }
+  }
+}
+
+// Starts decoding |source| at |outRate|, from frame |start| of the source.
+internal AUDIO_STREAM*
+AUDIO_STREAM_new(AUDIO_STREAM_SOURCE* source, uint32_t outRate, size_t start) {
+  AUDIO_STREAM* stream = calloc(1, sizeof(AUDIO_STREAM));
+  if (source->audioType == AUDIO_TYPE_OGG) {
+    int error;
+    stream->vorbis = stb_vorbis_open_memory((const unsigned char*)source->file, source->fileLength, &error, NULL);
+    if (stream->vorbis == NULL) {
+      free(stream);
+      return NULL;
+    }
+  }
+  SDL_AtomicIncRef(&source->refCount);
+  stream->source = source;
+
+  stream->chunkFrames = AUDIO_STREAM_CHUNK;
+  stream->resampling = source->freq != outRate;
+  if (stream->resampling) {
+    AUDIO_RESAMPLER_init(&stream->resampler, AUDIO_RESAMPLE_QUALITY, 2, source->freq, outRate);
+    // Whatever is left over from the last chunk is resampled with the next
+    size_t pendingCapacity = AUDIO_STREAM_CHUNK + AUDIO_SINC_TAPS + 2;
+    stream->chunkFrames = ((uint64_t)pendingCapacity * outRate) / source->freq + 2;
+    stream->pending = calloc(pendingCapacity * 2, sizeof(int16_t));
+    stream->pendingFrames = AUDIO_RESAMPLER_history(&stream->resampler);
+    stream->resampled = malloc(sizeof(int16_t) * 2 * stream->chunkFrames);
+  }
+
+  // Keep a few device buffers' worth decoded, so a slow frame on the stream
+  // thread doesn't reach the speakers.
+  stream->ringFrames = AUDIO_STREAM_CHUNK;
+  while (stream->ringFrames < max(AUDIO_BUFFER_SIZE * 8, stream->chunkFrames * 4)) {
+    stream->ringFrames <<= 1;
+  }
+  stream->ring = calloc(stream->ringFrames * 2, sizeof(int16_t));
+
+  if (start > 0) {
+    AUDIO_STREAM_seek(stream, start);
+  }
+
+  // Enough to start playing before the stream thread picks this up
+  AUDIO_STREAM_fill(stream, AUDIO_BUFFER_SIZE * 2);
+  return stream;
+}
+
+internal void
+AUDIO_STREAM_free(AUDIO_STREAM* stream) {
+  if (stream->vorbis != NULL) {
+    stb_vorbis_close(stream->vorbis);
+  }
+  AUDIO_STREAM_SOURCE_release(stream->source);
+  AUDIO_RESAMPLER_free(&stream->resampler);
+  free(stream->pending);
+  free(stream->resampled);
+  free(stream->ring);
+  free(stream);
+}
+
+// Mixer side: points |frames| at the decoded frames which can be read
+// without wrapping, and returns how many there are.
+internal uint32_t
+AUDIO_STREAM_peek(AUDIO_STREAM* stream, const int16_t** frames) {
+  uint32_t read = SDL_AtomicGet(&stream->read);
+  uint32_t buffered = (uint32_t)SDL_AtomicGet(&stream->written) - read;
+  uint32_t start = read & (stream->ringFrames - 1);
+  *frames = stream->ring + start * 2;
+  return min(buffered, stream->ringFrames - start);
+}
+
+internal void
+AUDIO_STREAM_consume(AUDIO_STREAM* stream, uint32_t frames) {
+  SDL_AtomicSet(&stream->read, (uint32_t)SDL_AtomicGet(&stream->read) + frames);
+}
+
+internal int
+AUDIO_STREAMER_run(void* data) {
+  AUDIO_STREAMER* streamer = data;
+  while (SDL_AtomicGet(&streamer->running)) {
+    SDL_LockMutex(streamer->lock);
+    for (size_t i = 0; i < streamer->count; i++) {
+      AUDIO_STREAM* stream = streamer->streams[i];
+      AUDIO_STREAM_fill(stream, stream->ringFrames);
+    }
+    SDL_UnlockMutex(streamer->lock);
+    SDL_SemWaitTimeout(streamer->wake, AUDIO_STREAMER_INTERVAL);
+  }
+  return 0;
+}
+
+internal void
+AUDIO_STREAMER_init(AUDIO_STREAMER* streamer) {
+  streamer->lock = SDL_CreateMutex();
+  streamer->wake = SDL_CreateSemaphore(0);
+  streamer->streams = NULL;
+  streamer->count = 0;
+  streamer->capacity = 0;
+  SDL_AtomicSet(&streamer->running, 1);
+  streamer->thread = SDL_CreateThread(AUDIO_STREAMER_run, "DOME audio stream", streamer);
+}
+
+internal void
+AUDIO_STREAMER_free(AUDIO_STREAMER* streamer) {
+  SDL_AtomicSet(&streamer->running, 0);
+  SDL_SemPost(streamer->wake);
+  SDL_WaitThread(streamer->thread, NULL);
+  SDL_DestroySemaphore(streamer->wake);
+  SDL_DestroyMutex(streamer->lock);
+  free(streamer->streams);
+}
+
+// Called from the mixer when it has used up some of a stream
+internal void
+AUDIO_STREAMER_wake(AUDIO_STREAMER* streamer) {
+  if (SDL_SemValue(streamer->wake) == 0) {
+    SDL_SemPost(streamer->wake);
+  }
+}
+
+internal void
+AUDIO_STREAMER_add(AUDIO_STREAMER* streamer, AUDIO_STREAM* stream) {
+  SDL_LockMutex(streamer->lock);
+  if (streamer->count == streamer->capacity) {
+    streamer->capacity = max(4, streamer->capacity * 2);
+    streamer->streams = realloc(streamer->streams, sizeof(AUDIO_STREAM*) * streamer->capacity);
+  }
+  streamer->streams[streamer->count++] = stream;
+  stream->streamer = streamer;
+  SDL_UnlockMutex(streamer->lock);
+}
+
+// Once this returns, the stream thread is no longer touching |stream|.
+internal void
+AUDIO_STREAMER_remove(AUDIO_STREAM* stream) {
+  AUDIO_STREAMER* streamer = stream->streamer;
+  if (streamer == NULL) {
+    return;
+  }
+  SDL_LockMutex(streamer->lock);
+  for (size_t i = 0; i < streamer->count; i++) {
+    if (streamer->streams[i] == stream) {
+      streamer->streams[i] = streamer->streams[--streamer->count];
+      break;
+    }
+  }
+  stream->streamer = NULL;
+  SDL_UnlockMutex(streamer->lock);
+}
@@ -0,0 +1,267 @@
+// Simple synthesiser voices, for retro sound effects which need no sample
+// data. A voice is an oscillator shaped by an ADSR envelope, and is
+// rendered by the mixer straight into the bus, like any other channel.
+
+// These match AudioWave
+typedef enum {
+  AUDIO_WAVE_SQUARE = 1,
+  AUDIO_WAVE_TRIANGLE,
+  AUDIO_WAVE_SAW,
+  AUDIO_WAVE_NOISE,
+  AUDIO_WAVE_WAVETABLE,
+  AUDIO_WAVE_LAST
+} AUDIO_WAVE;
+
+// Settings, in the order scripts give them. These match AudioEngine.playSynth.
+enum {
+  AUDIO_SYNTH_WAVE,
+  AUDIO_SYNTH_FREQUENCY,
+  AUDIO_SYNTH_SLIDE,
+  AUDIO_SYNTH_DUTY,
+  AUDIO_SYNTH_ATTACK,
+  AUDIO_SYNTH_DECAY,
+  AUDIO_SYNTH_SUSTAIN,
+  AUDIO_SYNTH_RELEASE,
+  AUDIO_SYNTH_DURATION,
+  AUDIO_SYNTH_PARAM_COUNT
+};
+
+#define AUDIO_SYNTH_MAX_TABLE 4096
+
+typedef enum {
+  AUDIO_ENVELOPE_ATTACK,
+  AUDIO_ENVELOPE_DECAY,
+  AUDIO_ENVELOPE_SUSTAIN,
+  AUDIO_ENVELOPE_RELEASE,
+  AUDIO_ENVELOPE_DONE
+} AUDIO_ENVELOPE_STAGE;
+
+typedef struct {
+  AUDIO_WAVE wave;
+  uint32_t rate;
+  // Frequency in Hz, slide in semitones per second, and times in seconds.
+  // A negative duration holds the note until the channel is stopped.
+  float frequency;
+  float slide;
+  float duty;
+  float attack;
+  float decay;
+  float sustain;
+  float release;
+  float duration;
+  float* table;
+  uint32_t tableLength;
+
+  // The oscillator's phase runs from 0 to 1 over each cycle, and moves on
+  // by |increment| each frame. A slide scales the increment every frame.
+  double phase;
+  double increment;
+  double slideFactor;
+  // Noise is a 15-bit shift register, clocked once per cycle
+  uint16_t lfsr;
+  float noise;
+
+  // The envelope moves by |levelStep| per frame for |stageFrames|, then
+  // moves on to the next stage.
+  AUDIO_ENVELOPE_STAGE stage;
+  float level;
+  float levelStep;
+  float levelTarget;
+  uint32_t stageFrames;
+  // Frames since the note started, to know when to release it
+  uint64_t elapsed;
+} AUDIO_SYNTH;
+
+internal void
+AUDIO_SYNTH_enterStage(AUDIO_SYNTH* synth, AUDIO_ENVELOPE_STAGE stage) {
+  while (true) {
+    synth->stage = stage;
+    float target = synth->level;
+    uint32_t frames = 0;
+    switch (stage) {
+      case AUDIO_ENVELOPE_ATTACK:
+        target = 1;
+        frames = synth->attack * synth->rate;
+        break;
+      case AUDIO_ENVELOPE_DECAY:
+        target = synth->sustain;
+        frames = synth->decay * synth->rate;
+        break;
+      case AUDIO_ENVELOPE_SUSTAIN:
+        if (synth->duration < 0) {
+          frames = UINT32_MAX;
+        } else {
+          uint64_t held = synth->duration * synth->rate;
+          frames = held > synth->elapsed ? min(held - synth->elapsed, UINT32_MAX) : 0;
+        }
+        break;
+      case AUDIO_ENVELOPE_RELEASE:
+        target = 0;
+        frames = synth->release * synth->rate;
+        break;
+      case AUDIO_ENVELOPE_DONE:
+        synth->level = 0;
+        synth->levelStep = 0;
+        synth->stageFrames = UINT32_MAX;
+        return;
+    }
+    synth->levelTarget = target;
+    if (frames > 0) {
+      synth->stageFrames = frames;
+      synth->levelStep = (target - synth->level) / frames;
+      return;
+    }
+    // Stages with no length are skipped over
+    synth->level = target;
+    stage++;
+  }
+}
+
+// Lets go of the note, so it fades out from wherever the envelope is over
+// the release time.
+internal void
+AUDIO_SYNTH_release(AUDIO_SYNTH* synth) {
+  if (synth->stage < AUDIO_ENVELOPE_RELEASE) {
+    AUDIO_SYNTH_enterStage(synth, AUDIO_ENVELOPE_RELEASE);
+  }
+}
+
+// Works out the per-frame steps for audio at |rate|. When the rate changes
+// partway through, the note carries on from the same point.
+internal void
+AUDIO_SYNTH_prepare(AUDIO_SYNTH* synth, uint32_t rate) {
+  if (synth->rate != 0 && synth->rate != rate) {
+    synth->increment *= (double)synth->rate / rate;
+    synth->elapsed = synth->elapsed * rate / synth->rate;
+    if (synth->stageFrames != UINT32_MAX) {
+      synth->stageFrames = (uint64_t)synth->stageFrames * rate / synth->rate;
+      synth->stageFrames = max(1, synth->stageFrames);
+      synth->levelStep *= (double)synth->rate / rate;
+    }
+    synth->rate = rate;
+  } else {
+    synth->rate = rate;
+    synth->increment = synth->frequency / rate;
+  }
+  synth->slideFactor = pow(2.0, synth->slide / 12.0 / rate);
+}
+
+// |params| holds AUDIO_SYNTH_PARAM_COUNT settings. Wavetables are copied.
+internal AUDIO_SYNTH*
+AUDIO_SYNTH_new(const float* params, const float* table, uint32_t tableLength, uint32_t rate) {
+  AUDIO_SYNTH* synth = calloc(1, sizeof(AUDIO_SYNTH));
+  synth->wave = params[AUDIO_SYNTH_WAVE];
+  synth->frequency = mid(1, params[AUDIO_SYNTH_FREQUENCY], rate / 2);
+  synth->slide = params[AUDIO_SYNTH_SLIDE];
+  synth->duty = mid(0.01, params[AUDIO_SYNTH_DUTY], 0.99);
+  synth->attack = max(0, params[AUDIO_SYNTH_ATTACK]);
+  synth->decay = max(0, params[AUDIO_SYNTH_DECAY]);
+  synth->sustain = mid(0, params[AUDIO_SYNTH_SUSTAIN], 1);
+  synth->release = max(0, params[AUDIO_SYNTH_RELEASE]);
+  synth->duration = params[AUDIO_SYNTH_DURATION];
+  if (table != NULL && tableLength > 0) {
+    synth->table = malloc(sizeof(float) * tableLength);
+    memcpy(synth->table, table, sizeof(float) * tableLength);
+    synth->tableLength = tableLength;
+  }
+  // Any seed but 0 works. One with a mix of bits starts straight into
+  // the noise, rather than a run of the same value.
+  synth->lfsr = 0x6D2B;
+  synth->noise = 1;
+  AUDIO_SYNTH_prepare(synth, rate);
+  AUDIO_SYNTH_enterStage(synth, AUDIO_ENVELOPE_ATTACK);
+  return synth;
+}
+
+internal void
+AUDIO_SYNTH_free(AUDIO_SYNTH* synth) {
+  if (synth != NULL) {
+    free(synth->table);
+    free(synth);
+  }
+}
+
+internal float
+AUDIO_SYNTH_oscillate(AUDIO_SYNTH* synth) {
+  float phase = synth->phase;
+  switch (synth->wave) {
+    case AUDIO_WAVE_SQUARE:
+      return phase < synth->duty ? 1 : -1;
+    case AUDIO_WAVE_TRIANGLE:
+      return 4 * fabsf(phase - 0.5f) - 1;
+    case AUDIO_WAVE_SAW:
+      return 2 * phase - 1;
+    case AUDIO_WAVE_NOISE:
+      return synth->noise;
+    case AUDIO_WAVE_WAVETABLE:
+      {
+        if (synth->tableLength == 0) {
+          return 0;
+        }
+        float position = phase * synth->tableLength;
+        uint32_t index = position;
+        float t = position - index;
+        float a = synth->table[index % synth->tableLength];
+        float b = synth->table[(index + 1) % synth->tableLength];
+        return a + (b - a) * t;
+      }
+    default:
+      return 0;
+  }
+}
+
+internal void
+AUDIO_SYNTH_advance(AUDIO_SYNTH* synth) {
+  synth->phase += synth->increment;
+  if (synth->phase >= 1) {
+    synth->phase -= 1;
+    if (synth->wave == AUDIO_WAVE_NOISE) {
+      uint16_t bit = (synth->lfsr ^ (synth->lfsr >> 1)) & 1;
+      synth->lfsr = (synth->lfsr >> 1) | (bit << 14);
+      synth->noise = (synth->lfsr & 1) ? 1 : -1;
+    }
+  }
+  if (synth->slideFactor != 1) {
+    // Past half the sample rate, a wave would only alias
+    synth->increment = mid(1e-6, synth->increment * synth->slideFactor, 0.5);
+  }
+}
+
+// Adds up to |frames| of the voice into the float stereo |out|, while the
+// gains ramp by |step| per frame, as in AUDIO_mixSpan. A virtual voice
+// moves on without being heard. Returns the number of frames before the
+// envelope finished, which is |frames| if it is still going.
+internal uint32_t
+AUDIO_SYNTH_mix(AUDIO_SYNTH* synth, float* restrict out, uint32_t frames,
+    const float* gain, const float* step, bool silent) {
+  float gainL = gain[0];
+  float gainR = gain[1];
+  uint32_t done = 0;
+  while (done < frames && synth->stage != AUDIO_ENVELOPE_DONE) {
+    uint32_t span = min(frames - done, synth->stageFrames);
+    float level = synth->level;
+    for (uint32_t i = done; i < done + span; i++) {
+      if (!silent) {
+        float value = AUDIO_SYNTH_oscillate(synth) * level;
+        out[i * 2] += value * gainL;
+        out[i * 2 + 1] += value * gainR;
+        gainL += step[0];
+        gainR += step[1];
+      }
+      level += synth->levelStep;
+      AUDIO_SYNTH_advance(synth);
+    }
+    synth->level = level;
+    synth->elapsed += span;
+    done += span;
+    if (synth->stageFrames != UINT32_MAX) {
+      synth->stageFrames -= span;
+      if (synth->stageFrames == 0) {
+        // Land exactly on the target, so rounding doesn't carry over
+        synth->level = synth->levelTarget;
+        AUDIO_SYNTH_enterStage(synth, synth->stage + 1);
+      }
+    }
+  }
+  return done;
+}
@@ -1,6 +1,10 @@
 typedef enum {
   AUDIO_TYPE_UNKNOWN,
   AUDIO_TYPE_WAV,
-  AUDIO_TYPE_OGG
+  AUDIO_TYPE_OGG,
+  AUDIO_TYPE_MOD
 } AUDIO_TYPE;
 
+// A playback rate of 1, as a step in 32.32 fixed point
+#define AUDIO_RATE_ONE ((uint64_t)1 << 32)
+
@@ -0,0 +1,205 @@
+// Writes the output of the mixer to a WAV file as it is produced. The
+// header is written up front with empty sizes, which are filled in once
+// the file is closed.
+
+#define AUDIO_WAV_HEADER_SIZE 44
+#define AUDIO_WAV_FORMAT_PCM 1
+#define AUDIO_WAV_FORMAT_FLOAT 3
+
+typedef struct {
+  FILE* file;
+  uint32_t rate;
+  bool isFloat;
+  uint16_t channels;
+  uint16_t bytesPerFrame;
+  // Frames written so far
+  uint32_t frames;
+} AUDIO_WAV_WRITER;
+
+internal void
+AUDIO_WAV_writeU16(uint8_t* out, uint16_t value) {
+  out[0] = value & 0xFF;
+  out[1] = (value >> 8) & 0xFF;
+}
+
+internal void
+AUDIO_WAV_writeU32(uint8_t* out, uint32_t value) {
+  AUDIO_WAV_writeU16(out, value & 0xFFFF);
+  AUDIO_WAV_writeU16(out + 2, value >> 16);
+}
+
+internal void
+AUDIO_WAV_WRITER_header(AUDIO_WAV_WRITER* writer) {
+  uint8_t header[AUDIO_WAV_HEADER_SIZE];
+  uint32_t dataSize = writer->frames * writer->bytesPerFrame;
+  memcpy(header, "RIFF", 4);
+  AUDIO_WAV_writeU32(header + 4, AUDIO_WAV_HEADER_SIZE - 8 + dataSize);
+  memcpy(header + 8, "WAVEfmt ", 8);
+  AUDIO_WAV_writeU32(header + 16, 16);
+  AUDIO_WAV_writeU16(header + 20, writer->isFloat ? AUDIO_WAV_FORMAT_FLOAT : AUDIO_WAV_FORMAT_PCM);
+  AUDIO_WAV_writeU16(header + 22, writer->channels);
+  AUDIO_WAV_writeU32(header + 24, writer->rate);
+  AUDIO_WAV_writeU32(header + 28, writer->rate * writer->bytesPerFrame);
+  AUDIO_WAV_writeU16(header + 32, writer->bytesPerFrame);
+  AUDIO_WAV_writeU16(header + 34, 8 * writer->bytesPerFrame / writer->channels);
+  memcpy(header + 36, "data", 4);
+  AUDIO_WAV_writeU32(header + 40, dataSize);
+  fseek(writer->file, 0, SEEK_SET);
+  fwrite(header, sizeof(header), 1, writer->file);
+}
+
+// Samples are written as they are laid out for the audio device in |spec|
+internal bool
+AUDIO_WAV_WRITER_open(AUDIO_WAV_WRITER* writer, const char* path, SDL_AudioSpec spec) {
+  writer->file = fopen(path, "wb");
+  if (writer->file == NULL) {
+    return false;
+  }
+  writer->rate = spec.freq;
+  writer->isFloat = SDL_AUDIO_ISFLOAT(spec.format);
+  writer->channels = spec.channels;
+  writer->bytesPerFrame = SDL_AUDIO_BITSIZE(spec.format) / 8 * spec.channels;
+  writer->frames = 0;
+  AUDIO_WAV_WRITER_header(writer);
+  return true;
+}
+
+internal void
+AUDIO_WAV_WRITER_write(AUDIO_WAV_WRITER* writer, const void* samples, uint32_t frames) {
+  fwrite(samples, writer->bytesPerFrame, frames, writer->file);
+  writer->frames += frames;
+}
+
+internal void
+AUDIO_WAV_WRITER_close(AUDIO_WAV_WRITER* writer) {
+  if (writer->file == NULL) {
+    return;
+  }
+  AUDIO_WAV_WRITER_header(writer);
+  fclose(writer->file);
+  writer->file = NULL;
+}
+
+// The recorder taps the master bus while the game plays. The mixer copies
+// each buffer it produces into a ring, and a thread of its own writes the
+// ring out to the file, so the audio thread never waits on the disk.
+
+// How long the ring can hold, if the disk falls behind
+#define AUDIO_RECORDER_SECONDS 2
+// How often the writer checks the ring, if it isn't woken
+#define AUDIO_RECORDER_INTERVAL 50
+
+typedef struct {
+  // The mixer only copies into the ring while this is set
+  SDL_atomic_t active;
+  SDL_atomic_t running;
+  SDL_Thread* thread;
+  SDL_sem* wake;
+  AUDIO_WAV_WRITER writer;
+
+  // Output frames, as the device receives them, with a single producer
+  // (the mixer) and a single consumer (the writer thread). The counters
+  // only ever increase, and are masked to find a place in the ring.
+  Uint8* ring;
+  uint32_t ringFrames;
+  SDL_atomic_t written;
+  SDL_atomic_t read;
+  // Frames the mixer had to throw away because the ring was full
+  SDL_atomic_t dropped;
+} AUDIO_RECORDER;
+
+// Writer thread: moves everything in the ring to the file
+internal void
+AUDIO_RECORDER_drain(AUDIO_RECORDER* recorder) {
+  uint32_t frameSize = recorder->writer.bytesPerFrame;
+  uint32_t read = SDL_AtomicGet(&recorder->read);
+  uint32_t written = SDL_AtomicGet(&recorder->written);
+  while (read != written) {
+    uint32_t start = read & (recorder->ringFrames - 1);
+    uint32_t span = min(written - read, recorder->ringFrames - start);
+    AUDIO_WAV_WRITER_write(&recorder->writer, recorder->ring + start * frameSize, span);
+    read += span;
+    SDL_AtomicSet(&recorder->read, read);
+  }
+}
+
+internal int
+AUDIO_RECORDER_run(void* data) {
+  AUDIO_RECORDER* recorder = data;
+  while (SDL_AtomicGet(&recorder->running)) {
+    SDL_SemWaitTimeout(recorder->wake, AUDIO_RECORDER_INTERVAL);
+    AUDIO_RECORDER_drain(recorder);
+  }
+  // Whatever the mixer wrote before it stopped
+  AUDIO_RECORDER_drain(recorder);
+  AUDIO_WAV_WRITER_close(&recorder->writer);
+  return 0;
+}
+
+internal bool
+AUDIO_RECORDER_isActive(AUDIO_RECORDER* recorder) {
+  return SDL_AtomicGet(&recorder->active);
+}
+
+// Game thread: starts recording audio laid out as in |spec| to |path|.
+internal bool
+AUDIO_RECORDER_start(AUDIO_RECORDER* recorder, const char* path, SDL_AudioSpec spec) {
+  if (recorder->thread != NULL || !AUDIO_WAV_WRITER_open(&recorder->writer, path, spec)) {
+    return false;
+  }
+  recorder->ringFrames = 1;
+  while (recorder->ringFrames < (uint32_t)spec.freq * AUDIO_RECORDER_SECONDS) {
+    recorder->ringFrames <<= 1;
+  }
+  recorder->ring = malloc(recorder->ringFrames * recorder->writer.bytesPerFrame);
+  SDL_AtomicSet(&recorder->written, 0);
+  SDL_AtomicSet(&recorder->read, 0);
+  SDL_AtomicSet(&recorder->dropped, 0);
+  SDL_AtomicSet(&recorder->running, 1);
+  recorder->wake = SDL_CreateSemaphore(0);
+  recorder->thread = SDL_CreateThread(AUDIO_RECORDER_run, "DOME audio recorder", recorder);
+  SDL_AtomicSet(&recorder->active, 1);
+  return true;
+}
+
+// Mixer: copies |frames| of finished output into the ring. If the writer
+// has fallen too far behind, they are dropped rather than waited for.
+internal void
+AUDIO_RECORDER_push(AUDIO_RECORDER* recorder, const Uint8* samples, uint32_t frames) {
+  if (!SDL_AtomicGet(&recorder->active)) {
+    return;
+  }
+  uint32_t frameSize = recorder->writer.bytesPerFrame;
+  uint32_t written = SDL_AtomicGet(&recorder->written);
+  uint32_t used = written - (uint32_t)SDL_AtomicGet(&recorder->read);
+  if (recorder->ringFrames - used < frames) {
+    SDL_AtomicAdd(&recorder->dropped, frames);
+    return;
+  }
+  uint32_t start = written & (recorder->ringFrames - 1);
+  uint32_t first = min(frames, recorder->ringFrames - start);
+  memcpy(recorder->ring + start * frameSize, samples, first * frameSize);
+  memcpy(recorder->ring, samples + first * frameSize, (frames - first) * frameSize);
+  SDL_AtomicSet(&recorder->written, written + frames);
+  if (SDL_SemValue(recorder->wake) == 0) {
+    SDL_SemPost(recorder->wake);
+  }
+}
+
+// Game thread: the mixer must have stopped pushing before this is called.
+// Returns how many frames were dropped.
+internal uint32_t
+AUDIO_RECORDER_stop(AUDIO_RECORDER* recorder) {
+  if (recorder->thread == NULL) {
+    return 0;
+  }
+  SDL_AtomicSet(&recorder->running, 0);
+  SDL_SemPost(recorder->wake);
+  SDL_WaitThread(recorder->thread, NULL);
+  SDL_DestroySemaphore(recorder->wake);
+  free(recorder->ring);
+  recorder->thread = NULL;
+  recorder->wake = NULL;
+  recorder->ring = NULL;
+  return SDL_AtomicGet(&recorder->dropped);
+}
@@ -21,6 +21,8 @@ internal void DEBUG_printAudioSpec(ENGINE* engine, SDL_AudioSpec spec, AUDIO_TYP
     eprintf("WAV ");
   } else if (type == AUDIO_TYPE_OGG) {
     eprintf("OGG ");
+  } else if (type == AUDIO_TYPE_MOD) {
+    eprintf("MOD ");
   } else {
     eprintf("Unknown audio file detected\n");
   }
@@ -40,4 +42,10 @@ internal void DEBUG_printAudioSpec(ENGINE* engine, SDL_AudioSpec spec, AUDIO_TYP
   }
   eprintf(")\n");
 }
+
+internal void DEBUG_printAudioDevice(ENGINE* engine, SDL_AudioSpec spec) {
+  eprintf("Audio device: %i Hz, ", spec.freq);
+  eprintf("%s, ", SDL_AUDIO_ISFLOAT(spec.format) ? "32 bit float" : "16 bit");
+  eprintf("%i channel(s), %i sample buffer\n", spec.channels, spec.samples);
+}
 #undef eprintf
@@ -43,6 +43,8 @@ ENGINE_writeFile(ENGINE* engine, char* path, char* buffer, size_t length) {
   int result = writeEntireFile(fullPath, buffer, length);
   if (result == ENOENT) {
     result = ENGINE_WRITE_PATH_INVALID;
+  } else if (result != 0) {
+    result = ENGINE_WRITE_FAILED;
   } else {
     result = ENGINE_WRITE_SUCCESS;
   }
@@ -60,18 +62,14 @@ ENGINE_readFile(ENGINE* engine, char* path, size_t* lengthPtr) {
       strcpy(pathBuf, "./");
     }
     strcat(pathBuf, path);
-    mtar_header_t h;
-    int success = mtar_find(engine->tar, pathBuf, &h);
-    if (success == MTAR_ESUCCESS) {
+    TAR_ENTRY* entry = TAR_INDEX_find(engine->tarIndex, pathBuf);
+    if (entry != NULL) {
       ENGINE_printLog(engine, "Reading from bundle: %s\n", path);
-      char* file = readFileFromTar(engine->tar, pathBuf, lengthPtr);
+      char* file = readFileFromTar(engine->tarIndex, entry, lengthPtr);
       if (file == NULL) {
-        ENGINE_printLog(engine, "Error: Couldn't read the data from the bundle.");
+        ENGINE_printLog(engine, "Error: There was a problem reading %s from the bundle.\n", pathBuf);
       }
       return file;
-    } else if (success != MTAR_ENOTFOUND) {
-      ENGINE_printLog(engine, "Error: There was a problem reading %s from the bundle.\n", pathBuf);
-      return NULL;
     }
     ENGINE_printLog(engine, "Couldn't find %s in bundle, falling back.\n", pathBuf);
   }
@@ -91,6 +89,59 @@ ENGINE_readFile(ENGINE* engine, char* path, size_t* lengthPtr) {
   }
 }
 
+// Like ENGINE_readFile, but if the file is in a mapped bundle, this returns
+// a view into the mapping without copying. |ownedPtr| reports whether the
+// caller is responsible for freeing the result.
+internal const char*
+ENGINE_viewFile(ENGINE* engine, char* path, size_t* lengthPtr, bool* ownedPtr) {
+  *ownedPtr = true;
+  if (engine->tarIndex != NULL && engine->tarIndex->image != NULL) {
+    char pathBuf[PATH_MAX];
+    strcpy(pathBuf, "\0");
+    if (strncmp(path, "./", 2) != 0) {
+      strcpy(pathBuf, "./");
+    }
+    strcat(pathBuf, path);
+    TAR_ENTRY* entry = TAR_INDEX_find(engine->tarIndex, pathBuf);
+    const char* view = entry != NULL ? TAR_INDEX_view(engine->tarIndex, entry) : NULL;
+    if (view != NULL) {
+      if (DEBUG_MODE) {
+        ENGINE_printLog(engine, "Mapping from bundle: %s\n", path);
+      }
+      if (lengthPtr != NULL) {
+        *lengthPtr = entry->size;
+      }
+      *ownedPtr = false;
+      return view;
+    }
+  }
+  return ENGINE_readFile(engine, path, lengthPtr);
+}
+
+// For data which is kept around but only read a little at a time. Loose
+// files are mapped rather than read in, where the platform allows it.
+internal char*
+ENGINE_mapFile(ENGINE* engine, char* path, size_t* lengthPtr, FILE_STORAGE* storagePtr) {
+  if (engine->tar == NULL) {
+    char* base = BASEPATH_get();
+    char* fullPath = malloc(strlen(base)+strlen(path)+1);
+    strcpy(fullPath, base);
+    strcat(fullPath, path);
+    char* data = mapEntireFile(fullPath, lengthPtr);
+    free(fullPath);
+    if (data != NULL) {
+      ENGINE_printLog(engine, "Mapping from filesystem: %s\n", path);
+      *storagePtr = FILE_STORAGE_MAPPED;
+      return data;
+    }
+  }
+
+  bool owned;
+  char* data = (char*)ENGINE_viewFile(engine, path, lengthPtr, &owned);
+  *storagePtr = owned ? FILE_STORAGE_OWNED : FILE_STORAGE_VIEW;
+  return data;
+}
+
 internal int
 ENGINE_taskHandler(ABC_TASK* task) {
   if (task->type == TASK_PRINT) {
@@ -100,6 +151,11 @@ ENGINE_taskHandler(ABC_TASK* task) {
   } else if (task->type == TASK_LOAD_FILE) {
     FILESYSTEM_loadEventHandler(task->data);
   } else if (task->type == TASK_WRITE_FILE) {
+    FILESYSTEM_saveEventHandler(task->data);
+  } else if (task->type == TASK_WRITE_FILE_APPEND) {
+    FILE_WRITER_appendEventHandler(task->data);
+  } else if (task->type == TASK_LOAD_AUDIO) {
+    AUDIO_loadEventHandler(task->data);
   }
   return 0;
 }
@@ -144,6 +200,10 @@ ENGINE_init(ENGINE* engine) {
   engine->debug.errorBuf = NULL;
   engine->debug.errorBufLen = 0;
 
+  // Open the log up front, as worker threads may log too.
+  if (engine->debug.logFile == NULL) {
+    ENGINE_openLogFile(engine);
+  }
 
 
   engine->width = GAME_WIDTH;
@@ -175,12 +235,6 @@ ENGINE_init(ENGINE* engine) {
     goto engine_init_end;
   }
 
-  engine->audioEngine = AUDIO_ENGINE_init();
-  if (engine->audioEngine == NULL) {
-    result = EXIT_FAILURE;
-    goto engine_init_end;
-  }
-
   ENGINE_EVENT_TYPE = SDL_RegisterEvents(1);
 
   ABC_FIFO_create(&engine->fifo);
@@ -221,6 +275,8 @@ ENGINE_free(ENGINE* engine) {
     free(engine->tar);
   }
 
+  TAR_INDEX_free(engine->tarIndex);
+
   if (engine->moduleMap.head != NULL) {
     MAP_free(&engine->moduleMap);
   }
@@ -4,6 +4,9 @@ struct AUDIO_ENGINE_t;
 internal struct AUDIO_ENGINE_t* AUDIO_ENGINE_init(void);
 internal void AUDIO_ENGINE_free(struct AUDIO_ENGINE_t*);
 
+// Lookup table for the contents of a game bundle, see io.c
+struct TAR_INDEX_t;
+
 typedef struct {
   double avgFps;
   double alpha;
@@ -25,6 +28,7 @@ typedef struct {
   uint32_t width;
   uint32_t height;
   mtar_t* tar;
+  struct TAR_INDEX_t* tarIndex;
   bool running;
   bool lockstep;
   int exit_status;
@@ -38,7 +42,8 @@ typedef enum {
   EVENT_NOP,
   EVENT_LOAD_FILE,
   EVENT_WRITE_FILE,
-  EVENT_WRITE_FILE_APPEND
+  EVENT_WRITE_FILE_APPEND,
+  EVENT_LOAD_AUDIO
 } EVENT_TYPE;
 
 typedef enum {
@@ -46,12 +51,14 @@ typedef enum {
   TASK_PRINT,
   TASK_LOAD_FILE,
   TASK_WRITE_FILE,
-  TASK_WRITE_FILE_APPEND
+  TASK_WRITE_FILE_APPEND,
+  TASK_LOAD_AUDIO
 } TASK_TYPE;
 
 typedef enum {
   ENGINE_WRITE_SUCCESS,
-  ENGINE_WRITE_PATH_INVALID
+  ENGINE_WRITE_PATH_INVALID,
+  ENGINE_WRITE_FAILED
 } ENGINE_WRITE_RESULT;
 
 global_variable uint32_t ENGINE_EVENT_TYPE;
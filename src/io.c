@@ -1,4 +1,7 @@
 internal void FILESYSTEM_loadEventHandler(void* task);
+internal void FILESYSTEM_saveEventHandler(void* task);
+internal void FILE_WRITER_appendEventHandler(void* task);
+internal void AUDIO_loadEventHandler(void* task);
 
 global_variable char* basePath = NULL;
 
@@ -85,14 +88,255 @@ doesFileExist(char* path) {
   return access(path, F_OK) != -1;
 }
 
+// The bundle index maps a path inside the tar to where its data lives,
+// so we only have to walk the tar headers once, when the bundle is opened.
+typedef struct {
+  char name[100];
+  size_t offset;
+  size_t size;
+} TAR_ENTRY;
+
+typedef struct TAR_INDEX_t {
+  // Capacity is always a power of two, and an empty slot has an empty name
+  size_t capacity;
+  size_t count;
+  TAR_ENTRY* entries;
+
+  // If the platform supports it, the whole bundle is mapped into memory
+  // and entries can be handed out as views into it.
+  char* image;
+  size_t imageLength;
+
+  // Otherwise, entries are read with positional reads, which don't share
+  // a file offset, so worker threads can load from the bundle in parallel.
+#ifdef _WIN32
+  FILE* file;
+  SDL_mutex* lock;
+#else
+  int fd;
+#endif
+} TAR_INDEX;
+
+internal uint32_t
+TAR_INDEX_hash(const char* name) {
+  // FNV-1a
+  uint32_t hash = 2166136261u;
+  while (*name != '\0') {
+    hash ^= (uint8_t)(*name);
+    hash *= 16777619;
+    name++;
+  }
+  return hash;
+}
+
+internal TAR_ENTRY*
+TAR_INDEX_slot(TAR_ENTRY* entries, size_t capacity, const char* name) {
+  size_t mask = capacity - 1;
+  size_t i = TAR_INDEX_hash(name) & mask;
+  while (entries[i].name[0] != '\0' && strcmp(entries[i].name, name) != 0) {
+    i = (i + 1) & mask;
+  }
+  return &entries[i];
+}
+
+internal void
+TAR_INDEX_insert(TAR_INDEX* index, mtar_header_t* h, size_t offset) {
+  // Keep the load factor under a half, so probe runs stay short.
+  if ((index->count + 1) * 2 > index->capacity) {
+    size_t capacity = index->capacity == 0 ? 64 : index->capacity * 2;
+    TAR_ENTRY* entries = calloc(capacity, sizeof(TAR_ENTRY));
+    for (size_t i = 0; i < index->capacity; i++) {
+      if (index->entries[i].name[0] != '\0') {
+        *TAR_INDEX_slot(entries, capacity, index->entries[i].name) = index->entries[i];
+      }
+    }
+    free(index->entries);
+    index->entries = entries;
+    index->capacity = capacity;
+  }
+  TAR_ENTRY* entry = TAR_INDEX_slot(index->entries, index->capacity, h->name);
+  if (entry->name[0] == '\0') {
+    index->count++;
+  }
+  // If a path appears twice, the later entry wins, like a tar extract would.
+  strcpy(entry->name, h->name);
+  entry->offset = offset;
+  entry->size = h->size;
+}
+
+internal TAR_INDEX*
+TAR_INDEX_build(mtar_t* tar, char* path) {
+  TAR_INDEX* index = calloc(1, sizeof(TAR_INDEX));
+#ifdef _WIN32
+  index->file = fopen(path, "rb");
+  index->lock = SDL_CreateMutex();
+#else
+  index->fd = open(path, O_RDONLY);
+#endif
+  mtar_header_t h;
+  mtar_rewind(tar);
+  while (mtar_read_header(tar, &h) == MTAR_ESUCCESS) {
+    if ((h.type == MTAR_TREG || h.type == '\0') && h.name[0] != '\0') {
+      // The file data begins in the block after its header
+      TAR_INDEX_insert(index, &h, tar->pos + 512);
+    }
+    if (mtar_next(tar) != MTAR_ESUCCESS) {
+      break;
+    }
+  }
+  return index;
+}
+
+// Returns NULL if the path isn't in the bundle. Because the index holds every
+// entry, a miss is definitive and never needs a rescan of the tar.
+internal TAR_ENTRY*
+TAR_INDEX_find(TAR_INDEX* index, const char* name) {
+  if (index == NULL || index->count == 0) {
+    return NULL;
+  }
+  TAR_ENTRY* entry = TAR_INDEX_slot(index->entries, index->capacity, name);
+  if (entry->name[0] == '\0') {
+    return NULL;
+  }
+  return entry;
+}
+
 internal char*
-readFileFromTar(mtar_t* tar, char* path, size_t* lengthPtr) {
+mapEntireFile(char* path, size_t* lengthPtr) {
+#ifdef _WIN32
+  // No mmap here, so callers fall back to regular reads.
+  return NULL;
+#else
+  int fd = open(path, O_RDONLY);
+  if (fd == -1) {
+    return NULL;
+  }
+  struct stat statbuf;
+  if (fstat(fd, &statbuf) != 0 || statbuf.st_size == 0) {
+    close(fd);
+    return NULL;
+  }
+  size_t length = statbuf.st_size;
+  void* data = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
+  // The mapping holds its own reference to the file
+  close(fd);
+  if (data == MAP_FAILED) {
+    return NULL;
+  }
+  if (lengthPtr != NULL) {
+    *lengthPtr = length;
+  }
+  return data;
+#endif
+}
+
+internal void
+unmapEntireFile(char* data, size_t length) {
+#ifndef _WIN32
+  if (data != NULL) {
+    munmap(data, length);
+  }
+#endif
+}
+
+// How a block of file data was obtained, and so how to let go of it.
+typedef enum {
+  FILE_STORAGE_OWNED,
+  FILE_STORAGE_VIEW,
+  FILE_STORAGE_MAPPED
+} FILE_STORAGE;
+
+internal void
+FILE_STORAGE_release(FILE_STORAGE storage, char* data, size_t length) {
+  if (storage == FILE_STORAGE_OWNED) {
+    free(data);
+  } else if (storage == FILE_STORAGE_MAPPED) {
+    unmapEntireFile(data, length);
+  }
+}
+
+internal bool
+TAR_INDEX_map(TAR_INDEX* index, char* path) {
+  index->image = mapEntireFile(path, &index->imageLength);
+  return index->image != NULL;
+}
+
+// Returns a pointer into the mapped bundle, or NULL if it isn't mapped.
+// The view stays valid until the index is freed.
+internal const char*
+TAR_INDEX_view(TAR_INDEX* index, TAR_ENTRY* entry) {
+  if (index->image == NULL || entry->offset + entry->size > index->imageLength) {
+    return NULL;
+  }
+  return index->image + entry->offset;
+}
+
+// Reads the whole of |entry| into |buffer|. This is safe to call from
+// multiple threads at once.
+internal int
+TAR_INDEX_read(TAR_INDEX* index, TAR_ENTRY* entry, char* buffer) {
+  const char* view = TAR_INDEX_view(index, entry);
+  if (view != NULL) {
+    memcpy(buffer, view, entry->size);
+    return MTAR_ESUCCESS;
+  }
+#ifdef _WIN32
+  // There's no pread, so we serialise the seek-then-read instead.
+  if (index->file == NULL) {
+    return MTAR_EOPENFAIL;
+  }
+  int result = MTAR_ESUCCESS;
+  SDL_LockMutex(index->lock);
+  if (fseek(index->file, entry->offset, SEEK_SET) != 0) {
+    result = MTAR_ESEEKFAIL;
+  } else if (fread(buffer, 1, entry->size, index->file) != entry->size) {
+    result = MTAR_EREADFAIL;
+  }
+  SDL_UnlockMutex(index->lock);
+  return result;
+#else
+  if (index->fd == -1) {
+    return MTAR_EOPENFAIL;
+  }
+  size_t total = 0;
+  while (total < entry->size) {
+    ssize_t count = pread(index->fd, buffer + total, entry->size - total, entry->offset + total);
+    if (count < 0 && errno == EINTR) {
+      continue;
+    } else if (count <= 0) {
+      return MTAR_EREADFAIL;
+    }
+    total += count;
+  }
+  return MTAR_ESUCCESS;
+#endif
+}
+
+internal void
+TAR_INDEX_free(TAR_INDEX* index) {
+  if (index != NULL) {
+#ifdef _WIN32
+    if (index->file != NULL) {
+      fclose(index->file);
+    }
+    SDL_DestroyMutex(index->lock);
+#else
+    if (index->fd != -1) {
+      close(index->fd);
+    }
+#endif
+    unmapEntireFile(index->image, index->imageLength);
+    free(index->entries);
+    free(index);
+  }
+}
+
+internal char*
+readFileFromTar(TAR_INDEX* index, TAR_ENTRY* entry, size_t* lengthPtr) {
   // We assume the tar open has been done already
-  mtar_header_t h;
-  mtar_find(tar, path, &h);
-  size_t length = h.size;
+  size_t length = entry->size;
   char* buffer = calloc(1, length + 1);
-  if (mtar_read_data(tar, buffer, length) != MTAR_ESUCCESS) {
+  if (TAR_INDEX_read(index, entry, buffer) != MTAR_ESUCCESS) {
     // Some kind of problem reading the file
     free(buffer);
     return NULL;
@@ -111,9 +355,12 @@ writeEntireFile(char* path, char* data, size_t length) {
   if (file == NULL) {
     return errno;
   }
-  fwrite(data, sizeof(char), length, file);
-  fclose(file);
-  return 0;
+  size_t written = fwrite(data, sizeof(char), length, file);
+  int result = written == length ? 0 : (errno != 0 ? errno : EIO);
+  if (fclose(file) != 0 && result == 0) {
+    result = errno;
+  }
+  return result;
 }
 
 internal char*
@@ -12,11 +12,18 @@
 #include <ctype.h>
 
 #include <unistd.h>
+#include <fcntl.h>
 #include <sys/stat.h>
+#ifndef _WIN32
+#include <sys/mman.h>
+#endif
 #include <sys/time.h>
 #include <string.h>
 #include <math.h>
 #include <libgen.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 
 #include <wren.h>
@@ -86,6 +93,7 @@
 // Used in the io variable, but we need to catch it here
 global_variable WrenHandle* bufferClass = NULL;
 global_variable WrenHandle* audioEngineClass = NULL;
+global_variable WrenHandle* audioDataClass = NULL;
 
 // These are set by cmd arguments
 #ifdef DEBUG
@@ -95,6 +103,7 @@ global_variable bool DEBUG_MODE = false;
 #endif
 global_variable size_t INITIAL_HEAP_SIZE = 1024 * 1024 * 100;
 global_variable size_t AUDIO_BUFFER_SIZE = 2048;
+global_variable int AUDIO_SAMPLE_RATE = 44100;
 
 // Game code
 #include "math.c"
@@ -108,6 +117,13 @@ global_variable size_t AUDIO_BUFFER_SIZE = 2048;
 */
 #include "util/font8x8.h"
 #include "io.c"
+#include "audio_resample.c"
+#include "audio_stream.c"
+#include "audio_wav.c"
+#include "audio_effects.c"
+#include "audio_synth.c"
+#include "audio_module.c"
+#include "audio_adpcm.c"
 #include "engine.c"
 #include "modules/dome.c"
 #if DOME_OPT_FFI
@@ -147,15 +163,19 @@ printVersion(ENGINE* engine) {
 internal void
 printUsage(ENGINE* engine) {
   ENGINE_printLog(engine, "\nUsage: \n");
-  ENGINE_printLog(engine, "  dome [-d | --debug] [-r<gif> | --record=<gif>] [-b<buf> | --buffer=<buf>] [-i<size> | --initial-heap=<size>] [entry path]\n");
+  ENGINE_printLog(engine, "  dome [-d | --debug] [-r<gif> | --record=<gif>] [-b<buf> | --buffer=<buf>] [-f<hz> | --frequency=<hz>] [-q<mode> | --resample=<mode>] [-a<wav> | --render-audio=<wav>] [-w<wav> | --record-audio=<wav>] [-i<size> | --initial-heap=<size>] [entry path]\n");
   ENGINE_printLog(engine, "  dome -h | --help\n");
   ENGINE_printLog(engine, "  dome -v | --version\n");
   ENGINE_printLog(engine, "\nOptions: \n");
+  ENGINE_printLog(engine, "  -a --render-audio=<wav> Mix audio offline into <wav> instead of playing it\n");
   ENGINE_printLog(engine, "  -b --buffer=<buf>   Set the audio buffer size (default: 11)\n");
   ENGINE_printLog(engine, "  -d --debug          Enables debug mode\n");
+  ENGINE_printLog(engine, "  -f --frequency=<hz> Set the audio output sample rate (default: 44100)\n");
   ENGINE_printLog(engine, "  -h --help           Show this screen.\n");
+  ENGINE_printLog(engine, "  -q --resample=<mode> Resample audio with 'linear' or 'sinc' (default: sinc)\n");
   ENGINE_printLog(engine, "  -v --version        Show version.\n");
   ENGINE_printLog(engine, "  -r --record=<gif>   Record video to <gif>.\n");
+  ENGINE_printLog(engine, "  -w --record-audio=<wav> Record audio to <wav>.\n");
 }
 
 int main(int argc, char* args[])
@@ -167,6 +187,8 @@ int main(int argc, char* args[])
 
   bool makeGif = false;
   char* gifName = "test.gif";
+  char* audioRenderPath = NULL;
+  char* audioRecordPath = NULL;
   int result = EXIT_SUCCESS;
   WrenVM* vm = NULL;
   size_t gameFileLength;
@@ -188,12 +210,16 @@ int main(int argc, char* args[])
 
   // TODO: Use getopt to parse the arguments better
   struct optparse_long longopts[] = {
+    {"render-audio", 'a', OPTPARSE_REQUIRED},
     {"buffer", 'b', OPTPARSE_REQUIRED},
     {"debug", 'd', OPTPARSE_NONE},
+    {"frequency", 'f', OPTPARSE_REQUIRED},
+    {"resample", 'q', OPTPARSE_REQUIRED},
     {"initial", 'i', OPTPARSE_REQUIRED},
     {"help", 'h', OPTPARSE_NONE},
     {"version", 'v', OPTPARSE_NONE},
     {"record", 'r', OPTPARSE_OPTIONAL},
+    {"record-audio", 'w', OPTPARSE_OPTIONAL},
     {0}
   };
   // char *arg;
@@ -202,19 +228,37 @@ int main(int argc, char* args[])
   optparse_init(&options, args);
   while ((option = optparse_long(&options, longopts, NULL)) != -1) {
     switch (option) {
+      case 'a':
+        audioRenderPath = options.optarg;
+        break;
       case 'b':
         {
           int shift = atoi(options.optarg);
-          if (shift == 0) {
+          if (shift <= 0 || shift > 15) {
             // If it wasn't valid, set to a meaningful default.
             AUDIO_BUFFER_SIZE = 2048;
+          } else {
+            AUDIO_BUFFER_SIZE = 1 << shift;
           }
-          AUDIO_BUFFER_SIZE = 1 << shift;
         } break;
       case 'd':
         DEBUG_MODE = true;
         ("Debug Mode enabled\n");
         break;
+      case 'f':
+        AUDIO_SAMPLE_RATE = atoi(options.optarg);
+        if (AUDIO_SAMPLE_RATE <= 0) {
+          // If it wasn't valid, set to a meaningful default.
+          AUDIO_SAMPLE_RATE = 44100;
+        }
+        break;
+      case 'q':
+        if (STRINGS_EQUAL(options.optarg, "linear")) {
+          AUDIO_RESAMPLE_QUALITY = AUDIO_RESAMPLE_LINEAR;
+        } else {
+          AUDIO_RESAMPLE_QUALITY = AUDIO_RESAMPLE_SINC;
+        }
+        break;
       case 'h':
         printTitle(&engine);
         printUsage(&engine);
@@ -235,6 +279,9 @@ int main(int argc, char* args[])
         }
         ENGINE_printLog(&engine, "GIF Recording is enabled: Saving to %s\n", gifName);
         break;
+      case 'w':
+        audioRecordPath = options.optarg != NULL ? options.optarg : "dome.wav";
+        break;
       case 'v':
         printTitle(&engine);
         printVersion(&engine);
@@ -246,6 +293,39 @@ int main(int argc, char* args[])
     }
   }
 
+  // The audio device is opened once the options which configure it are known
+  if (audioRenderPath != NULL) {
+    // No sound card is needed to render offline
+    SDL_setenv("SDL_AUDIODRIVER", "dummy", true);
+  }
+  engine.audioEngine = AUDIO_ENGINE_init();
+  if (engine.audioEngine == NULL) {
+    result = EXIT_FAILURE;
+    goto cleanup;
+  }
+  if (engine.audioEngine->deviceId == 0 && audioRenderPath == NULL) {
+    ENGINE_printLog(&engine, "Could not open an audio device: %s\n", SDL_GetError());
+  }
+  if (audioRenderPath != NULL) {
+    if (!AUDIO_ENGINE_startRender(engine.audioEngine, audioRenderPath)) {
+      ENGINE_printLog(&engine, "Could not open %s for rendering audio\n", audioRenderPath);
+      engine.exit_status = EXIT_FAILURE;
+      goto cleanup;
+    }
+    ENGINE_printLog(&engine, "Audio is being rendered offline to %s\n", audioRenderPath);
+  }
+  if (audioRecordPath != NULL) {
+    if (!AUDIO_ENGINE_startRecording(engine.audioEngine, audioRecordPath)) {
+      ENGINE_printLog(&engine, "Could not open %s for recording audio\n", audioRecordPath);
+      engine.exit_status = EXIT_FAILURE;
+      goto cleanup;
+    }
+    ENGINE_printLog(&engine, "Audio Recording is enabled: Saving to %s\n", audioRecordPath);
+  }
+  if (DEBUG_MODE) {
+    DEBUG_printAudioDevice(&engine, engine.audioEngine->spec);
+  }
+
   {
     char* defaultEggName = "game.egg";
     char* mainFileName = "main.wren";
@@ -292,6 +372,10 @@ int main(int argc, char* args[])
         fileName = basename(pathBuf);
       } else {
         ENGINE_printLog(&engine, "Loading bundle %s\n", pathBuf);
+        engine.tarIndex = TAR_INDEX_build(engine.tar, pathBuf);
+        if (!TAR_INDEX_map(engine.tarIndex, pathBuf)) {
+          ENGINE_printLog(&engine, "Bundle could not be mapped, reading entries on demand\n");
+        }
         fileName = mainFileName;
       }
     } else if (arg == NULL) {
@@ -404,6 +488,12 @@ int main(int argc, char* args[])
             ENGINE_printLog(&engine, "Event code %i\n", event.user.code);
             if (event.user.code == EVENT_LOAD_FILE) {
               FILESYSTEM_loadEventComplete(&event);
+            } else if (event.user.code == EVENT_WRITE_FILE) {
+              FILESYSTEM_saveEventComplete(&event);
+            } else if (event.user.code == EVENT_WRITE_FILE_APPEND) {
+              FILE_WRITER_timerEventComplete(&event);
+            } else if (event.user.code == EVENT_LOAD_AUDIO) {
+              AUDIO_loadEventComplete(&event);
             }
           }
       }
@@ -445,14 +535,13 @@ int main(int argc, char* args[])
       if (audioEngineClass != NULL) {
         wrenEnsureSlots(vm, 3);
         wrenSetSlotHandle(vm, 0, audioEngineClass);
-        AUDIO_ENGINE_lock(engine.audioEngine);
         interpreterResult = wrenCall(vm, updateMethod);
-        AUDIO_ENGINE_unlock(engine.audioEngine);
         if (interpreterResult != WREN_RESULT_SUCCESS) {
           result = EXIT_FAILURE;
           goto vm_cleanup;
         }
       }
+      AUDIO_ENGINE_render(engine.audioEngine, MS_PER_FRAME / 1000.0);
       lag -= MS_PER_FRAME;
       if (makeGif && gifCounter > 1) {
         for (size_t i = 0; i < imageSize; i++) {
@@ -516,6 +605,12 @@ vm_cleanup:
     if (event.type == SDL_USEREVENT) {
       if (event.user.code == EVENT_LOAD_FILE) {
         FILESYSTEM_loadEventComplete(&event);
+      } else if (event.user.code == EVENT_WRITE_FILE) {
+        FILESYSTEM_saveEventComplete(&event);
+      } else if (event.user.code == EVENT_WRITE_FILE_APPEND) {
+        FILE_WRITER_timerEventComplete(&event);
+      } else if (event.user.code == EVENT_LOAD_AUDIO) {
+        AUDIO_loadEventComplete(&event);
       }
     }
   }
@@ -532,12 +627,16 @@ vm_cleanup:
   if (audioEngineClass != NULL) {
     wrenReleaseHandle(vm, audioEngineClass);
   }
+  if (audioDataClass != NULL) {
+    wrenReleaseHandle(vm, audioDataClass);
+  }
 
 cleanup:
   // Free resources
   // TODO: Lock the Audio Engine here.
   ENGINE_reportError(&engine);
   BASEPATH_free();
+  AUDIO_ENGINE_finishRender(&engine);
   AUDIO_ENGINE_halt(engine.audioEngine);
   VM_free(vm);
   result = engine.exit_status;
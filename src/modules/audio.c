@@ -1,5 +1,3 @@
-#define AUDIO_CHANNEL_START 2
-
 typedef enum {
   CHANNEL_INVALID,
   CHANNEL_INITIALIZE,
@@ -19,41 +17,321 @@ typedef struct {
   AUDIO_TYPE audioType;
   // Length is the number of LR samples
   uint32_t length;
-  // Audio is stored as a stream of interleaved normalised values from [-1, 1)
-  float* buffer;
+  // Audio is stored as interleaved 16-bit samples, with the same number
+  // of channels (one or two) as spec.channels
+  int16_t* buffer;
+  // Or, if this is streamed, the file it is decoded from as it plays
+  AUDIO_STREAM_SOURCE* stream;
+  // Or, for tracker music, the module its channels play
+  AUDIO_MODULE* module;
+  // Or the same samples as |buffer|, compressed to a quarter of the size
+  AUDIO_ADPCM* adpcm;
+  // Held by the Wren object and every channel playing it, so unloading
+  // doesn't have to wait for the garbage collector to find the channels.
+  uint32_t refCount;
 } AUDIO_DATA;
 
 
+// How a channel playing at another rate reads between samples. These
+// match AudioInterpolation.
+typedef enum {
+  AUDIO_INTERPOLATION_LINEAR = 1,
+  AUDIO_INTERPOLATION_CUBIC = 2
+} AUDIO_INTERPOLATION;
+
+// How a positional channel gets quieter with distance. These match
+// AudioAttenuation.
+typedef enum {
+  AUDIO_ATTENUATION_INVERSE = 1,
+  AUDIO_ATTENUATION_LINEAR = 2,
+  AUDIO_ATTENUATION_EXPONENTIAL = 3
+} AUDIO_ATTENUATION;
+
+// Where the player hears from, and how sounds fade with distance. There
+// is one copy for the game thread, and one for the mixer.
 typedef struct {
+  float listener[2];
+  AUDIO_ATTENUATION model;
+  float rolloff;
+} AUDIO_SPATIAL;
+
+#define AUDIO_DEFAULT_MIN_DISTANCE 50
+#define AUDIO_DEFAULT_MAX_DISTANCE 500
+
+#define AUDIO_MAX_RATE 16
+
+typedef struct AUDIO_CHANNEL_t {
   CHANNEL_STATE state;
   char* soundId;
-  // Control variables
+  // The handle scripts use to refer to this channel, and where it sits in
+  // the engine's list of active channels
+  uint32_t handle;
+  uint32_t activeIndex;
+  bool stopRequested;
+  // How long the channel takes to fade out once it is asked to stop
+  uint32_t stopFrames;
+  // When there are more sounds than voices, the highest priority ones are
+  // mixed, and the rest become virtual. |real| is the current choice.
+  float priority;
+  bool real;
+
+  // Control variables. These belong to the game thread, and changes are
+  // sent to the mixer as commands.
   bool enabled;
   bool loop;
-
-  // Playback variables
   float volume;
   float pan;
-
-  // Position is the sample value to play next
-  size_t position;
-  size_t length;
+  float rate;
+  // Positional channels are attenuated and panned by where they are
+  // relative to the listener. |range| is the distance the sound starts
+  // to fade at, and the distance past which it fades no further.
+  bool spatial;
+  float emitter[2];
+  float range[2];
+  // The volume the player hears, once distance is taken into account
+  float audible;
   AUDIO_DATA* audio;
+  // This channel's decoder, if the audio is streamed
+  AUDIO_STREAM* stream;
+  // Or the voice which generates it, for a synth channel with no audio
+  AUDIO_SYNTH* synth;
+  // The song's place in its patterns, if the audio is a module
+  AUDIO_MODULE_PLAYER* player;
+  // The block being played, if the audio is compressed
+  AUDIO_ADPCM_DECODER* decoder;
+
+  // Published by the mixer, for the game thread to read
+  SDL_atomic_t position;
+  SDL_atomic_t finished;
+  // Set once the mixer will never touch this channel again
+  SDL_atomic_t retired;
+  // The next channel waiting to be retired
+  struct AUDIO_CHANNEL_t* retiredNext;
+
+  // Mixer state, which only the audio thread touches
+  struct {
+    bool playing;
+    // A virtual channel keeps its place in the audio without being mixed.
+    // It fades out over one block on the way.
+    bool virtual;
+    bool virtualizing;
+    bool loop;
+    float volume;
+    float pan;
+    bool spatial;
+    float emitter[2];
+    float range[2];
+    // A level on top of the volume, which ramps towards |fadeTarget| over
+    // the next |fadeFrames|. If |fadeStop| is set, the channel stops once
+    // it gets there.
+    float fade;
+    float fadeTarget;
+    uint32_t fadeFrames;
+    bool fadeStop;
+    // The left/right gains reached so far, and where they are ramping to
+    // by the end of the current callback.
+    bool gainReady;
+    float gain[2];
+    float gainTarget[2];
+    float gainStep[2];
+    // Position is the sample value to play next, and |fraction| how far
+    // past it the read position is, in 0.32 fixed point
+    size_t position;
+    uint32_t fraction;
+    // How far the read position moves per output frame, in 32.32 fixed
+    // point, and how samples are read between frames.
+    uint64_t step;
+    AUDIO_INTERPOLATION interpolation;
+    // The bus this channel is mixed into
+    uint32_t bus;
+    // The audio clock frame to start on, if the channel was scheduled
+    uint64_t start;
+    struct AUDIO_CHANNEL_t* prev;
+    struct AUDIO_CHANNEL_t* next;
+  } mix;
 } AUDIO_CHANNEL;
 
+typedef enum {
+  AUDIO_COMMAND_PLAY,
+  AUDIO_COMMAND_STOP,
+  AUDIO_COMMAND_VOLUME,
+  AUDIO_COMMAND_PAN,
+  AUDIO_COMMAND_LOOP,
+  AUDIO_COMMAND_RATE,
+  AUDIO_COMMAND_INTERPOLATION,
+  // Positional audio, which use |x| and |y|
+  AUDIO_COMMAND_POSITION,
+  AUDIO_COMMAND_RANGE,
+  AUDIO_COMMAND_LISTENER,
+  AUDIO_COMMAND_ATTENUATION,
+  AUDIO_COMMAND_VIRTUAL,
+  // Ramps the fade level to |value| over |frames|. FADE_IN starts from
+  // silence, and FADE_OUT ramps to silence and then stops the channel.
+  AUDIO_COMMAND_FADE,
+  AUDIO_COMMAND_FADE_IN,
+  AUDIO_COMMAND_FADE_OUT,
+  // Releases a synth voice's note, which stops the channel once its
+  // envelope has finished
+  AUDIO_COMMAND_NOTE_OFF,
+  // The game thread is done with the channel, so it can be freed once
+  // the mixer has let go of it
+  AUDIO_COMMAND_RELEASE,
+  // These act on a bus rather than a channel
+  AUDIO_COMMAND_BUS_VOLUME,
+  AUDIO_COMMAND_BUS_MUTE,
+  AUDIO_COMMAND_EFFECT_PARAM
+} AUDIO_COMMAND_TYPE;
+
+typedef struct {
+  AUDIO_COMMAND_TYPE type;
+  AUDIO_CHANNEL* channel;
+  float value;
+  uint32_t frames;
+  // For bus commands, which bus, and which parameter of which effect
+  uint8_t bus;
+  uint8_t effect;
+  uint8_t param;
+  float x;
+  float y;
+} AUDIO_COMMAND;
+
+// The queue's starting size, which must be a power of two
+#define AUDIO_COMMAND_QUEUE_SIZE 1024
+
+// Commands from the game thread, which the mixer applies at the start of
+// each callback. There is a single producer and a single consumer, so the
+// audio thread never waits on script execution.
+// Commands are staged through the frame and published together at the end
+// of the update, so everything a frame asks for starts on the same sample.
+typedef struct {
+  AUDIO_COMMAND* commands;
+  // Always a power of two. The queue grows if one update sends more.
+  uint32_t size;
+  SDL_atomic_t written;
+  SDL_atomic_t read;
+  uint32_t staged;
+} AUDIO_COMMAND_QUEUE;
+
+// A handle is an index into the engine's table, with the generation of the
+// slot in the upper bits, so a handle to a channel which has since been
+// freed is never mistaken for whichever channel reuses its slot.
+#define AUDIO_HANDLE_INDEX_BITS 16
+#define AUDIO_HANDLE_INDEX_MASK ((1 << AUDIO_HANDLE_INDEX_BITS) - 1)
+#define AUDIO_HANDLE_NONE AUDIO_HANDLE_INDEX_MASK
+
+#define AUDIO_DEFAULT_MAX_VOICES 64
+
+typedef struct {
+  AUDIO_CHANNEL* channel;
+  uint16_t generation;
+  uint16_t nextFree;
+} AUDIO_HANDLE_SLOT;
+
+// Timing of the mixer, for benchmarking. Only the mixer writes these, and
+// the game reads them with the device locked.
+typedef struct {
+  uint64_t callbacks;
+  uint64_t frames;
+  uint64_t ticks;
+  uint64_t maxTicks;
+  // The sum of the voices mixed by each callback
+  uint64_t voices;
+} AUDIO_MIXER_STATS;
+
+// The number of frames the mixer has output, which the game reads without
+// locking. It is 64-bit, so it is published as two halves, along with a
+// sequence number which is odd while they are being written.
+typedef struct {
+  SDL_atomic_t sequence;
+  SDL_atomic_t low;
+  SDL_atomic_t high;
+} AUDIO_CLOCK;
+
+internal void
+AUDIO_CLOCK_set(AUDIO_CLOCK* clock, uint64_t frames) {
+  SDL_AtomicIncRef(&clock->sequence);
+  SDL_AtomicSet(&clock->low, (uint32_t)frames);
+  SDL_AtomicSet(&clock->high, frames >> 32);
+  SDL_AtomicIncRef(&clock->sequence);
+}
+
+internal uint64_t
+AUDIO_CLOCK_get(AUDIO_CLOCK* clock) {
+  while (true) {
+    int sequence = SDL_AtomicGet(&clock->sequence);
+    uint32_t low = SDL_AtomicGet(&clock->low);
+    uint32_t high = SDL_AtomicGet(&clock->high);
+    if (sequence % 2 == 0 && SDL_AtomicGet(&clock->sequence) == sequence) {
+      return ((uint64_t)high << 32) | low;
+    }
+  }
+}
+
+#define AUDIO_MAX_BUSES 16
+#define AUDIO_MAX_EFFECTS 8
+#define AUDIO_MASTER_BUS 0
+
+// Channels are summed into a bus, which runs its effects over the whole
+// block. Every other bus is then summed into the master bus, which runs
+// its own effects before output.
 typedef struct {
-  size_t count;
-  AUDIO_CHANNEL* channels[];
-} AUDIO_CHANNEL_LIST;
+  float* buffer;
+  // Only the game thread changes the chain, with the device locked
+  AUDIO_EFFECT* effects[AUDIO_MAX_EFFECTS];
+  uint32_t effectCount;
+  // Mixer state: the gain reached so far, and the settings it ramps to
+  float gain;
+  float volume;
+  bool mute;
+  // Whether any channel was mixed into the bus this block
+  bool fed;
+} AUDIO_BUS;
 
 typedef struct AUDIO_ENGINE_t {
   SDL_AudioDeviceID deviceId;
   SDL_AudioSpec spec;
-  AUDIO_CHANNEL_LIST* channelList;
+  // Every channel the game has started and not yet retired, both by
+  // handle and as a dense list for the per-frame update.
+  AUDIO_HANDLE_SLOT* handles;
+  AUDIO_CHANNEL** active;
+  uint32_t handleCount;
+  uint32_t channelCapacity;
+  uint32_t activeCount;
+  uint16_t freeHandle;
+  // At most this many channels are mixed at once. |ranked| is space to
+  // sort the active channels in.
+  uint32_t maxVoices;
+  AUDIO_CHANNEL** ranked;
+  AUDIO_COMMAND_QUEUE commands;
+  AUDIO_SPATIAL spatial;
+  AUDIO_SPATIAL mixSpatial;
+  // The channels being mixed, which only the audio thread touches
+  AUDIO_CHANNEL* playing;
+  // Channels released by the game, which the mixer may still hold
+  AUDIO_CHANNEL* retired;
+  // Channels are summed into these float stereo buses before output. The
+  // buffers all hold |busFrames|.
+  AUDIO_BUS buses[AUDIO_MAX_BUSES];
+  uint32_t busCount;
+  uint32_t busFrames;
+  AUDIO_STREAMER streamer;
+  AUDIO_MIXER_STATS stats;
+  // Frames mixed since the engine started, for scheduling. Only the mixer
+  // writes |mixClock|, and publishes it to |clock|.
+  uint64_t mixClock;
+  AUDIO_CLOCK clock;
+  AUDIO_RECORDER recorder;
+  // When rendering offline, the device stays paused, and the game loop
+  // runs the mixer into |renderFile| instead.
+  bool offline;
+  char* renderPath;
+  AUDIO_WAV_WRITER renderFile;
+  Uint8* renderBuffer;
+  double renderFrames;
 } AUDIO_ENGINE;
 
+// The channels of the mix bus, which may differ from the device's
 const uint16_t channels = 2;
-const uint16_t bytesPerSample = 2 * 2 /* channels */;
 
 // audio callback function
 // Allows SDL to "pull" data into the output buffer
@@ -65,348 +343,2572 @@ AUDIO_ENGINE_capture(WrenVM* vm) {
     wrenGetVariable(vm, "audio", "AudioEngine", 0);
     audioEngineClass = wrenGetSlotHandle(vm, 0);
   }
+  if (audioDataClass == NULL) {
+    wrenGetVariable(vm, "audio", "AudioData", 0);
+    audioDataClass = wrenGetSlotHandle(vm, 0);
+  }
 }
 
-void AUDIO_ENGINE_mix(void*  userdata,
-    Uint8* stream,
-    int    outputBufferSize) {
-  AUDIO_ENGINE* audioEngine = userdata;
-  uint32_t totalSamples = outputBufferSize / bytesPerSample;
+// The mixer kernels accumulate |frames| of 16-bit |in| into the float
+// stereo bus |out|, while the gains ramp linearly by |step| per frame.
+// Samples are kept in the layout of the source file, and converted here,
+// as this is the hot loop of the mixer.
+#define AUDIO_SAMPLE_SCALE (1.0f / INT16_MAX)
+
+internal void
+AUDIO_mixSpanStereo(float* restrict out, const int16_t* restrict in, size_t frames,
+    float* gain, const float* step) {
+  float gainL = gain[0] * AUDIO_SAMPLE_SCALE;
+  float gainR = gain[1] * AUDIO_SAMPLE_SCALE;
+  float stepL = step[0] * AUDIO_SAMPLE_SCALE;
+  float stepR = step[1] * AUDIO_SAMPLE_SCALE;
+  size_t i = 0;
+#if defined(__SSE2__)
+  // Four frames per iteration, as two vectors of [L0, R0, L1, R1]
+  __m128 g0 = _mm_setr_ps(gainL, gainR, gainL + stepL, gainR + stepR);
+  __m128 g1 = _mm_add_ps(g0, _mm_setr_ps(stepL * 2, stepR * 2, stepL * 2, stepR * 2));
+  __m128 dg = _mm_setr_ps(stepL * 4, stepR * 4, stepL * 4, stepR * 4);
+  for (; i + 4 <= frames; i += 4) {
+    __m128i src = _mm_loadu_si128((const __m128i*)(in + i * 2));
+    // Widen to 32 bits, keeping the sign
+    __m128 lo = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpacklo_epi16(src, src), 16));
+    __m128 hi = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpackhi_epi16(src, src), 16));
+    _mm_storeu_ps(out + i * 2, _mm_add_ps(_mm_loadu_ps(out + i * 2), _mm_mul_ps(lo, g0)));
+    _mm_storeu_ps(out + i * 2 + 4, _mm_add_ps(_mm_loadu_ps(out + i * 2 + 4), _mm_mul_ps(hi, g1)));
+    g0 = _mm_add_ps(g0, dg);
+    g1 = _mm_add_ps(g1, dg);
+  }
+  gainL += stepL * i;
+  gainR += stepR * i;
+#endif
+  for (; i < frames; i++) {
+    out[i * 2] += in[i * 2] * gainL;
+    out[i * 2 + 1] += in[i * 2 + 1] * gainR;
+    gainL += stepL;
+    gainR += stepR;
+  }
+  gain[0] += step[0] * frames;
+  gain[1] += step[1] * frames;
+}
 
-  int16_t* writeCursor = (int16_t*)(stream);
-  SDL_memset(writeCursor, 0, outputBufferSize);
+internal void
+AUDIO_mixSpanMono(float* restrict out, const int16_t* restrict in, size_t frames,
+    float* gain, const float* step) {
+  float gainL = gain[0] * AUDIO_SAMPLE_SCALE;
+  float gainR = gain[1] * AUDIO_SAMPLE_SCALE;
+  float stepL = step[0] * AUDIO_SAMPLE_SCALE;
+  float stepR = step[1] * AUDIO_SAMPLE_SCALE;
+  size_t i = 0;
+#if defined(__SSE2__)
+  __m128 g0 = _mm_setr_ps(gainL, gainR, gainL + stepL, gainR + stepR);
+  __m128 g1 = _mm_add_ps(g0, _mm_setr_ps(stepL * 2, stepR * 2, stepL * 2, stepR * 2));
+  __m128 dg = _mm_setr_ps(stepL * 4, stepR * 4, stepL * 4, stepR * 4);
+  for (; i + 4 <= frames; i += 4) {
+    __m128i src = _mm_loadl_epi64((const __m128i*)(in + i));
+    __m128 mono = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpacklo_epi16(src, src), 16));
+    // Spread each sample across both sides: [M0, M0, M1, M1]
+    __m128 lo = _mm_unpacklo_ps(mono, mono);
+    __m128 hi = _mm_unpackhi_ps(mono, mono);
+    _mm_storeu_ps(out + i * 2, _mm_add_ps(_mm_loadu_ps(out + i * 2), _mm_mul_ps(lo, g0)));
+    _mm_storeu_ps(out + i * 2 + 4, _mm_add_ps(_mm_loadu_ps(out + i * 2 + 4), _mm_mul_ps(hi, g1)));
+    g0 = _mm_add_ps(g0, dg);
+    g1 = _mm_add_ps(g1, dg);
+  }
+  gainL += stepL * i;
+  gainR += stepR * i;
+#endif
+  for (; i < frames; i++) {
+    out[i * 2] += in[i] * gainL;
+    out[i * 2 + 1] += in[i] * gainR;
+    gainL += stepL;
+    gainR += stepR;
+  }
+  gain[0] += step[0] * frames;
+  gain[1] += step[1] * frames;
+}
 
-  int32_t samplesToWrite = totalSamples;//  - samplesQueued;
-  int totalChannels = 0;
+internal void
+AUDIO_mixSpan(float* restrict out, const int16_t* restrict in, uint16_t inChannels, size_t frames,
+    float* gain, const float* step) {
+  if (inChannels == 1) {
+    AUDIO_mixSpanMono(out, in, frames, gain, step);
+  } else {
+    AUDIO_mixSpanStereo(out, in, frames, gain, step);
+  }
+}
 
-  // Get channel
-  for (int i = 0; i < samplesToWrite; i++) {
-    int totalEnabled = 0;
-    float left = 0;
-    float right = 0;
-    AUDIO_CHANNEL_LIST* channelList = audioEngine->channelList;
-    for (size_t c = 0; c < channelList->count; c++) {
-      AUDIO_CHANNEL* channel = (AUDIO_CHANNEL*)(channelList->channels[c]);
-      if (channel != NULL && channel->audio != NULL) {
-        AUDIO_DATA* audio = channel->audio;
-        if (channel->enabled) {
-          totalEnabled++;
-          float* readCursor = (float*)(audio->buffer);
-          readCursor += channel->position * channels;
-          float volume = channel->volume;
-          float pan = (channel->pan + 1) * M_PI / 4; // Channel pan is [-1,1] real pan needs to be [0,1]
-
-          left += readCursor[0] * cos(pan) * volume;
-          right += readCursor[1] * sin(pan) * volume;
-        }
-        channel->position++;
-        if (channel->loop && channel->position >= audio->length) {
-          channel->position = 0;
-        }
-        channel->enabled = channel->enabled && channel->position < audio->length;
+// How loud a sound at |emitter| is to the listener, from 0 to 1. If |pan|
+// is given, it is set to where the sound sits between left and right.
+// Sounds nearer than the minimum distance aren't panned fully to one side,
+// so they don't jump across as they pass the listener.
+internal float
+AUDIO_SPATIAL_gain(const AUDIO_SPATIAL* spatial, const float* emitter, const float* range, float* pan) {
+  float dx = emitter[0] - spatial->listener[0];
+  float dy = emitter[1] - spatial->listener[1];
+  float minDistance = range[0];
+  float maxDistance = range[1];
+  float distanceSquared = dx * dx + dy * dy;
+  if (pan != NULL) {
+    *pan = dx / sqrtf(distanceSquared + minDistance * minDistance);
+  }
+  float distance = mid(minDistance, sqrtf(distanceSquared), maxDistance);
+  switch (spatial->model) {
+    case AUDIO_ATTENUATION_LINEAR:
+      if (maxDistance <= minDistance) {
+        return 1;
       }
-    }
-    if (totalEnabled > 1) {
-      left = (float)tanh(left); ///= totalEnabled;
-      right = (float)tanh(right); //= totalEnabled;
-    }
-    if (totalEnabled > 0) {
-      writeCursor[i*2] = (int16_t)(left * INT16_MAX);
-      writeCursor[i*2+1] = (int16_t)(right * INT16_MAX);
-    }
-    totalChannels = max(totalEnabled, totalChannels);
+      return max(0, 1 - spatial->rolloff * (distance - minDistance) / (maxDistance - minDistance));
+    case AUDIO_ATTENUATION_EXPONENTIAL:
+      return powf(distance / minDistance, -spatial->rolloff);
+    case AUDIO_ATTENUATION_INVERSE:
+    default:
+      return minDistance / (minDistance + spatial->rolloff * (distance - minDistance));
   }
 }
 
-internal void AUDIO_allocate(WrenVM* vm) {
-  wrenEnsureSlots(vm, 1);
-  AUDIO_DATA* data = (AUDIO_DATA*)wrenSetSlotNewForeign(vm, 0, 0, sizeof(AUDIO_DATA));
-  int length;
-  ASSERT_SLOT_TYPE(vm, 1, STRING, "buffer");
-  const char* fileBuffer = wrenGetSlotBytes(vm, 1, &length);
+// Works out the gain a channel should reach by the end of this span of
+// |totalFrames|, and how far to move towards it per frame, so changes are
+// ramped rather than stepped. The fade level moves from |fadeStart| to
+// |fadeEnd| over the span.
+internal void
+AUDIO_CHANNEL_prepareGain(AUDIO_CHANNEL* channel, const AUDIO_SPATIAL* spatial,
+    uint32_t totalFrames, float fadeStart, float fadeEnd) {
+  float volume = channel->mix.virtualizing ? 0 : channel->mix.volume;
+  float pan = channel->mix.pan;
+  if (channel->mix.spatial) {
+    float offset;
+    volume *= AUDIO_SPATIAL_gain(spatial, channel->mix.emitter, channel->mix.range, &offset);
+    pan = mid(-1, pan + offset, 1);
+  }
+  // Channel pan is [-1,1] real pan needs to be [0,1]
+  pan = (pan + 1) * M_PI / 4;
+  float target[2] = { cos(pan) * volume * fadeEnd, sin(pan) * volume * fadeEnd };
+  if (!channel->mix.gainReady) {
+    channel->mix.gain[0] = cos(pan) * volume * fadeStart;
+    channel->mix.gain[1] = sin(pan) * volume * fadeStart;
+    channel->mix.gainReady = true;
+  }
+  channel->mix.gainTarget[0] = target[0];
+  channel->mix.gainTarget[1] = target[1];
+  channel->mix.gainStep[0] = (target[0] - channel->mix.gain[0]) / totalFrames;
+  channel->mix.gainStep[1] = (target[1] - channel->mix.gain[1]) / totalFrames;
+}
 
-  int16_t* tempBuffer;
-  if (strncmp(fileBuffer, "RIFF", 4) == 0 &&
-      strncmp(&fileBuffer[8], "WAVE", 4) == 0) {
-    data->audioType = AUDIO_TYPE_WAV;
+// Mixes a whole block of |frames| for one channel into the bus, splitting
+// it only where the audio ends or loops. Returns false once the channel
+// has finished playing.
+internal bool
+AUDIO_CHANNEL_mix(AUDIO_CHANNEL* channel, float* bus, uint32_t frames) {
+  const int16_t* samples = channel->audio->buffer;
+  uint16_t inChannels = channel->audio->spec.channels;
+  size_t length = channel->audio->length;
+  size_t position = channel->mix.position;
+  bool loop = channel->mix.loop;
+  bool playing = true;
+  if (length == 0) {
+    // There is nothing to loop over
+    return false;
+  }
 
-    // Loading the WAV file
-    SDL_RWops* src = SDL_RWFromConstMem(fileBuffer, length);
-    void* result = SDL_LoadWAV_RW(src, 1, &data->spec, ((uint8_t**)&tempBuffer), &data->length);
-    if (result == NULL) {
-      VM_ABORT(vm, "Invalid WAVE file");
-      return;
+  uint32_t done = 0;
+  while (done < frames && playing) {
+    size_t span = min(frames - done, length - position);
+    if (!channel->mix.virtual) {
+      AUDIO_mixSpan(bus + done * channels, samples + position * inChannels, inChannels, span, channel->mix.gain, channel->mix.gainStep);
     }
-    data->length /= sizeof(int16_t) * data->spec.channels;
-  } else if (strncmp(fileBuffer, "OggS", 4) == 0) {
-    data->audioType = AUDIO_TYPE_OGG;
-
-    int channelsInFile = 0;
-    int freq = 0;
-    memset(&data->spec, 0, sizeof(SDL_AudioSpec));
-    // Loading the OGG file
-    int32_t result = stb_vorbis_decode_memory((const unsigned char*)fileBuffer, length, &channelsInFile, &freq, &tempBuffer);
-    if (result == -1) {
-      VM_ABORT(vm, "Invalid OGG file");
-      return;
+    position += span;
+    done += span;
+    if (position >= length) {
+      if (loop) {
+        position = 0;
+      } else {
+        playing = false;
+      }
     }
-    data->length = result;
-
-    data->spec.channels = channelsInFile;
-    data->spec.freq = freq;
-    data->spec.format = AUDIO_S16LSB;
-  } else {
-    VM_ABORT(vm, "Audio file was of an incompatible format");
-    return;
   }
 
-  data->buffer = calloc(channels * data->length, sizeof(float));
-  assert(data->buffer != NULL);
-  assert(data->length != UINT32_MAX);
-  // Process incoming values into an intermediate mixable format
-  for (uint32_t i = 0; i < data->length; i++) {
-    data->buffer[i * channels] = (float)(tempBuffer[i * data->spec.channels]) / INT16_MAX;
-    if (data->spec.channels == 1) {
-      data->buffer[i * channels + 1] = (float)(tempBuffer[i * data->spec.channels]) / INT16_MAX;
-    } else {
-      data->buffer[i * channels + 1] = (float)(tempBuffer[i * data->spec.channels + 1]) / INT16_MAX;
-    }
+  channel->mix.position = position;
+  if (channel->mix.gainReady) {
+    // Land exactly on the target, so rounding doesn't drift over time.
+    channel->mix.gain[0] = channel->mix.gainTarget[0];
+    channel->mix.gain[1] = channel->mix.gainTarget[1];
   }
-  // free the intermediate buffers
-  if (data->audioType == AUDIO_TYPE_WAV) {
-    SDL_FreeWAV((uint8_t*)tempBuffer);
-  } else if (data->audioType == AUDIO_TYPE_OGG) {
-    free(tempBuffer);
-  }
-  if (DEBUG_MODE) {
-    ENGINE* engine = wrenGetUserData(vm);
-    DEBUG_printAudioSpec(engine, data->spec, data->audioType);
+  return playing;
+}
+
+// Reads a sample of |c| for AUDIO_CHANNEL_mixPitched, at an |index| which
+// may fall past either end of the audio. Looping audio wraps around, and
+// otherwise the nearest end is held.
+internal float
+AUDIO_CHANNEL_sampleAt(const int16_t* samples, uint16_t inChannels, int64_t length, bool loop, int64_t index, int c) {
+  if (index < 0) {
+    index = loop ? index + length : 0;
+  } else if (index >= length) {
+    index = loop ? index - length : length - 1;
   }
+  return samples[index * inChannels + (inChannels == 1 ? 0 : c)];
 }
 
-internal void AUDIO_finalize(void* data) {
-  AUDIO_DATA* audioData = (AUDIO_DATA*)data;
-  if (audioData->buffer != NULL) {
-    if (audioData->audioType == AUDIO_TYPE_WAV || audioData->audioType == AUDIO_TYPE_OGG) {
-      free(audioData->buffer);
+// Mixes a block for a channel which isn't playing at its natural rate.
+// The read position moves by |step| each frame, and samples in between
+// are interpolated.
+internal bool
+AUDIO_CHANNEL_mixPitched(AUDIO_CHANNEL* channel, float* bus, uint32_t frames) {
+  const int16_t* samples = channel->audio->buffer;
+  uint16_t inChannels = channel->audio->spec.channels;
+  int64_t length = channel->audio->length;
+  uint64_t end = (uint64_t)length << 32;
+  uint64_t cursor = ((uint64_t)channel->mix.position << 32) | channel->mix.fraction;
+  uint64_t step = channel->mix.step;
+  bool loop = channel->mix.loop;
+  bool cubic = channel->mix.interpolation == AUDIO_INTERPOLATION_CUBIC;
+  bool playing = true;
+
+  float gain[2] = { channel->mix.gain[0] * AUDIO_SAMPLE_SCALE, channel->mix.gain[1] * AUDIO_SAMPLE_SCALE };
+  float gainStep[2] = { channel->mix.gainStep[0] * AUDIO_SAMPLE_SCALE, channel->mix.gainStep[1] * AUDIO_SAMPLE_SCALE };
+  for (uint32_t i = 0; i < frames; i++) {
+    if (cursor >= end) {
+      if (!loop || length == 0) {
+        playing = false;
+        break;
+      }
+      cursor %= end;
+    }
+    if (!channel->mix.virtual) {
+      int64_t index = cursor >> 32;
+      float t = (uint32_t)cursor * (1.0f / AUDIO_RATE_ONE);
+      for (int c = 0; c < 2; c++) {
+        float p1 = AUDIO_CHANNEL_sampleAt(samples, inChannels, length, loop, index, c);
+        float p2 = AUDIO_CHANNEL_sampleAt(samples, inChannels, length, loop, index + 1, c);
+        float value;
+        if (cubic) {
+          // Catmull-Rom, through the two samples either side
+          float p0 = AUDIO_CHANNEL_sampleAt(samples, inChannels, length, loop, index - 1, c);
+          float p3 = AUDIO_CHANNEL_sampleAt(samples, inChannels, length, loop, index + 2, c);
+          value = p1 + 0.5f * t * (p2 - p0 + t * (2 * p0 - 5 * p1 + 4 * p2 - p3 + t * (3 * (p1 - p2) + p3 - p0)));
+        } else {
+          value = p1 + (p2 - p1) * t;
+        }
+        bus[i * 2 + c] += value * gain[c];
+        gain[c] += gainStep[c];
+      }
+    }
+    cursor += step;
+  }
+  if (playing && cursor >= end) {
+    if (loop && length > 0) {
+      cursor %= end;
+    } else {
+      playing = false;
     }
-    audioData->buffer = NULL;
   }
-}
-internal void AUDIO_unload(WrenVM* vm) {
-  ASSERT_SLOT_TYPE(vm, 1, FOREIGN, "audio data");
-  AUDIO_DATA* data = (AUDIO_DATA*)wrenGetSlotForeign(vm, 0);
-  AUDIO_finalize(data);
-}
 
-internal void AUDIO_getLength(WrenVM* vm) {
-  AUDIO_DATA* data = (AUDIO_DATA*)wrenGetSlotForeign(vm, 0);
-  wrenEnsureSlots(vm, 1);
-  wrenSetSlotDouble(vm, 0, data->length);
+  channel->mix.position = cursor >> 32;
+  channel->mix.fraction = (uint32_t)cursor;
+  if (channel->mix.gainReady) {
+    channel->mix.gain[0] = channel->mix.gainTarget[0];
+    channel->mix.gain[1] = channel->mix.gainTarget[1];
+  }
+  return playing;
 }
 
-internal AUDIO_ENGINE*
-AUDIO_ENGINE_init(void) {
-  SDL_InitSubSystem(SDL_INIT_AUDIO);
-  AUDIO_ENGINE* engine = malloc(sizeof(AUDIO_ENGINE));
-  engine->channelList = malloc(sizeof(AUDIO_CHANNEL_LIST) + sizeof(AUDIO_CHANNEL*) * AUDIO_CHANNEL_START);
-  engine->channelList->count = AUDIO_CHANNEL_START;
-  for (int i = 0; i < AUDIO_CHANNEL_START; i++) {
-    engine->channelList->channels[i] = NULL;
-  }
-  // SETUP player
-  // set the callback function
-  (engine->spec).freq = 44100;
-  (engine->spec).format = AUDIO_S16LSB;
-  (engine->spec).channels = channels; // TODO: consider mono/stereo
-  (engine->spec).samples = AUDIO_BUFFER_SIZE; // Consider making this configurable
-  (engine->spec).callback = AUDIO_ENGINE_mix;
-  (engine->spec).userdata = engine;
-
-  // open audio device
-  engine->deviceId = SDL_OpenAudioDevice(NULL, 0, &(engine->spec), NULL, 0);
-  // TODO: Handle if we can't get a device!
-
-  // Unpause audio so we can begin taking over the buffer
-  SDL_PauseAudioDevice(engine->deviceId, 0);
-  return engine;
+// Mixes a block of a synth voice. Returns false once its envelope has
+// finished.
+internal bool
+AUDIO_CHANNEL_mixSynth(AUDIO_CHANNEL* channel, float* bus, uint32_t frames) {
+  AUDIO_SYNTH* synth = channel->synth;
+  channel->mix.position += AUDIO_SYNTH_mix(synth, bus, frames,
+      channel->mix.gain, channel->mix.gainStep, channel->mix.virtual);
+  if (channel->mix.gainReady) {
+    channel->mix.gain[0] = channel->mix.gainTarget[0];
+    channel->mix.gain[1] = channel->mix.gainTarget[1];
+  }
+  return synth->stage != AUDIO_ENVELOPE_DONE;
 }
 
-internal AUDIO_CHANNEL_LIST*
-AUDIO_CHANNEL_LIST_resize(AUDIO_CHANNEL_LIST* list, size_t channels) {
-  if (list->count < channels) {
-    list = realloc(list, sizeof(AUDIO_CHANNEL_LIST) + sizeof(AUDIO_CHANNEL*) * channels);
-    list->count = channels;
-    for (int i = 0; i < AUDIO_CHANNEL_START; i++) {
-      list->channels[i] = NULL;
+// The compressed version of AUDIO_CHANNEL_mix, which decodes the audio
+// a block at a time as it reaches it.
+internal bool
+AUDIO_CHANNEL_mixCompressed(AUDIO_CHANNEL* channel, float* bus, uint32_t frames) {
+  const AUDIO_ADPCM* adpcm = channel->audio->adpcm;
+  AUDIO_ADPCM_DECODER* decoder = channel->decoder;
+  uint16_t inChannels = adpcm->channels;
+  size_t length = channel->audio->length;
+  size_t position = channel->mix.position;
+  bool loop = channel->mix.loop;
+  bool playing = true;
+  if (length == 0) {
+    return false;
+  }
+
+  uint32_t done = 0;
+  while (done < frames && playing) {
+    uint32_t block = position / adpcm->blockFrames;
+    uint32_t offset = position % adpcm->blockFrames;
+    size_t span = min(frames - done, min(length - position, adpcm->blockFrames - offset));
+    if (!channel->mix.virtual) {
+      if (decoder->block != block) {
+        AUDIO_ADPCM_decodeBlock(adpcm, block, decoder->frames);
+        decoder->block = block;
+      }
+      AUDIO_mixSpan(bus + done * channels, decoder->frames + offset * inChannels, inChannels, span, channel->mix.gain, channel->mix.gainStep);
+    }
+    position += span;
+    done += span;
+    if (position >= length) {
+      if (loop) {
+        position = 0;
+      } else {
+        playing = false;
+      }
     }
   }
-  return list;
-}
 
-internal void AUDIO_ENGINE_lock(AUDIO_ENGINE* engine) {
-  SDL_LockAudioDevice(engine->deviceId);
+  channel->mix.position = position;
+  if (channel->mix.gainReady) {
+    channel->mix.gain[0] = channel->mix.gainTarget[0];
+    channel->mix.gain[1] = channel->mix.gainTarget[1];
+  }
+  return playing;
 }
 
-internal void AUDIO_ENGINE_unlock(AUDIO_ENGINE* engine) {
-  SDL_UnlockAudioDevice(engine->deviceId);
+// Mixes a block of a module. Returns false once the song has ended.
+internal bool
+AUDIO_CHANNEL_mixModule(AUDIO_CHANNEL* channel, float* bus, uint32_t frames) {
+  AUDIO_MODULE_PLAYER* player = channel->player;
+  size_t length = channel->audio->length;
+  player->loop = channel->mix.loop;
+  uint32_t done = AUDIO_MODULE_PLAYER_mix(player, bus, frames,
+      channel->mix.gain, channel->mix.gainStep, channel->mix.virtual);
+  channel->mix.position += done;
+  if (channel->mix.loop && length > 0) {
+    channel->mix.position %= length;
+  }
+  if (channel->mix.gainReady) {
+    channel->mix.gain[0] = channel->mix.gainTarget[0];
+    channel->mix.gain[1] = channel->mix.gainTarget[1];
+  }
+  return done == frames;
 }
 
-internal void AUDIO_ENGINE_update(WrenVM* vm) {
-  // We need additional slots to parse a list
-  wrenEnsureSlots(vm, 3);
-  ENGINE* engine = wrenGetUserData(vm);
-  AUDIO_ENGINE* data = engine->audioEngine;
-
-  AUDIO_ENGINE_lock(data);
-  ASSERT_SLOT_TYPE(vm, 1, LIST, "channels");
-  uint8_t soundCount = wrenGetListCount(vm, 1);
-  data->channelList = AUDIO_CHANNEL_LIST_resize(data->channelList, soundCount);
-  for (size_t i = 0; i < data->channelList->count; i++) {
-    if (i < soundCount) {
-      wrenGetListElement(vm, 1, i, 2);
-      if (wrenGetSlotType(vm, 2) != WREN_TYPE_NULL) {
-        data->channelList->channels[i] = wrenGetSlotForeign(vm, 2);
+// The streamed version of AUDIO_CHANNEL_mix, which reads from the
+// channel's ring of decoded frames instead.
+internal bool
+AUDIO_CHANNEL_mixStream(AUDIO_CHANNEL* channel, float* bus, uint32_t frames) {
+  AUDIO_STREAM* stream = channel->stream;
+  size_t length = channel->audio->length;
+  size_t position = channel->mix.position;
+  bool playing = true;
+
+  uint32_t done = 0;
+  while (done < frames) {
+    // Check this first, so we can't miss frames written just before it is set
+    bool ended = SDL_AtomicGet(&stream->ended);
+    const int16_t* samples;
+    uint32_t span = AUDIO_STREAM_peek(stream, &samples);
+    if (span == 0) {
+      if (ended) {
+        playing = false;
       }
-    } else {
-      data->channelList->channels[i] = NULL;
+      // Otherwise the decoder has fallen behind, and we play silence.
+      break;
+    }
+    span = min(span, frames - done);
+    if (!channel->mix.virtual) {
+      AUDIO_mixSpanStereo(bus + done * channels, samples, span, channel->mix.gain, channel->mix.gainStep);
     }
+    AUDIO_STREAM_consume(stream, span);
+    position += span;
+    done += span;
   }
-  AUDIO_ENGINE_unlock(data);
-}
 
-internal void AUDIO_ENGINE_pause(AUDIO_ENGINE* engine) {
-  SDL_PauseAudioDevice(engine->deviceId, 1);
+  if (channel->mix.loop && length > 0) {
+    position %= length;
+  }
+  channel->mix.position = position;
+  if (channel->mix.gainReady) {
+    channel->mix.gain[0] = channel->mix.gainTarget[0];
+    channel->mix.gain[1] = channel->mix.gainTarget[1];
+  }
+  return playing;
 }
 
-internal void AUDIO_ENGINE_resume(AUDIO_ENGINE* engine) {
-  SDL_PauseAudioDevice(engine->deviceId, 0);
+// These maintain the list of playing channels, on the audio thread.
+internal void
+AUDIO_ENGINE_link(AUDIO_ENGINE* engine, AUDIO_CHANNEL* channel) {
+  if (channel->mix.playing) {
+    return;
+  }
+  channel->mix.prev = NULL;
+  channel->mix.next = engine->playing;
+  if (engine->playing != NULL) {
+    engine->playing->mix.prev = channel;
+  }
+  engine->playing = channel;
+  channel->mix.playing = true;
 }
 
-internal void AUDIO_ENGINE_halt(AUDIO_ENGINE* engine) {
-  if (engine != NULL) {
-    SDL_PauseAudioDevice(engine->deviceId, 1);
-    SDL_CloseAudioDevice(engine->deviceId);
+internal void
+AUDIO_ENGINE_unlink(AUDIO_ENGINE* engine, AUDIO_CHANNEL* channel) {
+  if (!channel->mix.playing) {
+    return;
+  }
+  if (channel->mix.prev != NULL) {
+    channel->mix.prev->mix.next = channel->mix.next;
+  } else {
+    engine->playing = channel->mix.next;
+  }
+  if (channel->mix.next != NULL) {
+    channel->mix.next->mix.prev = channel->mix.prev;
   }
+  channel->mix.prev = NULL;
+  channel->mix.next = NULL;
+  channel->mix.playing = false;
 }
 
-internal void AUDIO_ENGINE_free(AUDIO_ENGINE* engine) {
-  // We might need to free contained audio here
-  AUDIO_ENGINE_halt(engine);
-  free(engine->channelList);
+// Applies every command sent since the last callback.
+internal void
+AUDIO_ENGINE_drain(AUDIO_ENGINE* engine) {
+  AUDIO_COMMAND_QUEUE* queue = &engine->commands;
+  uint32_t read = SDL_AtomicGet(&queue->read);
+  uint32_t written = SDL_AtomicGet(&queue->written);
+  for (; read != written; read++) {
+    AUDIO_COMMAND* command = &queue->commands[read & (queue->size - 1)];
+    AUDIO_CHANNEL* channel = command->channel;
+    switch (command->type) {
+      case AUDIO_COMMAND_PLAY:
+        AUDIO_ENGINE_link(engine, channel);
+        break;
+      case AUDIO_COMMAND_STOP:
+        AUDIO_ENGINE_unlink(engine, channel);
+        break;
+      case AUDIO_COMMAND_VOLUME:
+        channel->mix.volume = command->value;
+        break;
+      case AUDIO_COMMAND_PAN:
+        channel->mix.pan = command->value;
+        break;
+      case AUDIO_COMMAND_LOOP:
+        channel->mix.loop = command->value != 0;
+        break;
+      case AUDIO_COMMAND_RATE:
+        channel->mix.step = (double)command->value * AUDIO_RATE_ONE;
+        break;
+      case AUDIO_COMMAND_INTERPOLATION:
+        channel->mix.interpolation = command->value;
+        break;
+      case AUDIO_COMMAND_POSITION:
+        channel->mix.spatial = true;
+        channel->mix.emitter[0] = command->x;
+        channel->mix.emitter[1] = command->y;
+        break;
+      case AUDIO_COMMAND_RANGE:
+        channel->mix.range[0] = command->x;
+        channel->mix.range[1] = command->y;
+        break;
+      case AUDIO_COMMAND_LISTENER:
+        engine->mixSpatial.listener[0] = command->x;
+        engine->mixSpatial.listener[1] = command->y;
+        break;
+      case AUDIO_COMMAND_ATTENUATION:
+        engine->mixSpatial.model = command->value;
+        engine->mixSpatial.rolloff = command->x;
+        break;
+      case AUDIO_COMMAND_FADE_IN:
+        channel->mix.fade = 0;
+        // Fallthrough
+      case AUDIO_COMMAND_FADE:
+      case AUDIO_COMMAND_FADE_OUT:
+        channel->mix.fadeTarget = command->value;
+        channel->mix.fadeFrames = command->frames;
+        channel->mix.fadeStop = command->type == AUDIO_COMMAND_FADE_OUT;
+        if (command->frames == 0) {
+          channel->mix.fade = command->value;
+        }
+        break;
+      case AUDIO_COMMAND_NOTE_OFF:
+        AUDIO_SYNTH_release(channel->synth);
+        break;
+      case AUDIO_COMMAND_VIRTUAL:
+        if (command->value == 0) {
+          channel->mix.virtual = false;
+          channel->mix.virtualizing = false;
+          // Fade back in from silence
+          channel->mix.gain[0] = 0;
+          channel->mix.gain[1] = 0;
+          channel->mix.gainReady = true;
+        } else if (!channel->mix.virtual) {
+          channel->mix.virtualizing = true;
+        }
+        break;
+      case AUDIO_COMMAND_RELEASE:
+        AUDIO_ENGINE_unlink(engine, channel);
+        SDL_AtomicSet(&channel->retired, 1);
+        break;
+      case AUDIO_COMMAND_BUS_VOLUME:
+        engine->buses[command->bus].volume = command->value;
+        break;
+      case AUDIO_COMMAND_BUS_MUTE:
+        engine->buses[command->bus].mute = command->value != 0;
+        break;
+      case AUDIO_COMMAND_EFFECT_PARAM:
+        {
+          AUDIO_BUS* bus = &engine->buses[command->bus];
+          // The chain may have been cleared since this was sent
+          if (command->effect < bus->effectCount) {
+            AUDIO_EFFECT_setParam(bus->effects[command->effect], command->param, command->value);
+          }
+        } break;
+    }
+  }
+  SDL_AtomicSet(&queue->read, read);
 }
 
-internal void AUDIO_CHANNEL_allocate(WrenVM* vm) {
-  wrenEnsureSlots(vm, 1);
-  AUDIO_CHANNEL* data = (AUDIO_CHANNEL*)wrenSetSlotNewForeign(vm, 0, 0, sizeof(AUDIO_CHANNEL));
-  ASSERT_SLOT_TYPE(vm, 1, STRING, "sound id");
-  char* soundId = wrenGetSlotString(vm, 1);
-  size_t len = strlen(soundId);
-  data->soundId = malloc((1 + len) * sizeof(char));
-  strcpy(data->soundId, soundId);
-  data->soundId[len] = '\0';
+// Mixes a block for one channel. The block is split where a fade reaches
+// its target, so fades land on the exact sample they were asked for.
+internal bool
+AUDIO_CHANNEL_process(AUDIO_CHANNEL* channel, const AUDIO_SPATIAL* spatial, float* bus, uint32_t frames) {
+  bool playing = true;
+  uint32_t done = 0;
+  while (done < frames && playing) {
+    uint32_t span = frames - done;
+    float fadeStart = channel->mix.fade;
+    float fadeEnd = channel->mix.fadeTarget;
+    if (channel->mix.fadeFrames > 0) {
+      span = min(span, channel->mix.fadeFrames);
+      fadeEnd = fadeStart + (fadeEnd - fadeStart) * span / channel->mix.fadeFrames;
+      channel->mix.fadeFrames -= span;
+    }
+    channel->mix.fade = fadeEnd;
 
-  data->state = CHANNEL_INITIALIZE;
-  data->enabled = false;
-  data->loop = false;
-  data->audio = NULL;
-}
+    AUDIO_CHANNEL_prepareGain(channel, spatial, span, fadeStart, fadeEnd);
+    if (channel->synth != NULL) {
+      playing = AUDIO_CHANNEL_mixSynth(channel, bus + done * channels, span);
+    } else if (channel->player != NULL) {
+      playing = AUDIO_CHANNEL_mixModule(channel, bus + done * channels, span);
+    } else if (channel->decoder != NULL) {
+      playing = AUDIO_CHANNEL_mixCompressed(channel, bus + done * channels, span);
+    } else if (channel->stream != NULL) {
+      playing = AUDIO_CHANNEL_mixStream(channel, bus + done * channels, span);
+    } else if (channel->mix.step != AUDIO_RATE_ONE) {
+      playing = AUDIO_CHANNEL_mixPitched(channel, bus + done * channels, span);
+    } else {
+      if (channel->mix.fraction != 0) {
+        // Back at the normal rate, so the cursor moves to the nearest
+        // sample, and the channel can be mixed without interpolation.
+        channel->mix.position += channel->mix.fraction >> 31;
+        channel->mix.fraction = 0;
+      }
+      playing = AUDIO_CHANNEL_mix(channel, bus + done * channels, span);
+    }
+    done += span;
 
-internal void AUDIO_CHANNEL_setAudio(WrenVM* vm) {
-  AUDIO_CHANNEL* data = (AUDIO_CHANNEL*)wrenGetSlotForeign(vm, 0);
-  if (data->state == CHANNEL_INITIALIZE) {
-    ASSERT_SLOT_TYPE(vm, 1, FOREIGN, "audio");
-    data->audio = (AUDIO_DATA*)wrenGetSlotForeign(vm, 1);
-  } else {
-    VM_ABORT(vm, "Cannot change audio in channel once initialized");
+    if (channel->mix.fadeStop && channel->mix.fadeFrames == 0) {
+      playing = false;
+    }
   }
+  return playing;
 }
 
-internal void AUDIO_CHANNEL_setState(WrenVM* vm) {
-  AUDIO_CHANNEL* data = (AUDIO_CHANNEL*)wrenGetSlotForeign(vm, 0);
-  ASSERT_SLOT_TYPE(vm, 1, NUM, "state");
-  int state = wrenGetSlotDouble(vm, 1);
-  if (state <= CHANNEL_INVALID || state >= CHANNEL_LAST) {
-    VM_ABORT(vm, "Setting invalid channel state");
-  }
-  data->state = state;
+internal uint32_t
+AUDIO_ENGINE_frameSize(SDL_AudioSpec spec) {
+  return SDL_AUDIO_BITSIZE(spec.format) / 8 * spec.channels;
 }
 
-internal void AUDIO_CHANNEL_getSoundId(WrenVM* vm) {
-  AUDIO_CHANNEL* data = (AUDIO_CHANNEL*)wrenGetSlotForeign(vm, 0);
-  wrenEnsureSlots(vm, 1);
-  wrenSetSlotString(vm, 0, data->soundId);
-}
+// Converts |frames| of the finished mix into the device's format and
+// layout. Mono devices get both sides mixed down, and any channels past
+// the first two are left silent.
+internal void
+AUDIO_ENGINE_output(AUDIO_ENGINE* engine, Uint8* out, float* bus, uint32_t frames, bool softClip) {
+  uint32_t count = frames * channels;
+  bool isFloat = SDL_AUDIO_ISFLOAT(engine->spec.format);
+  uint16_t outChannels = engine->spec.channels;
+  if (!isFloat && outChannels == channels) {
+    // The usual case, which is soft clipped and converted in one pass.
+    int16_t* samples = (int16_t*)out;
+    if (softClip) {
+      for (uint32_t i = 0; i < count; i++) {
+        samples[i] = (int16_t)(tanhf(bus[i]) * INT16_MAX);
+      }
+    } else {
+      for (uint32_t i = 0; i < count; i++) {
+        samples[i] = (int16_t)(mid(-1.0f, bus[i], 1.0f) * INT16_MAX);
+      }
+    }
+    return;
+  }
 
-internal void AUDIO_CHANNEL_getState(WrenVM* vm) {
-  AUDIO_CHANNEL* data = (AUDIO_CHANNEL*)wrenGetSlotForeign(vm, 0);
-  wrenEnsureSlots(vm, 1);
-  wrenSetSlotDouble(vm, 0, data->state);
-}
+  // Float output can go past full scale, so it is only clamped once it
+  // is converted to 16-bit.
+  if (softClip) {
+    for (uint32_t i = 0; i < count; i++) {
+      bus[i] = tanhf(bus[i]);
+    }
+  }
+  if (isFloat && outChannels == channels) {
+    memcpy(out, bus, sizeof(float) * count);
+    return;
+  }
 
-internal void AUDIO_CHANNEL_getLength(WrenVM* vm) {
-  AUDIO_CHANNEL* channel = (AUDIO_CHANNEL*)wrenGetSlotForeign(vm, 0);
-  wrenEnsureSlots(vm, 1);
-  wrenSetSlotDouble(vm, 0, channel->audio->length);
+  for (uint32_t i = 0; i < frames; i++) {
+    for (uint16_t c = 0; c < outChannels; c++) {
+      float value;
+      if (outChannels == 1) {
+        value = (bus[i * 2] + bus[i * 2 + 1]) * 0.5f;
+      } else {
+        value = c < channels ? bus[i * 2 + c] : 0;
+      }
+      if (isFloat) {
+        ((float*)out)[i * outChannels + c] = value;
+      } else {
+        ((int16_t*)out)[i * outChannels + c] = (int16_t)(mid(-1.0f, value, 1.0f) * INT16_MAX);
+      }
+    }
+  }
 }
 
-internal void AUDIO_CHANNEL_getPosition(WrenVM* vm) {
-  AUDIO_CHANNEL* channel = (AUDIO_CHANNEL*)wrenGetSlotForeign(vm, 0);
-  wrenEnsureSlots(vm, 1);
-  wrenSetSlotDouble(vm, 0, channel->position);
+// Runs the bus's effects over the block, then applies its volume. Changes
+// to the volume, including muting, are ramped over the block.
+internal void
+AUDIO_BUS_process(AUDIO_BUS* bus, uint32_t frames) {
+  for (uint32_t i = 0; i < bus->effectCount; i++) {
+    AUDIO_EFFECT_process(bus->effects[i], bus->buffer, frames);
+  }
+  float target = bus->mute ? 0 : bus->volume;
+  if (bus->gain == 1 && target == 1) {
+    return;
+  }
+  float gain = bus->gain;
+  float step = (target - gain) / frames;
+  for (uint32_t i = 0; i < frames; i++) {
+    bus->buffer[i * 2] *= gain;
+    bus->buffer[i * 2 + 1] *= gain;
+    gain += step;
+  }
+  bus->gain = target;
 }
 
-internal void AUDIO_CHANNEL_setEnabled(WrenVM* vm) {
-  AUDIO_CHANNEL* channel = (AUDIO_CHANNEL*)wrenGetSlotForeign(vm, 0);
-  ASSERT_SLOT_TYPE(vm, 1, BOOL, "enabled");
-  channel->enabled = wrenGetSlotBool(vm, 1);
+internal void
+AUDIO_BUS_sum(AUDIO_BUS* into, const AUDIO_BUS* bus, uint32_t frames) {
+  uint32_t count = frames * channels;
+  for (uint32_t i = 0; i < count; i++) {
+    into->buffer[i] += bus->buffer[i];
+  }
 }
 
-internal void AUDIO_CHANNEL_getEnabled(WrenVM* vm) {
-  AUDIO_CHANNEL* channel = (AUDIO_CHANNEL*)wrenGetSlotForeign(vm, 0);
-  wrenEnsureSlots(vm, 1);
-  wrenSetSlotBool(vm, 0, channel->enabled);
-}
+// audio callback function
+// Allows SDL to "pull" data into the output buffer
+// on a seperate thread. We need to be pretty efficient
+// here as it holds a lock.
+void AUDIO_ENGINE_mix(void*  userdata,
+    Uint8* stream,
+    int    outputBufferSize) {
+  AUDIO_ENGINE* audioEngine = userdata;
+  uint32_t frameSize = AUDIO_ENGINE_frameSize(audioEngine->spec);
+  uint32_t totalSamples = outputBufferSize / frameSize;
+  AUDIO_BUS* buses = audioEngine->buses;
+  AUDIO_BUS* master = &buses[AUDIO_MASTER_BUS];
+  uint64_t startTime = SDL_GetPerformanceCounter();
+  uint32_t voices = 0;
 
-internal void AUDIO_CHANNEL_setLoop(WrenVM* vm) {
-  AUDIO_CHANNEL* channel = (AUDIO_CHANNEL*)wrenGetSlotForeign(vm, 0);
-  ASSERT_SLOT_TYPE(vm, 1, BOOL, "loop");
-  channel->loop = wrenGetSlotBool(vm, 1);
-}
+  AUDIO_ENGINE_drain(audioEngine);
 
-internal void AUDIO_CHANNEL_getLoop(WrenVM* vm) {
-  AUDIO_CHANNEL* channel = (AUDIO_CHANNEL*)wrenGetSlotForeign(vm, 0);
-  wrenEnsureSlots(vm, 1);
-  wrenSetSlotBool(vm, 0, channel->loop);
-}
+  // The bus is sized for the device buffer. We can't allocate on this
+  // thread, so if SDL ever asks for more, it is mixed in several blocks.
+  for (uint32_t start = 0; start < totalSamples; start += audioEngine->busFrames) {
+    uint32_t frames = min(audioEngine->busFrames, totalSamples - start);
+    for (uint32_t b = 0; b < audioEngine->busCount; b++) {
+      memset(buses[b].buffer, 0, sizeof(float) * frames * channels);
+      buses[b].fed = false;
+    }
 
-internal void AUDIO_CHANNEL_setVolume(WrenVM* vm) {
-  AUDIO_CHANNEL* channel = (AUDIO_CHANNEL*)wrenGetSlotForeign(vm, 0);
-  ASSERT_SLOT_TYPE(vm, 1, NUM, "volume");
-  channel->volume = (float)max(0, wrenGetSlotDouble(vm, 1));
-}
+    int totalEnabled = 0;
+    bool streamed = false;
+    uint64_t blockClock = audioEngine->mixClock + start;
+    AUDIO_CHANNEL* channel = audioEngine->playing;
+    while (channel != NULL) {
+      AUDIO_CHANNEL* next = channel->mix.next;
+      // A scheduled channel waits until its start frame, which may fall
+      // partway into this block.
+      uint32_t offset = 0;
+      if (channel->mix.start > blockClock) {
+        if (channel->mix.fadeStop) {
+          // It was stopped before it started
+          SDL_AtomicSet(&channel->finished, 1);
+          AUDIO_ENGINE_unlink(audioEngine, channel);
+          channel = next;
+          continue;
+        }
+        if (channel->mix.start >= blockClock + frames) {
+          channel = next;
+          continue;
+        }
+        offset = channel->mix.start - blockClock;
+      }
+      if (!channel->mix.virtual) {
+        totalEnabled++;
+      }
+      streamed |= channel->stream != NULL;
+      AUDIO_BUS* bus = &buses[channel->mix.bus];
+      bus->fed = true;
+      bool playing = AUDIO_CHANNEL_process(channel, &audioEngine->mixSpatial,
+          bus->buffer + offset * channels, frames - offset);
+      if (channel->mix.virtualizing) {
+        // It has faded out, so stop mixing it from the next block
+        channel->mix.virtualizing = false;
+        channel->mix.virtual = true;
+      }
+      SDL_AtomicSet(&channel->position, channel->mix.position);
+      if (!playing) {
+        SDL_AtomicSet(&channel->finished, 1);
+        AUDIO_ENGINE_unlink(audioEngine, channel);
+      }
+      channel = next;
+    }
+    if (streamed) {
+      AUDIO_STREAMER_wake(&audioEngine->streamer);
+    }
+    voices = max(voices, totalEnabled);
 
-internal void AUDIO_CHANNEL_getVolume(WrenVM* vm) {
-  AUDIO_CHANNEL* channel = (AUDIO_CHANNEL*)wrenGetSlotForeign(vm, 0);
-  wrenEnsureSlots(vm, 1);
-  wrenSetSlotDouble(vm, 0, channel->volume);
-}
+    for (uint32_t b = AUDIO_MASTER_BUS + 1; b < audioEngine->busCount; b++) {
+      AUDIO_BUS* bus = &buses[b];
+      // A bus with effects may still be ringing out, even with nothing fed
+      // into it.
+      if (bus->fed || bus->effectCount > 0) {
+        AUDIO_BUS_process(bus, frames);
+        AUDIO_BUS_sum(master, bus, frames);
+      }
+    }
+    AUDIO_BUS_process(master, frames);
 
-internal void AUDIO_CHANNEL_setPan(WrenVM* vm) {
-  AUDIO_CHANNEL* channel = (AUDIO_CHANNEL*)wrenGetSlotForeign(vm, 0);
-  ASSERT_SLOT_TYPE(vm, 1, NUM, "pan");
-  channel->pan = (float)mid(-1.0, wrenGetSlotDouble(vm, 1), 1.0f);
+    AUDIO_ENGINE_output(audioEngine, stream + start * frameSize, master->buffer, frames, totalEnabled > 1);
+    AUDIO_RECORDER_push(&audioEngine->recorder, stream + start * frameSize, frames);
+  }
+
+  audioEngine->mixClock += totalSamples;
+  AUDIO_CLOCK_set(&audioEngine->clock, audioEngine->mixClock);
+
+  uint64_t ticks = SDL_GetPerformanceCounter() - startTime;
+  AUDIO_MIXER_STATS* stats = &audioEngine->stats;
+  stats->callbacks++;
+  stats->frames += totalSamples;
+  stats->ticks += ticks;
+  stats->maxTicks = max(stats->maxTicks, ticks);
+  stats->voices += voices;
 }
 
-internal void AUDIO_CHANNEL_getPan(WrenVM* vm) {
-  AUDIO_CHANNEL* channel = (AUDIO_CHANNEL*)wrenGetSlotForeign(vm, 0);
+// Converts audio to the device |rate|, so the mixer never has to. Streams
+// are converted as they are decoded, so only their length changes.
+internal void
+AUDIO_DATA_convert(AUDIO_DATA* data, uint32_t rate) {
+  if (data->stream != NULL) {
+    AUDIO_STREAM_SOURCE* source = data->stream;
+    data->length = source->freq > 0 ? ((uint64_t)source->length * rate) / source->freq : 0;
+    data->spec.freq = rate;
+    return;
+  }
+  if (data->module != NULL) {
+    // Modules are rendered at whatever rate the device runs at
+    data->length = data->module->seconds * rate;
+    data->spec.freq = rate;
+    return;
+  }
+  if (data->spec.freq == (int)rate || data->spec.freq <= 0 || rate == 0) {
+    return;
+  }
+  if (data->adpcm != NULL) {
+    // Compressed audio is expanded to be converted, and compressed again
+    AUDIO_ADPCM* adpcm = data->adpcm;
+    int16_t* samples = AUDIO_ADPCM_decode(adpcm);
+    size_t resampledLength;
+    int16_t* resampled = AUDIO_resample(samples, data->length, adpcm->channels,
+        data->spec.freq, rate, AUDIO_RESAMPLE_QUALITY, &resampledLength);
+    data->adpcm = AUDIO_ADPCM_encode(resampled, resampledLength, adpcm->channels);
+    data->length = resampledLength;
+    data->spec.freq = rate;
+    AUDIO_ADPCM_free(adpcm);
+    free(samples);
+    free(resampled);
+    return;
+  }
+  if (data->buffer == NULL) {
+    return;
+  }
+  size_t resampledLength;
+  int16_t* resampled = AUDIO_resample(data->buffer, data->length, data->spec.channels,
+      data->spec.freq, rate, AUDIO_RESAMPLE_QUALITY, &resampledLength);
+  free(data->buffer);
+  data->buffer = resampled;
+  data->length = resampledLength;
+  data->spec.freq = rate;
+}
+
+// Decodes a whole WAV or OGG file into |data|, converted to |rate|, or
+// parses a MOD file to be played as it is. This
+// doesn't touch the VM, so it can run on a worker thread. Returns an error
+// message on failure, and |sourceSpec| describes the file as it was.
+internal const char*
+AUDIO_DATA_decode(AUDIO_DATA* data, const char* fileBuffer, size_t length, uint32_t rate, SDL_AudioSpec* sourceSpec) {
+  int16_t* tempBuffer;
+  if (length >= 12 && strncmp(fileBuffer, "RIFF", 4) == 0 &&
+      strncmp(&fileBuffer[8], "WAVE", 4) == 0) {
+    data->audioType = AUDIO_TYPE_WAV;
+
+    // IMA-ADPCM files stay compressed
+    const char* error = NULL;
+    uint32_t freq = 0;
+    data->adpcm = AUDIO_ADPCM_readWav(fileBuffer, length, &data->length, &freq, &error);
+    if (error != NULL) {
+      return error;
+    }
+    if (data->adpcm != NULL) {
+      memset(&data->spec, 0, sizeof(SDL_AudioSpec));
+      data->spec.channels = data->adpcm->channels;
+      data->spec.freq = freq;
+      data->spec.format = AUDIO_S16LSB;
+      *sourceSpec = data->spec;
+      AUDIO_DATA_convert(data, rate);
+      return NULL;
+    }
+
+    // Loading the WAV file
+    SDL_RWops* src = SDL_RWFromConstMem(fileBuffer, length);
+    void* result = SDL_LoadWAV_RW(src, 1, &data->spec, ((uint8_t**)&tempBuffer), &data->length);
+    if (result == NULL) {
+      return "Invalid WAVE file";
+    }
+    data->length /= sizeof(int16_t) * data->spec.channels;
+  } else if (length >= 4 && strncmp(fileBuffer, "OggS", 4) == 0) {
+    data->audioType = AUDIO_TYPE_OGG;
+
+    int channelsInFile = 0;
+    int freq = 0;
+    memset(&data->spec, 0, sizeof(SDL_AudioSpec));
+    // Loading the OGG file
+    int32_t result = stb_vorbis_decode_memory((const unsigned char*)fileBuffer, length, &channelsInFile, &freq, &tempBuffer);
+    if (result == -1) {
+      return "Invalid OGG file";
+    }
+    data->length = result;
+
+    data->spec.channels = channelsInFile;
+    data->spec.freq = freq;
+    data->spec.format = AUDIO_S16LSB;
+  } else if (AUDIO_MODULE_detect(fileBuffer, length)) {
+    data->audioType = AUDIO_TYPE_MOD;
+    const char* error = AUDIO_MODULE_load(&data->module, fileBuffer, length);
+    if (error != NULL) {
+      return error;
+    }
+    memset(&data->spec, 0, sizeof(SDL_AudioSpec));
+    data->spec.channels = channels;
+    data->spec.format = AUDIO_S16LSB;
+    AUDIO_DATA_convert(data, rate);
+    *sourceSpec = data->spec;
+    return NULL;
+  } else {
+    return "Audio file was of an incompatible format";
+  }
+  *sourceSpec = data->spec;
+
+  assert(data->length != UINT32_MAX);
+  if (data->audioType == AUDIO_TYPE_OGG && data->spec.channels <= channels) {
+    // The decoder's buffer is already in the layout we want, so keep it.
+    data->buffer = tempBuffer;
+  } else {
+    // Only the first two channels of a file are ever played
+    uint16_t fileChannels = data->spec.channels;
+    uint16_t keptChannels = min(fileChannels, channels);
+    data->buffer = malloc(sizeof(int16_t) * keptChannels * data->length);
+    assert(data->buffer != NULL);
+    if (keptChannels == fileChannels) {
+      memcpy(data->buffer, tempBuffer, sizeof(int16_t) * keptChannels * data->length);
+    } else {
+      for (uint32_t i = 0; i < data->length; i++) {
+        data->buffer[i * keptChannels] = tempBuffer[i * fileChannels];
+        data->buffer[i * keptChannels + 1] = tempBuffer[i * fileChannels + 1];
+      }
+    }
+    data->spec.channels = keptChannels;
+    // free the intermediate buffers
+    if (data->audioType == AUDIO_TYPE_WAV) {
+      SDL_FreeWAV((uint8_t*)tempBuffer);
+    } else if (data->audioType == AUDIO_TYPE_OGG) {
+      free(tempBuffer);
+    }
+  }
+
+  AUDIO_DATA_convert(data, rate);
+  return NULL;
+}
+
+// Replaces decoded audio with IMA-ADPCM, before anything plays it
+internal void
+AUDIO_DATA_compress(AUDIO_DATA* data) {
+  if (data->buffer == NULL) {
+    return;
+  }
+  data->adpcm = AUDIO_ADPCM_encode(data->buffer, data->length, data->spec.channels);
+  free(data->buffer);
+  data->buffer = NULL;
+}
+
+// AudioData.stream_(path) is a static method rather than a constructor,
+// so it creates the object itself, from the class in slot 0.
+internal void
+AUDIO_stream(WrenVM* vm) {
+  ASSERT_SLOT_TYPE(vm, 1, STRING, "path");
+  ENGINE* engine = wrenGetUserData(vm);
+  char* path = wrenGetSlotString(vm, 1);
+  AUDIO_DATA** slot = (AUDIO_DATA**)wrenSetSlotNewForeign(vm, 0, 0, sizeof(AUDIO_DATA*));
+  AUDIO_DATA* data = calloc(1, sizeof(AUDIO_DATA));
+  data->refCount = 1;
+  *slot = data;
+
+  AUDIO_STREAM_SOURCE* source = calloc(1, sizeof(AUDIO_STREAM_SOURCE));
+  source->file = ENGINE_mapFile(engine, path, &source->fileLength, &source->storage);
+  if (source->file == NULL) {
+    free(source);
+    VM_ABORT(vm, "Audio file could not be opened");
+    return;
+  }
+  const char* error = AUDIO_STREAM_SOURCE_init(source);
+  if (error != NULL) {
+    AUDIO_STREAM_SOURCE_release(source);
+    VM_ABORT(vm, error);
+    return;
+  }
+
+  data->stream = source;
+  data->audioType = source->audioType;
+  memset(&data->spec, 0, sizeof(SDL_AudioSpec));
+  data->spec.channels = source->channels;
+  data->spec.freq = source->freq;
+  data->spec.format = AUDIO_S16LSB;
+  if (DEBUG_MODE) {
+    DEBUG_printAudioSpec(engine, data->spec, data->audioType);
+  }
+  // Streams are resampled as they are decoded, so report the length they
+  // will play for.
+  AUDIO_DATA_convert(data, engine->audioEngine->spec.freq);
+}
+
+internal void AUDIO_allocate(WrenVM* vm) {
+  wrenEnsureSlots(vm, 1);
+  AUDIO_DATA** slot = (AUDIO_DATA**)wrenSetSlotNewForeign(vm, 0, 0, sizeof(AUDIO_DATA*));
+  AUDIO_DATA* data = calloc(1, sizeof(AUDIO_DATA));
+  data->refCount = 1;
+  *slot = data;
+
+  int length;
+  const char* fileBuffer = DBUFFER_getSlotBytes(vm, 1, &length);
+  if (fileBuffer == NULL) {
+    VM_ABORT(vm, "buffer was not a String or a ready DataBuffer");
+    return;
+  }
+
+  ENGINE* engine = wrenGetUserData(vm);
+  SDL_AudioSpec sourceSpec;
+  const char* error = AUDIO_DATA_decode(data, fileBuffer, length, engine->audioEngine->spec.freq, &sourceSpec);
+  if (error != NULL) {
+    VM_ABORT(vm, error);
+    return;
+  }
+  if (DEBUG_MODE) {
+    DEBUG_printAudioSpec(engine, sourceSpec, data->audioType);
+  }
+}
+
+internal AUDIO_DATA*
+AUDIO_DATA_fromSlot(WrenVM* vm, int slot) {
+  return *(AUDIO_DATA**)wrenGetSlotForeign(vm, slot);
+}
+
+internal AUDIO_DATA*
+AUDIO_DATA_retain(AUDIO_DATA* audioData) {
+  audioData->refCount++;
+  return audioData;
+}
+
+internal void
+AUDIO_DATA_release(AUDIO_DATA* audioData) {
+  if (audioData == NULL || --audioData->refCount > 0) {
+    return;
+  }
+  if (audioData->buffer != NULL) {
+    if (audioData->audioType == AUDIO_TYPE_WAV || audioData->audioType == AUDIO_TYPE_OGG) {
+      free(audioData->buffer);
+    }
+    audioData->buffer = NULL;
+  }
+  AUDIO_STREAM_SOURCE_release(audioData->stream);
+  audioData->stream = NULL;
+  AUDIO_MODULE_free(audioData->module);
+  audioData->module = NULL;
+  AUDIO_ADPCM_free(audioData->adpcm);
+  audioData->adpcm = NULL;
+  free(audioData);
+}
+
+internal void AUDIO_compress(WrenVM* vm) {
+  AUDIO_DATA* data = AUDIO_DATA_fromSlot(vm, 0);
+  if (data->refCount > 1) {
+    VM_ABORT(vm, "Audio can't be compressed once it has been played");
+    return;
+  }
+  AUDIO_DATA_compress(data);
+}
+
+internal void AUDIO_finalize(void* data) {
+  AUDIO_DATA_release(*(AUDIO_DATA**)data);
+}
+
+internal void AUDIO_getLength(WrenVM* vm) {
+  ENGINE* engine = wrenGetUserData(vm);
+  AUDIO_DATA* data = AUDIO_DATA_fromSlot(vm, 0);
+  uint32_t rate = engine->audioEngine->spec.freq;
+  uint64_t length = data->length;
+  if (data->spec.freq > 0 && data->spec.freq != (int)rate) {
+    // It is converted the next time it plays, if the device rate changed
+    length = length * rate / data->spec.freq;
+  }
   wrenEnsureSlots(vm, 1);
-  wrenSetSlotDouble(vm, 0, channel->pan);
+  wrenSetSlotDouble(vm, 0, length);
+}
+
+typedef struct {
+  WrenVM* vm;
+  WrenHandle* opHandle;
+  char name[256];
+  uint32_t rate;
+  AUDIO_DATA* data;
+  bool compress;
+  SDL_AudioSpec sourceSpec;
+  const char* error;
+} AUDIO_LOAD_TASK;
+
+// Makes |op| complete, with a new AudioData object for |data| as its result.
+internal void
+AUDIO_completeLoad(WrenVM* vm, ASYNCOP* op, AUDIO_DATA* data, int slot) {
+  if (data != NULL) {
+    wrenSetSlotHandle(vm, slot, audioDataClass);
+    AUDIO_DATA** result = (AUDIO_DATA**)wrenSetSlotNewForeign(vm, slot, slot, sizeof(AUDIO_DATA*));
+    *result = data;
+    wrenReleaseHandle(vm, op->bufferHandle);
+    op->bufferHandle = wrenGetSlotHandle(vm, slot);
+  }
+  op->error = data == NULL;
+  op->complete = true;
+}
+
+internal void
+AUDIO_ENGINE_loadAsync(WrenVM* vm) {
+  // Thread: main
+  ASSERT_SLOT_TYPE(vm, 1, STRING, "file path");
+  ASSERT_SLOT_TYPE(vm, 2, FOREIGN, "operation");
+  ASSERT_SLOT_TYPE(vm, 4, BOOL, "compressed");
+  wrenEnsureSlots(vm, 6);
+  ASYNCOP* op = wrenGetSlotForeign(vm, 2);
+  if (wrenGetSlotType(vm, 3) == WREN_TYPE_FOREIGN) {
+    // Already loaded, so there's no work to do
+    AUDIO_completeLoad(vm, op, AUDIO_DATA_retain(AUDIO_DATA_fromSlot(vm, 3)), 5);
+    return;
+  }
+
+  ENGINE* engine = wrenGetUserData(vm);
+  AUDIO_LOAD_TASK* taskData = calloc(1, sizeof(AUDIO_LOAD_TASK));
+  const char* path = wrenGetSlotString(vm, 1);
+  strncpy(taskData->name, path, 255);
+  taskData->name[255] = '\0';
+  taskData->vm = vm;
+  taskData->opHandle = wrenGetSlotHandle(vm, 2);
+  taskData->rate = engine->audioEngine->spec.freq;
+  taskData->compress = wrenGetSlotBool(vm, 4);
+
+  INIT_TO_ZERO(ABC_TASK, task);
+  task.type = TASK_LOAD_AUDIO;
+  task.data = taskData;
+  ABC_FIFO_pushTask(&engine->fifo, task);
+}
+
+internal void
+AUDIO_loadEventHandler(void* data) {
+  // Thread: Async
+  AUDIO_LOAD_TASK* task = data;
+  ENGINE* engine = (ENGINE*)wrenGetUserData(task->vm);
+  size_t length;
+  bool owned;
+  const char* file = ENGINE_viewFile(engine, task->name, &length, &owned);
+  if (file == NULL) {
+    task->error = "Audio file could not be opened";
+  } else {
+    task->data = calloc(1, sizeof(AUDIO_DATA));
+    task->data->refCount = 1;
+    task->error = AUDIO_DATA_decode(task->data, file, length, task->rate, &task->sourceSpec);
+    if (task->error != NULL) {
+      AUDIO_DATA_release(task->data);
+      task->data = NULL;
+    } else if (task->compress) {
+      AUDIO_DATA_compress(task->data);
+    }
+    if (owned) {
+      free((void*)file);
+    }
+  }
+
+  SDL_Event event;
+  SDL_memset(&event, 0, sizeof(event));
+  event.type = ENGINE_EVENT_TYPE;
+  event.user.code = EVENT_LOAD_AUDIO;
+  event.user.data1 = task;
+  SDL_PushEvent(&event);
+}
+
+internal void
+AUDIO_loadEventComplete(SDL_Event* event) {
+  // Thread: Main
+  AUDIO_LOAD_TASK* task = event->user.data1;
+  WrenVM* vm = task->vm;
+  ENGINE* engine = wrenGetUserData(vm);
+  wrenEnsureSlots(vm, 3);
+
+  wrenSetSlotHandle(vm, 1, task->opHandle);
+  ASYNCOP* op = (ASYNCOP*)wrenGetSlotForeign(vm, 1);
+  if (task->data != NULL) {
+    if (DEBUG_MODE) {
+      DEBUG_printAudioSpec(engine, task->sourceSpec, task->data->audioType);
+    }
+  } else {
+    ENGINE_printLog(engine, "%s: %s\n", task->error, task->name);
+  }
+  AUDIO_completeLoad(vm, op, task->data, 2);
+
+  wrenReleaseHandle(vm, task->opHandle);
+  free(task);
+}
+
+// Opens the device with the |desired| spec, paused. SDL converts the rate,
+// format and channels if the hardware differs, but may choose a different
+// buffer size, so |engine->spec| is set to what was actually granted.
+// If no device can be opened, this returns false, but the engine still
+// takes on the |desired| spec, so audio can be loaded and mixed for it.
+internal bool
+AUDIO_ENGINE_open(AUDIO_ENGINE* engine, SDL_AudioSpec desired) {
+  desired.callback = AUDIO_ENGINE_mix;
+  desired.userdata = engine;
+  SDL_AudioSpec obtained;
+  SDL_AudioDeviceID deviceId = SDL_OpenAudioDevice(NULL, 0, &desired, &obtained, SDL_AUDIO_ALLOW_SAMPLES_CHANGE);
+  if (deviceId == 0) {
+    obtained = desired;
+  }
+  engine->deviceId = deviceId;
+  engine->spec = obtained;
+
+  uint32_t busFrames = max(obtained.samples, desired.samples);
+  if (busFrames > engine->busFrames) {
+    engine->busFrames = busFrames;
+    for (uint32_t i = 0; i < engine->busCount; i++) {
+      free(engine->buses[i].buffer);
+      engine->buses[i].buffer = calloc(engine->busFrames * channels, sizeof(float));
+    }
+  }
+  // Streams size their buffers to match the device
+  AUDIO_BUFFER_SIZE = busFrames;
+  return deviceId != 0;
+}
+
+internal AUDIO_ENGINE*
+AUDIO_ENGINE_init(void) {
+  SDL_InitSubSystem(SDL_INIT_AUDIO);
+  AUDIO_ENGINE* engine = calloc(1, sizeof(AUDIO_ENGINE));
+  engine->freeHandle = AUDIO_HANDLE_NONE;
+  engine->commands.size = AUDIO_COMMAND_QUEUE_SIZE;
+  engine->commands.commands = malloc(sizeof(AUDIO_COMMAND) * AUDIO_COMMAND_QUEUE_SIZE);
+  engine->maxVoices = AUDIO_DEFAULT_MAX_VOICES;
+  engine->busCount = 1;
+  engine->buses[AUDIO_MASTER_BUS].volume = 1;
+  engine->buses[AUDIO_MASTER_BUS].gain = 1;
+  engine->spatial.model = AUDIO_ATTENUATION_INVERSE;
+  engine->spatial.rolloff = 1;
+  engine->mixSpatial = engine->spatial;
+
+  INIT_TO_ZERO(SDL_AudioSpec, desired);
+  desired.freq = AUDIO_SAMPLE_RATE;
+  desired.format = AUDIO_S16SYS;
+  desired.channels = channels;
+  desired.samples = AUDIO_BUFFER_SIZE;
+  // Without a device, the game carries on without sound (deviceId is 0).
+  // Offline rendering doesn't need one, so it still works.
+  AUDIO_ENGINE_open(engine, desired);
+  AUDIO_STREAMER_init(&engine->streamer);
+
+  // Unpause audio so we can begin taking over the buffer
+  SDL_PauseAudioDevice(engine->deviceId, 0);
+  return engine;
+}
+
+internal void AUDIO_ENGINE_lock(AUDIO_ENGINE* engine) {
+  SDL_LockAudioDevice(engine->deviceId);
+}
+
+internal void AUDIO_ENGINE_unlock(AUDIO_ENGINE* engine) {
+  SDL_UnlockAudioDevice(engine->deviceId);
+}
+
+// Applies every published command straight away. The lock is only held
+// for as long as that takes, and this is only needed when the game must
+// know the mixer has let go of something, or the queue is full.
+internal void
+AUDIO_ENGINE_sync(AUDIO_ENGINE* engine) {
+  AUDIO_ENGINE_lock(engine);
+  AUDIO_ENGINE_drain(engine);
+  AUDIO_ENGINE_unlock(engine);
+}
+
+// Queues commands for the mixer, from the game thread.
+internal void
+AUDIO_ENGINE_publish(AUDIO_ENGINE* engine) {
+  // The commands must all be written before the mixer can see them
+  SDL_AtomicSet(&engine->commands.written, engine->commands.staged);
+}
+
+// Doubles the size of the queue, with the device locked so the mixer
+// isn't reading it. Commands keep their place in the sequence.
+internal void
+AUDIO_ENGINE_growQueue(AUDIO_ENGINE* engine) {
+  AUDIO_COMMAND_QUEUE* queue = &engine->commands;
+  uint32_t size = queue->size * 2;
+  AUDIO_COMMAND* commands = malloc(sizeof(AUDIO_COMMAND) * size);
+  AUDIO_ENGINE_lock(engine);
+  for (uint32_t i = SDL_AtomicGet(&queue->read); i != queue->staged; i++) {
+    commands[i & (size - 1)] = queue->commands[i & (queue->size - 1)];
+  }
+  free(queue->commands);
+  queue->commands = commands;
+  queue->size = size;
+  AUDIO_ENGINE_unlock(engine);
+}
+
+// Takes the next free command in the queue. Nothing is published until
+// the end of the update, so it can be filled in afterwards. If the queue
+// is full, commands from earlier updates are applied to make room, and it
+// only grows if this update has filled it by itself, so a frame's commands
+// are never split up.
+internal AUDIO_COMMAND*
+AUDIO_ENGINE_stageCommand(AUDIO_ENGINE* engine, AUDIO_COMMAND_TYPE type) {
+  AUDIO_COMMAND_QUEUE* queue = &engine->commands;
+  uint32_t staged = queue->staged;
+  if (staged - (uint32_t)SDL_AtomicGet(&queue->read) >= queue->size) {
+    AUDIO_ENGINE_sync(engine);
+    if (staged - (uint32_t)SDL_AtomicGet(&queue->read) >= queue->size) {
+      AUDIO_ENGINE_growQueue(engine);
+    }
+  }
+  AUDIO_COMMAND* command = &queue->commands[staged & (queue->size - 1)];
+  memset(command, 0, sizeof(AUDIO_COMMAND));
+  command->type = type;
+  queue->staged = staged + 1;
+  return command;
+}
+
+internal void
+AUDIO_ENGINE_sendRamp(AUDIO_ENGINE* engine, AUDIO_COMMAND_TYPE type, AUDIO_CHANNEL* channel, float value, uint32_t frames) {
+  AUDIO_COMMAND* command = AUDIO_ENGINE_stageCommand(engine, type);
+  command->channel = channel;
+  command->value = value;
+  command->frames = frames;
+}
+
+internal void
+AUDIO_ENGINE_sendPoint(AUDIO_ENGINE* engine, AUDIO_COMMAND_TYPE type, AUDIO_CHANNEL* channel, float value, float x, float y) {
+  AUDIO_COMMAND* command = AUDIO_ENGINE_stageCommand(engine, type);
+  command->channel = channel;
+  command->value = value;
+  command->x = x;
+  command->y = y;
+}
+
+internal void
+AUDIO_ENGINE_sendBusCommand(AUDIO_ENGINE* engine, AUDIO_COMMAND_TYPE type,
+    uint32_t bus, uint32_t effect, uint32_t param, float value) {
+  AUDIO_COMMAND* command = AUDIO_ENGINE_stageCommand(engine, type);
+  command->bus = bus;
+  command->effect = effect;
+  command->param = param;
+  command->value = value;
+}
+
+internal void
+AUDIO_ENGINE_sendCommand(AUDIO_ENGINE* engine, AUDIO_COMMAND_TYPE type, AUDIO_CHANNEL* channel, float value) {
+  AUDIO_ENGINE_sendRamp(engine, type, channel, value, 0);
 }
 
-internal void AUDIO_CHANNEL_finalize(void* data) {
-  AUDIO_CHANNEL* channel = (AUDIO_CHANNEL*)data;
+internal void
+AUDIO_CHANNEL_free(AUDIO_CHANNEL* channel) {
+  if (channel->stream != NULL) {
+    AUDIO_STREAMER_remove(channel->stream);
+    AUDIO_STREAM_free(channel->stream);
+  }
+  AUDIO_SYNTH_free(channel->synth);
+  free(channel->player);
+  free(channel->decoder);
+  AUDIO_DATA_release(channel->audio);
   free(channel->soundId);
+  free(channel);
+}
+
+// Frees the released channels which the mixer has finished with.
+internal void
+AUDIO_ENGINE_collect(AUDIO_ENGINE* engine) {
+  AUDIO_CHANNEL** link = &engine->retired;
+  while (*link != NULL) {
+    AUDIO_CHANNEL* channel = *link;
+    if (SDL_AtomicGet(&channel->retired)) {
+      *link = channel->retiredNext;
+      AUDIO_CHANNEL_free(channel);
+    } else {
+      link = &channel->retiredNext;
+    }
+  }
+}
+
+// Gives the channel a handle and adds it to the active list. Returns false
+// if every handle is in use.
+internal bool
+AUDIO_ENGINE_addChannel(AUDIO_ENGINE* engine, AUDIO_CHANNEL* channel) {
+  uint16_t index = engine->freeHandle;
+  if (index == AUDIO_HANDLE_NONE) {
+    if (engine->handleCount == engine->channelCapacity) {
+      uint32_t capacity = max(64, engine->channelCapacity * 2);
+      capacity = min(capacity, AUDIO_HANDLE_NONE);
+      if (capacity == engine->channelCapacity) {
+        return false;
+      }
+      engine->handles = realloc(engine->handles, sizeof(AUDIO_HANDLE_SLOT) * capacity);
+      engine->active = realloc(engine->active, sizeof(AUDIO_CHANNEL*) * capacity);
+      engine->ranked = realloc(engine->ranked, sizeof(AUDIO_CHANNEL*) * capacity);
+      engine->channelCapacity = capacity;
+    }
+    index = engine->handleCount++;
+    engine->handles[index].generation = 1;
+  } else {
+    engine->freeHandle = engine->handles[index].nextFree;
+  }
+
+  AUDIO_HANDLE_SLOT* slot = &engine->handles[index];
+  slot->channel = channel;
+  slot->nextFree = AUDIO_HANDLE_NONE;
+  channel->handle = ((uint32_t)slot->generation << AUDIO_HANDLE_INDEX_BITS) | index;
+  channel->activeIndex = engine->activeCount;
+  engine->active[engine->activeCount++] = channel;
+  return true;
+}
+
+internal AUDIO_CHANNEL*
+AUDIO_ENGINE_getChannel(AUDIO_ENGINE* engine, uint32_t handle) {
+  uint32_t index = handle & AUDIO_HANDLE_INDEX_MASK;
+  if (index >= engine->handleCount) {
+    return NULL;
+  }
+  AUDIO_HANDLE_SLOT* slot = &engine->handles[index];
+  if (slot->generation != (handle >> AUDIO_HANDLE_INDEX_BITS)) {
+    return NULL;
+  }
+  return slot->channel;
+}
+
+// Takes a stopped channel out of the game's hands. Its handle becomes
+// invalid straight away, and it is freed once the mixer lets go of it.
+internal void
+AUDIO_ENGINE_retireChannel(AUDIO_ENGINE* engine, AUDIO_CHANNEL* channel) {
+  uint16_t index = channel->handle & AUDIO_HANDLE_INDEX_MASK;
+  AUDIO_HANDLE_SLOT* slot = &engine->handles[index];
+  slot->channel = NULL;
+  slot->generation++;
+  if (slot->generation == 0) {
+    slot->generation = 1;
+  }
+  slot->nextFree = engine->freeHandle;
+  engine->freeHandle = index;
+
+  AUDIO_CHANNEL* last = engine->active[--engine->activeCount];
+  engine->active[channel->activeIndex] = last;
+  last->activeIndex = channel->activeIndex;
+
+  AUDIO_ENGINE_sendCommand(engine, AUDIO_COMMAND_RELEASE, channel, 0);
+  channel->retiredNext = engine->retired;
+  engine->retired = channel;
+}
+
+internal void
+AUDIO_CHANNEL_setEnabled(AUDIO_ENGINE* engine, AUDIO_CHANNEL* channel, bool enabled) {
+  if (enabled == channel->enabled) {
+    return;
+  }
+  channel->enabled = enabled;
+  AUDIO_ENGINE_sendCommand(engine, enabled ? AUDIO_COMMAND_PLAY : AUDIO_COMMAND_STOP, channel, 0);
+}
+
+internal bool
+AUDIO_CHANNEL_isFinished(AUDIO_CHANNEL* channel) {
+  return channel->state == CHANNEL_STOPPED || SDL_AtomicGet(&channel->finished);
+}
+
+// Synth voices which can be heard end with their envelope's release,
+// rather than the fade.
+internal void
+AUDIO_CHANNEL_fadeOut(AUDIO_ENGINE* engine, AUDIO_CHANNEL* channel, uint32_t frames) {
+  if (!AUDIO_CHANNEL_isFinished(channel)) {
+    if (channel->synth != NULL && frames > 0) {
+      AUDIO_ENGINE_sendCommand(engine, AUDIO_COMMAND_NOTE_OFF, channel, 0);
+    } else {
+      AUDIO_ENGINE_sendRamp(engine, AUDIO_COMMAND_FADE_OUT, channel, 0, frames);
+    }
+  }
+  channel->state = CHANNEL_STOPPING;
+}
+
+// Ranks channels by priority, then by how loud they are. Channels which
+// are already real win ties, so equal sounds don't keep trading places.
+internal int
+AUDIO_CHANNEL_compare(const void* a, const void* b) {
+  const AUDIO_CHANNEL* left = *(AUDIO_CHANNEL* const*)a;
+  const AUDIO_CHANNEL* right = *(AUDIO_CHANNEL* const*)b;
+  if (left->priority != right->priority) {
+    return left->priority > right->priority ? -1 : 1;
+  }
+  if (left->audible != right->audible) {
+    return left->audible > right->audible ? -1 : 1;
+  }
+  if (left->real != right->real) {
+    return left->real ? -1 : 1;
+  }
+  return 0;
+}
+
+// Decides which channels get one of the engine's real voices this frame.
+// Silent channels never need one, including those too far away to hear.
+internal void
+AUDIO_ENGINE_allocateVoices(AUDIO_ENGINE* engine) {
+  uint32_t count = 0;
+  for (uint32_t i = 0; i < engine->activeCount; i++) {
+    AUDIO_CHANNEL* channel = engine->active[i];
+    channel->audible = channel->volume;
+    if (channel->spatial) {
+      channel->audible *= AUDIO_SPATIAL_gain(&engine->spatial, channel->emitter, channel->range, NULL);
+    }
+    if (channel->state == CHANNEL_STOPPING || channel->state == CHANNEL_STOPPED
+        || channel->state == CHANNEL_LOADING || channel->stopRequested || channel->audible <= 0) {
+      channel->real = false;
+    } else {
+      engine->ranked[count++] = channel;
+    }
+  }
+  if (count > engine->maxVoices) {
+    qsort(engine->ranked, count, sizeof(AUDIO_CHANNEL*), AUDIO_CHANNEL_compare);
+  }
+  for (uint32_t i = 0; i < count; i++) {
+    engine->ranked[i]->real = i < engine->maxVoices;
+  }
+}
+
+// Moves a channel on through its lifecycle, once per frame. Returns false
+// once it has stopped and been retired.
+internal bool
+AUDIO_ENGINE_updateChannel(AUDIO_ENGINE* engine, AUDIO_CHANNEL* channel) {
+  switch (channel->state) {
+    case CHANNEL_INITIALIZE:
+      channel->state = CHANNEL_TO_PLAY;
+      // Fallthrough
+    case CHANNEL_TO_PLAY:
+      // Assume data is loaded by this point. The mixer hasn't seen the
+      // channel yet, so it can be set to start virtual directly.
+      channel->mix.virtual = !channel->real;
+      AUDIO_CHANNEL_setEnabled(engine, channel, true);
+      channel->state = channel->real ? CHANNEL_PLAYING : CHANNEL_VIRTUAL;
+      return true;
+    case CHANNEL_DEVIRTUALIZE:
+      channel->state = CHANNEL_PLAYING;
+      // Fallthrough
+    case CHANNEL_PLAYING:
+      if (AUDIO_CHANNEL_isFinished(channel) || channel->stopRequested) {
+        AUDIO_CHANNEL_fadeOut(engine, channel, channel->stopFrames);
+      } else if (!channel->real) {
+        AUDIO_ENGINE_sendCommand(engine, AUDIO_COMMAND_VIRTUAL, channel, 1);
+        channel->state = CHANNEL_VIRTUALIZING;
+      }
+      return true;
+    case CHANNEL_VIRTUALIZING:
+      channel->state = CHANNEL_VIRTUAL;
+      // Fallthrough
+    case CHANNEL_VIRTUAL:
+      if (AUDIO_CHANNEL_isFinished(channel) || channel->stopRequested) {
+        // Nobody can hear it, so there's no need to wait for a fade
+        AUDIO_CHANNEL_fadeOut(engine, channel, 0);
+      } else if (channel->real) {
+        AUDIO_ENGINE_sendCommand(engine, AUDIO_COMMAND_VIRTUAL, channel, 0);
+        channel->state = CHANNEL_DEVIRTUALIZE;
+      }
+      return true;
+    case CHANNEL_LOADING:
+      if (channel->stopRequested) {
+        channel->state = CHANNEL_STOPPED;
+        AUDIO_ENGINE_retireChannel(engine, channel);
+        return false;
+      }
+      return true;
+    case CHANNEL_STOPPING:
+      // The mixer stops the channel itself once the fade is done
+      if (!AUDIO_CHANNEL_isFinished(channel)) {
+        return true;
+      }
+      AUDIO_CHANNEL_setEnabled(engine, channel, false);
+      channel->state = CHANNEL_STOPPED;
+      // Fallthrough
+    case CHANNEL_STOPPED:
+      AUDIO_ENGINE_retireChannel(engine, channel);
+      return false;
+    default:
+      return true;
+  }
+}
+
+internal void AUDIO_ENGINE_update(WrenVM* vm) {
+  ENGINE* engine = wrenGetUserData(vm);
+  AUDIO_ENGINE* audioEngine = engine->audioEngine;
+  AUDIO_ENGINE_allocateVoices(audioEngine);
+  uint32_t i = 0;
+  while (i < audioEngine->activeCount) {
+    // Retiring a channel moves the last one into its place
+    if (AUDIO_ENGINE_updateChannel(audioEngine, audioEngine->active[i])) {
+      i++;
+    }
+  }
+  AUDIO_ENGINE_publish(audioEngine);
+  AUDIO_ENGINE_collect(audioEngine);
+}
+
+internal void AUDIO_ENGINE_getClock(WrenVM* vm) {
+  ENGINE* engine = wrenGetUserData(vm);
+  wrenEnsureSlots(vm, 1);
+  wrenSetSlotDouble(vm, 0, AUDIO_CLOCK_get(&engine->audioEngine->clock));
+}
+
+internal void AUDIO_ENGINE_getSampleRate(WrenVM* vm) {
+  ENGINE* engine = wrenGetUserData(vm);
+  wrenEnsureSlots(vm, 1);
+  wrenSetSlotDouble(vm, 0, engine->audioEngine->spec.freq);
+}
+
+internal void AUDIO_ENGINE_pause(AUDIO_ENGINE* engine) {
+  SDL_PauseAudioDevice(engine->deviceId, 1);
+}
+
+internal void AUDIO_ENGINE_resume(AUDIO_ENGINE* engine) {
+  if (!engine->offline) {
+    SDL_PauseAudioDevice(engine->deviceId, 0);
+  }
+}
+
+internal void AUDIO_ENGINE_halt(AUDIO_ENGINE* engine) {
+  if (engine != NULL) {
+    SDL_PauseAudioDevice(engine->deviceId, 1);
+    SDL_CloseAudioDevice(engine->deviceId);
+  }
+}
+
+// Brings the channels which were playing at |oldRate| over to the rate of
+// the new device. The device is closed, so the mixer state is ours to change.
+internal void
+AUDIO_ENGINE_convertChannels(AUDIO_ENGINE* engine, uint32_t oldRate) {
+  uint32_t rate = engine->spec.freq;
+  for (uint32_t i = 0; i < engine->activeCount; i++) {
+    AUDIO_CHANNEL* channel = engine->active[i];
+    AUDIO_DATA* audio = channel->audio;
+    if (channel->mix.start > engine->mixClock) {
+      // The clock carries on counting at the new rate, so a channel which
+      // is yet to start waits the same length of time.
+      uint64_t wait = channel->mix.start - engine->mixClock;
+      channel->mix.start = engine->mixClock + wait * rate / oldRate;
+    }
+    if (channel->synth != NULL) {
+      AUDIO_SYNTH_prepare(channel->synth, rate);
+    }
+    if (audio == NULL) {
+      continue;
+    }
+    if (channel->player != NULL) {
+      AUDIO_MODULE_PLAYER_prepare(channel->player, rate);
+    }
+    if (channel->stream != NULL) {
+      // Decoding starts again from where the mixer had got to, as the
+      // frames already buffered are at the old rate.
+      AUDIO_STREAM_SOURCE* source = audio->stream;
+      size_t start = (uint64_t)channel->mix.position * source->freq / oldRate;
+      AUDIO_STREAM* stream = AUDIO_STREAM_new(source, rate, start);
+      if (stream != NULL) {
+        AUDIO_STREAMER_remove(channel->stream);
+        AUDIO_STREAM_free(channel->stream);
+        SDL_AtomicSet(&stream->loop, channel->loop);
+        AUDIO_STREAMER_add(&engine->streamer, stream);
+        channel->stream = stream;
+      }
+      channel->mix.position = (uint64_t)start * rate / source->freq;
+    } else {
+      channel->mix.position = (uint64_t)channel->mix.position * rate / oldRate;
+    }
+    AUDIO_DATA_convert(audio, rate);
+    if (channel->decoder != NULL) {
+      // The blocks have been compressed again at the new rate
+      channel->decoder->block = UINT32_MAX;
+    }
+    channel->mix.position = min(channel->mix.position, audio->length);
+    channel->mix.fraction = 0;
+    SDL_AtomicSet(&channel->position, channel->mix.position);
+  }
+}
+
+internal bool
+AUDIO_ENGINE_startRecording(AUDIO_ENGINE* engine, const char* path) {
+  return AUDIO_RECORDER_start(&engine->recorder, path, engine->spec);
+}
+
+// Returns the number of frames which were lost because the disk couldn't
+// keep up.
+internal uint32_t
+AUDIO_ENGINE_finishRecording(AUDIO_ENGINE* engine) {
+  SDL_AtomicSet(&engine->recorder.active, 0);
+  // Wait out a callback which might still be copying into the ring
+  AUDIO_ENGINE_lock(engine);
+  AUDIO_ENGINE_unlock(engine);
+  return AUDIO_RECORDER_stop(&engine->recorder);
+}
+
+// Closes the device and opens it again with the |desired| spec. If that
+// fails, the previous device is restored and this returns false. A
+// recording can only hold one format, so it is finished first.
+internal bool
+AUDIO_ENGINE_reopen(AUDIO_ENGINE* engine, SDL_AudioSpec desired) {
+  SDL_AudioSpec previous = engine->spec;
+  AUDIO_ENGINE_finishRecording(engine);
+  AUDIO_ENGINE_halt(engine);
+  // With the device closed, everything sent so far can be applied, so
+  // nothing the mixer holds is left at the old rate.
+  AUDIO_ENGINE_publish(engine);
+  AUDIO_ENGINE_drain(engine);
+  AUDIO_ENGINE_collect(engine);
+
+  bool opened = AUDIO_ENGINE_open(engine, desired);
+  if (!opened && !AUDIO_ENGINE_open(engine, previous)) {
+    // Left without a device, at the previous spec
+    return false;
+  }
+  if (engine->spec.freq != previous.freq) {
+    AUDIO_ENGINE_convertChannels(engine, previous.freq);
+    // Filter coefficients and delay lengths depend on the rate
+    for (uint32_t b = 0; b < engine->busCount; b++) {
+      AUDIO_BUS* bus = &engine->buses[b];
+      for (uint32_t i = 0; i < bus->effectCount; i++) {
+        AUDIO_EFFECT_prepare(bus->effects[i], engine->spec.freq);
+      }
+    }
+  }
+  if (engine->offline) {
+    // The render file can only hold one format, so it starts again
+    AUDIO_WAV_WRITER_close(&engine->renderFile);
+    AUDIO_WAV_WRITER_open(&engine->renderFile, engine->renderPath, engine->spec);
+    free(engine->renderBuffer);
+    engine->renderBuffer = malloc(engine->spec.samples * AUDIO_ENGINE_frameSize(engine->spec));
+  }
+  AUDIO_ENGINE_resume(engine);
+  return opened;
+}
+
+// Offline rendering drives the mixer from the game loop, rather than the
+// device, and writes what it mixes to a WAV file at |path|. The output
+// then only depends on the game's updates, and not on timing, so it can
+// be compared between builds. The device should use the dummy driver, as
+// it is kept paused.
+internal bool
+AUDIO_ENGINE_startRender(AUDIO_ENGINE* engine, const char* path) {
+  if (!AUDIO_WAV_WRITER_open(&engine->renderFile, path, engine->spec)) {
+    return false;
+  }
+  AUDIO_ENGINE_pause(engine);
+  engine->offline = true;
+  engine->renderPath = strdup(path);
+  engine->renderBuffer = malloc(engine->spec.samples * AUDIO_ENGINE_frameSize(engine->spec));
+  engine->renderFrames = 0;
+  return true;
+}
+
+// Mixes another |seconds| of audio into the render file. It is mixed a
+// device buffer at a time, just as the device would ask for it.
+internal void
+AUDIO_ENGINE_render(AUDIO_ENGINE* engine, double seconds) {
+  if (!engine->offline) {
+    return;
+  }
+  uint32_t samples = engine->spec.samples;
+  uint32_t bufferSize = samples * AUDIO_ENGINE_frameSize(engine->spec);
+  engine->renderFrames += seconds * engine->spec.freq;
+  while (engine->renderFrames >= samples) {
+    AUDIO_ENGINE_mix(engine, engine->renderBuffer, bufferSize);
+    AUDIO_WAV_WRITER_write(&engine->renderFile, engine->renderBuffer, samples);
+    engine->renderFrames -= samples;
+  }
+}
+
+internal void
+AUDIO_ENGINE_finishRender(ENGINE* engine) {
+  AUDIO_ENGINE* audioEngine = engine->audioEngine;
+  if (audioEngine == NULL || !audioEngine->offline) {
+    return;
+  }
+  AUDIO_WAV_WRITER_close(&audioEngine->renderFile);
+  AUDIO_MIXER_STATS stats = audioEngine->stats;
+  double ticksPerMicrosecond = SDL_GetPerformanceFrequency() / 1000000.0;
+  ENGINE_printLog(engine, "Rendered %.2f seconds of audio to %s\n",
+      (double)audioEngine->renderFile.frames / audioEngine->spec.freq, audioEngine->renderPath);
+  if (stats.callbacks > 0) {
+    ENGINE_printLog(engine, "Mixer: %llu callbacks of %i samples, %.1f voices, average %.1fus, max %.1fus\n",
+        (unsigned long long)stats.callbacks, audioEngine->spec.samples,
+        (double)stats.voices / stats.callbacks,
+        stats.ticks / ticksPerMicrosecond / stats.callbacks,
+        stats.maxTicks / ticksPerMicrosecond);
+  }
+}
+
+internal void AUDIO_ENGINE_free(AUDIO_ENGINE* engine) {
+  // We might need to free contained audio here
+  AUDIO_ENGINE_halt(engine);
+  SDL_AtomicSet(&engine->recorder.active, 0);
+  AUDIO_RECORDER_stop(&engine->recorder);
+  // The device is closed, so anything still queued can be applied here
+  while (engine->activeCount > 0) {
+    AUDIO_ENGINE_retireChannel(engine, engine->active[0]);
+  }
+  AUDIO_ENGINE_publish(engine);
+  AUDIO_ENGINE_drain(engine);
+  AUDIO_ENGINE_collect(engine);
+  free(engine->commands.commands);
+  free(engine->handles);
+  free(engine->active);
+  free(engine->ranked);
+  for (uint32_t b = 0; b < engine->busCount; b++) {
+    AUDIO_BUS* bus = &engine->buses[b];
+    for (uint32_t i = 0; i < bus->effectCount; i++) {
+      AUDIO_EFFECT_free(bus->effects[i]);
+    }
+    free(bus->buffer);
+  }
+  AUDIO_STREAMER_free(&engine->streamer);
+  AUDIO_WAV_WRITER_close(&engine->renderFile);
+  free(engine->renderBuffer);
+  free(engine->renderPath);
+}
+
+// The rest of the channel API takes the handle given out by f_play. Once a
+// channel is retired, its handle reads as stopped, and changes are ignored.
+internal AUDIO_CHANNEL*
+AUDIO_CHANNEL_fromSlot(WrenVM* vm, int slot) {
+  if (wrenGetSlotType(vm, slot) != WREN_TYPE_NUM) {
+    return NULL;
+  }
+  ENGINE* engine = wrenGetUserData(vm);
+  return AUDIO_ENGINE_getChannel(engine->audioEngine, wrenGetSlotDouble(vm, slot));
+}
+
+// Buses are referred to by their index. Returns NULL, having aborted the
+// fiber, if there is no such bus.
+internal AUDIO_BUS*
+AUDIO_BUS_fromSlot(WrenVM* vm, int slot, uint32_t* index) {
+  ENGINE* engine = wrenGetUserData(vm);
+  AUDIO_ENGINE* audioEngine = engine->audioEngine;
+  double value = wrenGetSlotType(vm, slot) == WREN_TYPE_NUM ? wrenGetSlotDouble(vm, slot) : -1;
+  if (value < 0 || value >= audioEngine->busCount || value != (uint32_t)value) {
+    VM_ABORT(vm, "Audio bus does not exist");
+    return NULL;
+  }
+  *index = value;
+  return &audioEngine->buses[*index];
+}
+
+// Gives a channel the audio it will play, and starts decoding it if it is
+// streamed. Returns false if the stream couldn't be started.
+internal bool
+AUDIO_CHANNEL_setAudio(AUDIO_ENGINE* engine, AUDIO_CHANNEL* channel, AUDIO_DATA* audio) {
+  // The device may have changed rate since this was loaded
+  AUDIO_DATA_convert(audio, engine->spec.freq);
+  channel->audio = AUDIO_DATA_retain(audio);
+  if (audio->stream != NULL) {
+    channel->stream = AUDIO_STREAM_new(audio->stream, engine->spec.freq, 0);
+    if (channel->stream == NULL) {
+      return false;
+    }
+    SDL_AtomicSet(&channel->stream->loop, channel->loop);
+    AUDIO_STREAMER_add(&engine->streamer, channel->stream);
+  }
+  if (audio->module != NULL) {
+    channel->player = AUDIO_MODULE_PLAYER_new(audio->module, engine->spec.freq, channel->loop);
+  }
+  if (audio->adpcm != NULL) {
+    AUDIO_ADPCM* adpcm = audio->adpcm;
+    channel->decoder = malloc(sizeof(AUDIO_ADPCM_DECODER) + sizeof(int16_t) * adpcm->blockFrames * adpcm->channels);
+    channel->decoder->block = UINT32_MAX;
+  }
+  return true;
+}
+
+// Makes a channel with the settings every sound has. The mixer can't see
+// the channel until it is played, so they can be written directly rather
+// than sent.
+internal AUDIO_CHANNEL*
+AUDIO_CHANNEL_new(const char* soundId, double volume, bool loop, double pan, double priority, uint32_t bus) {
+  AUDIO_CHANNEL* channel = calloc(1, sizeof(AUDIO_CHANNEL));
+  size_t len = strlen(soundId);
+  channel->soundId = malloc((1 + len) * sizeof(char));
+  strcpy(channel->soundId, soundId);
+  channel->soundId[len] = '\0';
+
+  channel->volume = (float)max(0, volume);
+  channel->loop = loop;
+  channel->pan = (float)mid(-1.0, pan, 1.0f);
+  channel->priority = priority;
+  channel->mix.volume = channel->volume;
+  channel->mix.fade = 1;
+  channel->mix.fadeTarget = 1;
+  channel->mix.loop = channel->loop;
+  channel->mix.pan = channel->pan;
+  channel->mix.bus = bus;
+  channel->rate = 1;
+  channel->range[0] = channel->mix.range[0] = AUDIO_DEFAULT_MIN_DISTANCE;
+  channel->range[1] = channel->mix.range[1] = AUDIO_DEFAULT_MAX_DISTANCE;
+  channel->mix.step = AUDIO_RATE_ONE;
+  channel->mix.interpolation = AUDIO_INTERPOLATION_LINEAR;
+  return channel;
+}
+
+internal void AUDIO_ENGINE_play(WrenVM* vm) {
+  ENGINE* engine = wrenGetUserData(vm);
+  AUDIO_ENGINE* audioEngine = engine->audioEngine;
+  ASSERT_SLOT_TYPE(vm, 1, STRING, "sound id");
+  ASSERT_SLOT_TYPE(vm, 3, NUM, "volume");
+  ASSERT_SLOT_TYPE(vm, 4, BOOL, "loop");
+  ASSERT_SLOT_TYPE(vm, 5, NUM, "pan");
+  ASSERT_SLOT_TYPE(vm, 6, NUM, "priority");
+  uint32_t bus;
+  if (AUDIO_BUS_fromSlot(vm, 7, &bus) == NULL) {
+    return;
+  }
+  // The audio may still be loading, in which case the channel waits for it
+  AUDIO_DATA* audio = NULL;
+  if (wrenGetSlotType(vm, 2) != WREN_TYPE_NULL) {
+    ASSERT_SLOT_TYPE(vm, 2, FOREIGN, "audio");
+    audio = AUDIO_DATA_fromSlot(vm, 2);
+    if (audio->buffer == NULL && audio->stream == NULL && audio->module == NULL && audio->adpcm == NULL) {
+      VM_ABORT(vm, "Audio data has not been loaded");
+      return;
+    }
+  }
+
+  AUDIO_CHANNEL* channel = AUDIO_CHANNEL_new(wrenGetSlotString(vm, 1),
+      wrenGetSlotDouble(vm, 3), wrenGetSlotBool(vm, 4), wrenGetSlotDouble(vm, 5),
+      wrenGetSlotDouble(vm, 6), bus);
+  channel->state = audio != NULL ? CHANNEL_INITIALIZE : CHANNEL_LOADING;
+
+  if (audio != NULL && !AUDIO_CHANNEL_setAudio(audioEngine, channel, audio)) {
+    AUDIO_CHANNEL_free(channel);
+    VM_ABORT(vm, "Could not start streaming audio");
+    return;
+  }
+
+  if (!AUDIO_ENGINE_addChannel(audioEngine, channel)) {
+    AUDIO_CHANNEL_free(channel);
+    VM_ABORT(vm, "Too many audio channels");
+    return;
+  }
+  wrenSetSlotDouble(vm, 0, channel->handle);
+}
+
+// Starts a synth voice, with its settings as a list in slot 1, and an
+// optional wavetable in slot 2. The voice stops itself once its envelope
+// has been released.
+internal void AUDIO_ENGINE_playSynth(WrenVM* vm) {
+  ENGINE* engine = wrenGetUserData(vm);
+  AUDIO_ENGINE* audioEngine = engine->audioEngine;
+  ASSERT_SLOT_TYPE(vm, 1, LIST, "settings");
+  ASSERT_SLOT_TYPE(vm, 3, NUM, "volume");
+  ASSERT_SLOT_TYPE(vm, 4, NUM, "pan");
+  ASSERT_SLOT_TYPE(vm, 5, NUM, "priority");
+  uint32_t bus;
+  if (AUDIO_BUS_fromSlot(vm, 6, &bus) == NULL) {
+    return;
+  }
+  if (wrenGetListCount(vm, 1) != AUDIO_SYNTH_PARAM_COUNT) {
+    VM_ABORT(vm, "Wrong number of synth settings");
+    return;
+  }
+  wrenEnsureSlots(vm, 8);
+  float params[AUDIO_SYNTH_PARAM_COUNT];
+  for (int i = 0; i < AUDIO_SYNTH_PARAM_COUNT; i++) {
+    wrenGetListElement(vm, 1, i, 7);
+    ASSERT_SLOT_TYPE(vm, 7, NUM, "synth setting");
+    params[i] = wrenGetSlotDouble(vm, 7);
+  }
+  double wave = params[AUDIO_SYNTH_WAVE];
+  if (wave < AUDIO_WAVE_SQUARE || wave >= AUDIO_WAVE_LAST || wave != (int)wave) {
+    VM_ABORT(vm, "wave must be an AudioWave");
+    return;
+  }
+
+  float table[AUDIO_SYNTH_MAX_TABLE];
+  uint32_t tableLength = 0;
+  if (wave == AUDIO_WAVE_WAVETABLE) {
+    ASSERT_SLOT_TYPE(vm, 2, LIST, "wavetable");
+    int count = wrenGetListCount(vm, 2);
+    if (count < 2 || count > AUDIO_SYNTH_MAX_TABLE) {
+      VM_ABORT(vm, "wavetable must hold between 2 and 4096 samples");
+      return;
+    }
+    for (int i = 0; i < count; i++) {
+      wrenGetListElement(vm, 2, i, 7);
+      ASSERT_SLOT_TYPE(vm, 7, NUM, "wavetable sample");
+      table[i] = wrenGetSlotDouble(vm, 7);
+    }
+    tableLength = count;
+  }
+
+  AUDIO_CHANNEL* channel = AUDIO_CHANNEL_new("synth", wrenGetSlotDouble(vm, 3), false,
+      wrenGetSlotDouble(vm, 4), wrenGetSlotDouble(vm, 5), bus);
+  channel->synth = AUDIO_SYNTH_new(params, table, tableLength, audioEngine->spec.freq);
+  channel->state = CHANNEL_INITIALIZE;
+  if (!AUDIO_ENGINE_addChannel(audioEngine, channel)) {
+    AUDIO_CHANNEL_free(channel);
+    VM_ABORT(vm, "Too many audio channels");
+    return;
+  }
+  wrenSetSlotDouble(vm, 0, channel->handle);
+}
+
+// Holds back a channel which was just played until the audio clock reaches
+// the frame in slot 2. The mixer can't see the channel before the next
+// update, so this can be set directly.
+internal void AUDIO_CHANNEL_schedule(WrenVM* vm) {
+  AUDIO_CHANNEL* channel = AUDIO_CHANNEL_fromSlot(vm, 1);
+  ASSERT_SLOT_TYPE(vm, 2, NUM, "time");
+  if (channel == NULL) {
+    return;
+  }
+  if (channel->state != CHANNEL_INITIALIZE && channel->state != CHANNEL_LOADING) {
+    VM_ABORT(vm, "Channel has already started");
+    return;
+  }
+  channel->mix.start = max(0, wrenGetSlotDouble(vm, 2));
+}
+
+// Hands a channel which was waiting on its audio the data, once loaded.
+internal void AUDIO_ENGINE_setChannelAudio(WrenVM* vm) {
+  ENGINE* engine = wrenGetUserData(vm);
+  AUDIO_CHANNEL* channel = AUDIO_CHANNEL_fromSlot(vm, 1);
+  ASSERT_SLOT_TYPE(vm, 2, FOREIGN, "audio");
+  if (channel == NULL || channel->state != CHANNEL_LOADING) {
+    return;
+  }
+  if (!AUDIO_CHANNEL_setAudio(engine->audioEngine, channel, AUDIO_DATA_fromSlot(vm, 2))) {
+    VM_ABORT(vm, "Could not start streaming audio");
+    return;
+  }
+  channel->state = CHANNEL_TO_PLAY;
+}
+
+internal uint32_t
+AUDIO_ENGINE_secondsToFrames(AUDIO_ENGINE* engine, double seconds) {
+  return max(0, seconds) * engine->spec.freq;
+}
+
+// Even an immediate stop is faded out over a few milliseconds, so the
+// channel doesn't click as it is cut off.
+internal uint32_t
+AUDIO_ENGINE_stopFrames(AUDIO_ENGINE* engine, double seconds) {
+  return max(AUDIO_ENGINE_secondsToFrames(engine, seconds), engine->spec.freq / 200);
+}
+
+internal void AUDIO_ENGINE_stop(WrenVM* vm) {
+  ENGINE* engine = wrenGetUserData(vm);
+  AUDIO_CHANNEL* channel = AUDIO_CHANNEL_fromSlot(vm, 1);
+  ASSERT_SLOT_TYPE(vm, 2, NUM, "seconds");
+  if (channel != NULL && !channel->stopRequested) {
+    channel->stopRequested = true;
+    channel->stopFrames = AUDIO_ENGINE_stopFrames(engine->audioEngine, wrenGetSlotDouble(vm, 2));
+  }
+}
+
+internal void AUDIO_ENGINE_stopAll(WrenVM* vm) {
+  ENGINE* engine = wrenGetUserData(vm);
+  AUDIO_ENGINE* audioEngine = engine->audioEngine;
+  for (uint32_t i = 0; i < audioEngine->activeCount; i++) {
+    AUDIO_CHANNEL* channel = audioEngine->active[i];
+    if (!channel->stopRequested) {
+      channel->stopRequested = true;
+      channel->stopFrames = AUDIO_ENGINE_stopFrames(audioEngine, 0);
+    }
+  }
+}
+
+internal void AUDIO_CHANNEL_fade(WrenVM* vm) {
+  ENGINE* engine = wrenGetUserData(vm);
+  AUDIO_CHANNEL* channel = AUDIO_CHANNEL_fromSlot(vm, 1);
+  ASSERT_SLOT_TYPE(vm, 2, NUM, "level");
+  ASSERT_SLOT_TYPE(vm, 3, NUM, "seconds");
+  if (channel == NULL || channel->stopRequested) {
+    return;
+  }
+  float level = max(0, wrenGetSlotDouble(vm, 2));
+  uint32_t frames = AUDIO_ENGINE_secondsToFrames(engine->audioEngine, wrenGetSlotDouble(vm, 3));
+  AUDIO_ENGINE_sendRamp(engine->audioEngine, AUDIO_COMMAND_FADE, channel, level, frames);
+}
+
+internal void AUDIO_CHANNEL_fadeIn(WrenVM* vm) {
+  ENGINE* engine = wrenGetUserData(vm);
+  AUDIO_CHANNEL* channel = AUDIO_CHANNEL_fromSlot(vm, 1);
+  ASSERT_SLOT_TYPE(vm, 2, NUM, "seconds");
+  if (channel == NULL || channel->stopRequested) {
+    return;
+  }
+  uint32_t frames = AUDIO_ENGINE_secondsToFrames(engine->audioEngine, wrenGetSlotDouble(vm, 2));
+  AUDIO_ENGINE_sendRamp(engine->audioEngine, AUDIO_COMMAND_FADE_IN, channel, 1, frames);
+}
+
+// Halts every channel playing the named sound immediately.
+internal void AUDIO_ENGINE_unload(WrenVM* vm) {
+  ENGINE* engine = wrenGetUserData(vm);
+  AUDIO_ENGINE* audioEngine = engine->audioEngine;
+  ASSERT_SLOT_TYPE(vm, 1, STRING, "sound id");
+  const char* soundId = wrenGetSlotString(vm, 1);
+  uint32_t i = 0;
+  while (i < audioEngine->activeCount) {
+    AUDIO_CHANNEL* channel = audioEngine->active[i];
+    if (STRINGS_EQUAL(channel->soundId, soundId)) {
+      AUDIO_CHANNEL_setEnabled(audioEngine, channel, false);
+      channel->state = CHANNEL_STOPPED;
+      AUDIO_ENGINE_retireChannel(audioEngine, channel);
+    } else {
+      i++;
+    }
+  }
+}
+
+internal void AUDIO_CHANNEL_getState(WrenVM* vm) {
+  AUDIO_CHANNEL* channel = AUDIO_CHANNEL_fromSlot(vm, 1);
+  wrenEnsureSlots(vm, 1);
+  wrenSetSlotDouble(vm, 0, channel != NULL ? channel->state : CHANNEL_STOPPED);
+}
+
+internal void AUDIO_CHANNEL_getFinished(WrenVM* vm) {
+  AUDIO_CHANNEL* channel = AUDIO_CHANNEL_fromSlot(vm, 1);
+  wrenEnsureSlots(vm, 1);
+  wrenSetSlotBool(vm, 0, channel == NULL || AUDIO_CHANNEL_isFinished(channel));
+}
+
+internal void AUDIO_CHANNEL_getPosition(WrenVM* vm) {
+  AUDIO_CHANNEL* channel = AUDIO_CHANNEL_fromSlot(vm, 1);
+  wrenEnsureSlots(vm, 1);
+  if (channel != NULL) {
+    wrenSetSlotDouble(vm, 0, (uint32_t)SDL_AtomicGet(&channel->position));
+  } else {
+    wrenSetSlotNull(vm, 0);
+  }
+}
+
+// The length changes if the device is reopened at another rate
+internal void AUDIO_CHANNEL_getLength(WrenVM* vm) {
+  AUDIO_CHANNEL* channel = AUDIO_CHANNEL_fromSlot(vm, 1);
+  wrenEnsureSlots(vm, 1);
+  if (channel != NULL && channel->audio != NULL) {
+    wrenSetSlotDouble(vm, 0, channel->audio->length);
+  } else {
+    wrenSetSlotNull(vm, 0);
+  }
+}
+
+// Where a module channel has got to in its song, as [order, pattern, row]
+internal void AUDIO_CHANNEL_getSongPosition(WrenVM* vm) {
+  AUDIO_CHANNEL* channel = AUDIO_CHANNEL_fromSlot(vm, 1);
+  wrenEnsureSlots(vm, 2);
+  if (channel == NULL || channel->player == NULL) {
+    wrenSetSlotNull(vm, 0);
+    return;
+  }
+  uint32_t position = SDL_AtomicGet(&channel->player->songPosition);
+  uint32_t order = position >> 8;
+  wrenSetSlotNewList(vm, 0);
+  wrenSetSlotDouble(vm, 1, order);
+  wrenInsertInList(vm, 0, -1, 1);
+  wrenSetSlotDouble(vm, 1, channel->audio->module->orders[order]);
+  wrenInsertInList(vm, 0, -1, 1);
+  wrenSetSlotDouble(vm, 1, position & 0xFF);
+  wrenInsertInList(vm, 0, -1, 1);
+}
+
+internal void AUDIO_CHANNEL_setLoop(WrenVM* vm) {
+  AUDIO_CHANNEL* channel = AUDIO_CHANNEL_fromSlot(vm, 1);
+  ASSERT_SLOT_TYPE(vm, 2, BOOL, "loop");
+  bool loop = wrenGetSlotBool(vm, 2);
+  if (channel == NULL || loop == channel->loop) {
+    return;
+  }
+  channel->loop = loop;
+  if (channel->stream != NULL) {
+    SDL_AtomicSet(&channel->stream->loop, channel->loop);
+  }
+  ENGINE* engine = wrenGetUserData(vm);
+  AUDIO_ENGINE_sendCommand(engine->audioEngine, AUDIO_COMMAND_LOOP, channel, loop);
+}
+
+internal void AUDIO_CHANNEL_setVolume(WrenVM* vm) {
+  AUDIO_CHANNEL* channel = AUDIO_CHANNEL_fromSlot(vm, 1);
+  ASSERT_SLOT_TYPE(vm, 2, NUM, "volume");
+  float volume = (float)max(0, wrenGetSlotDouble(vm, 2));
+  if (channel == NULL || volume == channel->volume) {
+    return;
+  }
+  channel->volume = volume;
+  ENGINE* engine = wrenGetUserData(vm);
+  AUDIO_ENGINE_sendCommand(engine->audioEngine, AUDIO_COMMAND_VOLUME, channel, volume);
+}
+
+internal void AUDIO_CHANNEL_setPan(WrenVM* vm) {
+  AUDIO_CHANNEL* channel = AUDIO_CHANNEL_fromSlot(vm, 1);
+  ASSERT_SLOT_TYPE(vm, 2, NUM, "pan");
+  float pan = (float)mid(-1.0, wrenGetSlotDouble(vm, 2), 1.0f);
+  if (channel == NULL || pan == channel->pan) {
+    return;
+  }
+  channel->pan = pan;
+  ENGINE* engine = wrenGetUserData(vm);
+  AUDIO_ENGINE_sendCommand(engine->audioEngine, AUDIO_COMMAND_PAN, channel, pan);
+}
+
+// Streamed audio always plays at its natural rate
+internal void AUDIO_CHANNEL_setRate(WrenVM* vm) {
+  AUDIO_CHANNEL* channel = AUDIO_CHANNEL_fromSlot(vm, 1);
+  ASSERT_SLOT_TYPE(vm, 2, NUM, "rate");
+  double rate = wrenGetSlotDouble(vm, 2);
+  if (rate <= 0) {
+    VM_ABORT(vm, "rate must be greater than 0");
+    return;
+  }
+  rate = min(rate, AUDIO_MAX_RATE);
+  if (channel == NULL || rate == channel->rate) {
+    return;
+  }
+  channel->rate = rate;
+  ENGINE* engine = wrenGetUserData(vm);
+  AUDIO_ENGINE_sendCommand(engine->audioEngine, AUDIO_COMMAND_RATE, channel, rate);
+}
+
+internal void AUDIO_CHANNEL_setInterpolation(WrenVM* vm) {
+  AUDIO_CHANNEL* channel = AUDIO_CHANNEL_fromSlot(vm, 1);
+  ASSERT_SLOT_TYPE(vm, 2, NUM, "interpolation");
+  double interpolation = wrenGetSlotDouble(vm, 2);
+  if (interpolation != AUDIO_INTERPOLATION_LINEAR && interpolation != AUDIO_INTERPOLATION_CUBIC) {
+    VM_ABORT(vm, "interpolation must be an AudioInterpolation");
+    return;
+  }
+  if (channel == NULL) {
+    return;
+  }
+  ENGINE* engine = wrenGetUserData(vm);
+  AUDIO_ENGINE_sendCommand(engine->audioEngine, AUDIO_COMMAND_INTERPOLATION, channel, interpolation);
+}
+
+// Moves a batch of positional channels at once. The list in slot 1 holds
+// a handle, x and y for each. Channels which have since been retired are
+// skipped.
+internal void AUDIO_ENGINE_setPositions(WrenVM* vm) {
+  ENGINE* engine = wrenGetUserData(vm);
+  AUDIO_ENGINE* audioEngine = engine->audioEngine;
+  ASSERT_SLOT_TYPE(vm, 1, LIST, "positions");
+  int count = wrenGetListCount(vm, 1);
+  if (count % 3 != 0) {
+    VM_ABORT(vm, "positions must hold a channel, x and y for each sound");
+    return;
+  }
+  wrenEnsureSlots(vm, 3);
+  for (int i = 0; i < count; i += 3) {
+    wrenGetListElement(vm, 1, i, 2);
+    AUDIO_CHANNEL* channel = AUDIO_CHANNEL_fromSlot(vm, 2);
+    wrenGetListElement(vm, 1, i + 1, 2);
+    ASSERT_SLOT_TYPE(vm, 2, NUM, "x");
+    float x = wrenGetSlotDouble(vm, 2);
+    wrenGetListElement(vm, 1, i + 2, 2);
+    ASSERT_SLOT_TYPE(vm, 2, NUM, "y");
+    float y = wrenGetSlotDouble(vm, 2);
+    if (channel == NULL) {
+      continue;
+    }
+    channel->spatial = true;
+    channel->emitter[0] = x;
+    channel->emitter[1] = y;
+    AUDIO_ENGINE_sendPoint(audioEngine, AUDIO_COMMAND_POSITION, channel, 0, x, y);
+  }
+}
+
+internal void AUDIO_CHANNEL_setRange(WrenVM* vm) {
+  AUDIO_CHANNEL* channel = AUDIO_CHANNEL_fromSlot(vm, 1);
+  ASSERT_SLOT_TYPE(vm, 2, NUM, "min distance");
+  ASSERT_SLOT_TYPE(vm, 3, NUM, "max distance");
+  float minDistance = wrenGetSlotDouble(vm, 2);
+  float maxDistance = wrenGetSlotDouble(vm, 3);
+  if (minDistance <= 0 || maxDistance < minDistance) {
+    VM_ABORT(vm, "min distance must be above 0, and no more than max distance");
+    return;
+  }
+  if (channel == NULL) {
+    return;
+  }
+  channel->range[0] = minDistance;
+  channel->range[1] = maxDistance;
+  ENGINE* engine = wrenGetUserData(vm);
+  AUDIO_ENGINE_sendPoint(engine->audioEngine, AUDIO_COMMAND_RANGE, channel, 0, minDistance, maxDistance);
+}
+
+internal void AUDIO_ENGINE_setListener(WrenVM* vm) {
+  ENGINE* engine = wrenGetUserData(vm);
+  AUDIO_ENGINE* audioEngine = engine->audioEngine;
+  ASSERT_SLOT_TYPE(vm, 1, NUM, "x");
+  ASSERT_SLOT_TYPE(vm, 2, NUM, "y");
+  audioEngine->spatial.listener[0] = wrenGetSlotDouble(vm, 1);
+  audioEngine->spatial.listener[1] = wrenGetSlotDouble(vm, 2);
+  AUDIO_ENGINE_sendPoint(audioEngine, AUDIO_COMMAND_LISTENER, NULL, 0,
+      audioEngine->spatial.listener[0], audioEngine->spatial.listener[1]);
+}
+
+internal void AUDIO_ENGINE_setAttenuation(WrenVM* vm) {
+  ENGINE* engine = wrenGetUserData(vm);
+  AUDIO_ENGINE* audioEngine = engine->audioEngine;
+  ASSERT_SLOT_TYPE(vm, 1, NUM, "attenuation");
+  ASSERT_SLOT_TYPE(vm, 2, NUM, "rolloff");
+  double model = wrenGetSlotDouble(vm, 1);
+  double rolloff = wrenGetSlotDouble(vm, 2);
+  if (model != AUDIO_ATTENUATION_INVERSE && model != AUDIO_ATTENUATION_LINEAR
+      && model != AUDIO_ATTENUATION_EXPONENTIAL) {
+    VM_ABORT(vm, "attenuation must be an AudioAttenuation");
+    return;
+  }
+  if (rolloff < 0) {
+    VM_ABORT(vm, "rolloff must not be negative");
+    return;
+  }
+  audioEngine->spatial.model = model;
+  audioEngine->spatial.rolloff = rolloff;
+  AUDIO_ENGINE_sendPoint(audioEngine, AUDIO_COMMAND_ATTENUATION, NULL, model, rolloff, 0);
+}
+
+internal void AUDIO_CHANNEL_setPriority(WrenVM* vm) {
+  AUDIO_CHANNEL* channel = AUDIO_CHANNEL_fromSlot(vm, 1);
+  ASSERT_SLOT_TYPE(vm, 2, NUM, "priority");
+  if (channel != NULL) {
+    channel->priority = wrenGetSlotDouble(vm, 2);
+  }
+}
+
+internal void AUDIO_ENGINE_getMaxVoices(WrenVM* vm) {
+  ENGINE* engine = wrenGetUserData(vm);
+  wrenEnsureSlots(vm, 1);
+  wrenSetSlotDouble(vm, 0, engine->audioEngine->maxVoices);
+}
+
+internal void AUDIO_ENGINE_setMaxVoices(WrenVM* vm) {
+  ENGINE* engine = wrenGetUserData(vm);
+  ASSERT_SLOT_TYPE(vm, 1, NUM, "max voices");
+  double maxVoices = wrenGetSlotDouble(vm, 1);
+  if (maxVoices < 0 || maxVoices != (uint32_t)maxVoices) {
+    VM_ABORT(vm, "max voices must be a non-negative integer");
+    return;
+  }
+  engine->audioEngine->maxVoices = maxVoices;
+}
+
+// These match the values of AudioFormat
+typedef enum {
+  AUDIO_FORMAT_INT16 = 1,
+  AUDIO_FORMAT_FLOAT32 = 2
+} AUDIO_FORMAT;
+
+internal void AUDIO_ENGINE_configure(WrenVM* vm) {
+  ENGINE* engine = wrenGetUserData(vm);
+  AUDIO_ENGINE* audioEngine = engine->audioEngine;
+  ASSERT_SLOT_TYPE(vm, 1, NUM, "sample rate");
+  ASSERT_SLOT_TYPE(vm, 2, NUM, "buffer size");
+  ASSERT_SLOT_TYPE(vm, 3, NUM, "format");
+  ASSERT_SLOT_TYPE(vm, 4, NUM, "channels");
+  double rate = wrenGetSlotDouble(vm, 1);
+  double bufferSize = wrenGetSlotDouble(vm, 2);
+  double format = wrenGetSlotDouble(vm, 3);
+  double outChannels = wrenGetSlotDouble(vm, 4);
+  if (rate < 8000 || rate > 192000 || rate != (int)rate) {
+    VM_ABORT(vm, "sample rate must be a whole number between 8000 and 192000");
+    return;
+  }
+  if (bufferSize < 16 || bufferSize > 32768 || bufferSize != (int)bufferSize
+      || ((int)bufferSize & ((int)bufferSize - 1)) != 0) {
+    VM_ABORT(vm, "buffer size must be a power of two between 16 and 32768");
+    return;
+  }
+  if (format != AUDIO_FORMAT_INT16 && format != AUDIO_FORMAT_FLOAT32) {
+    VM_ABORT(vm, "format must be an AudioFormat");
+    return;
+  }
+  if (outChannels < 1 || outChannels > 8 || outChannels != (int)outChannels) {
+    VM_ABORT(vm, "channels must be a whole number between 1 and 8");
+    return;
+  }
+
+  INIT_TO_ZERO(SDL_AudioSpec, desired);
+  desired.freq = rate;
+  desired.format = format == AUDIO_FORMAT_FLOAT32 ? AUDIO_F32SYS : AUDIO_S16SYS;
+  desired.channels = outChannels;
+  desired.samples = bufferSize;
+  if (!AUDIO_ENGINE_reopen(audioEngine, desired)) {
+    VM_ABORT(vm, "Could not open the audio device with those settings");
+    return;
+  }
+  if (DEBUG_MODE) {
+    DEBUG_printAudioDevice(engine, audioEngine->spec);
+  }
+}
+
+internal void AUDIO_ENGINE_getBufferSize(WrenVM* vm) {
+  ENGINE* engine = wrenGetUserData(vm);
+  wrenEnsureSlots(vm, 1);
+  wrenSetSlotDouble(vm, 0, engine->audioEngine->spec.samples);
+}
+
+internal void AUDIO_ENGINE_getFormat(WrenVM* vm) {
+  ENGINE* engine = wrenGetUserData(vm);
+  wrenEnsureSlots(vm, 1);
+  bool isFloat = SDL_AUDIO_ISFLOAT(engine->audioEngine->spec.format);
+  wrenSetSlotDouble(vm, 0, isFloat ? AUDIO_FORMAT_FLOAT32 : AUDIO_FORMAT_INT16);
+}
+
+internal void AUDIO_ENGINE_getChannels(WrenVM* vm) {
+  ENGINE* engine = wrenGetUserData(vm);
+  wrenEnsureSlots(vm, 1);
+  wrenSetSlotDouble(vm, 0, engine->audioEngine->spec.channels);
+}
+
+// Reports [callbacks, frames, average seconds, most seconds, average
+// voices] for the callbacks since the last reset.
+internal void AUDIO_ENGINE_getMixerStats(WrenVM* vm) {
+  ENGINE* engine = wrenGetUserData(vm);
+  AUDIO_ENGINE* audioEngine = engine->audioEngine;
+  AUDIO_ENGINE_lock(audioEngine);
+  AUDIO_MIXER_STATS stats = audioEngine->stats;
+  AUDIO_ENGINE_unlock(audioEngine);
+
+  double frequency = SDL_GetPerformanceFrequency();
+  double callbacks = max(1, stats.callbacks);
+  double values[] = {
+    stats.callbacks,
+    stats.frames,
+    stats.ticks / frequency / callbacks,
+    stats.maxTicks / frequency,
+    stats.voices / callbacks
+  };
+  wrenEnsureSlots(vm, 2);
+  wrenSetSlotNewList(vm, 0);
+  for (size_t i = 0; i < sizeof(values) / sizeof(values[0]); i++) {
+    wrenSetSlotDouble(vm, 1, values[i]);
+    wrenInsertInList(vm, 0, -1, 1);
+  }
+}
+
+internal void AUDIO_ENGINE_resetMixerStats(WrenVM* vm) {
+  ENGINE* engine = wrenGetUserData(vm);
+  AUDIO_ENGINE* audioEngine = engine->audioEngine;
+  AUDIO_ENGINE_lock(audioEngine);
+  memset(&audioEngine->stats, 0, sizeof(AUDIO_MIXER_STATS));
+  AUDIO_ENGINE_unlock(audioEngine);
+}
+
+internal void AUDIO_ENGINE_record(WrenVM* vm) {
+  ENGINE* engine = wrenGetUserData(vm);
+  ASSERT_SLOT_TYPE(vm, 1, STRING, "path");
+  if (AUDIO_RECORDER_isActive(&engine->audioEngine->recorder)) {
+    VM_ABORT(vm, "Audio is already being recorded");
+    return;
+  }
+  const char* path = wrenGetSlotString(vm, 1);
+  char* base = BASEPATH_get();
+  char* fullPath = malloc(strlen(base) + strlen(path) + 1);
+  strcpy(fullPath, base);
+  strcat(fullPath, path);
+  bool started = AUDIO_ENGINE_startRecording(engine->audioEngine, fullPath);
+  free(fullPath);
+  if (!started) {
+    VM_ABORT(vm, "Could not open the file to record audio to");
+    return;
+  }
+  ENGINE_printLog(engine, "Recording audio to %s\n", path);
+}
+
+internal void AUDIO_ENGINE_stopRecording(WrenVM* vm) {
+  ENGINE* engine = wrenGetUserData(vm);
+  uint32_t dropped = AUDIO_ENGINE_finishRecording(engine->audioEngine);
+  if (dropped > 0) {
+    ENGINE_printLog(engine, "Audio recording dropped %u samples\n", dropped);
+  }
+}
+
+internal void AUDIO_ENGINE_isRecording(WrenVM* vm) {
+  ENGINE* engine = wrenGetUserData(vm);
+  wrenEnsureSlots(vm, 1);
+  wrenSetSlotBool(vm, 0, AUDIO_RECORDER_isActive(&engine->audioEngine->recorder));
+}
+
+// Changes to the buses themselves are made with the device locked, as the
+// mixer walks them every block. Only the bus changes straight away, so the
+// rest of the update still starts on the same sample.
+internal void
+AUDIO_ENGINE_lockBuses(AUDIO_ENGINE* engine) {
+  AUDIO_ENGINE_lock(engine);
+}
+
+internal void AUDIO_ENGINE_addBus(WrenVM* vm) {
+  ENGINE* engine = wrenGetUserData(vm);
+  AUDIO_ENGINE* audioEngine = engine->audioEngine;
+  if (audioEngine->busCount == AUDIO_MAX_BUSES) {
+    VM_ABORT(vm, "Too many audio buses");
+    return;
+  }
+  float* buffer = calloc(audioEngine->busFrames * channels, sizeof(float));
+  AUDIO_ENGINE_lockBuses(audioEngine);
+  AUDIO_BUS* bus = &audioEngine->buses[audioEngine->busCount];
+  memset(bus, 0, sizeof(AUDIO_BUS));
+  bus->buffer = buffer;
+  bus->volume = 1;
+  bus->gain = 1;
+  audioEngine->busCount++;
+  AUDIO_ENGINE_unlock(audioEngine);
+  wrenEnsureSlots(vm, 1);
+  wrenSetSlotDouble(vm, 0, audioEngine->busCount - 1);
+}
+
+internal void AUDIO_BUS_setVolume(WrenVM* vm) {
+  ENGINE* engine = wrenGetUserData(vm);
+  uint32_t index;
+  if (AUDIO_BUS_fromSlot(vm, 1, &index) == NULL) {
+    return;
+  }
+  ASSERT_SLOT_TYPE(vm, 2, NUM, "volume");
+  float volume = max(0, wrenGetSlotDouble(vm, 2));
+  AUDIO_ENGINE_sendBusCommand(engine->audioEngine, AUDIO_COMMAND_BUS_VOLUME, index, 0, 0, volume);
+}
+
+internal void AUDIO_BUS_setMute(WrenVM* vm) {
+  ENGINE* engine = wrenGetUserData(vm);
+  uint32_t index;
+  if (AUDIO_BUS_fromSlot(vm, 1, &index) == NULL) {
+    return;
+  }
+  ASSERT_SLOT_TYPE(vm, 2, BOOL, "mute");
+  bool mute = wrenGetSlotBool(vm, 2);
+  AUDIO_ENGINE_sendBusCommand(engine->audioEngine, AUDIO_COMMAND_BUS_MUTE, index, 0, 0, mute);
+}
+
+// Adds an effect of the type in slot 2 to the end of the bus's chain, with
+// the list of parameters in slot 3, and returns its index.
+internal void AUDIO_BUS_addEffect(WrenVM* vm) {
+  ENGINE* engine = wrenGetUserData(vm);
+  AUDIO_ENGINE* audioEngine = engine->audioEngine;
+  uint32_t index;
+  AUDIO_BUS* bus = AUDIO_BUS_fromSlot(vm, 1, &index);
+  if (bus == NULL) {
+    return;
+  }
+  ASSERT_SLOT_TYPE(vm, 2, NUM, "effect");
+  ASSERT_SLOT_TYPE(vm, 3, LIST, "parameters");
+  double type = wrenGetSlotDouble(vm, 2);
+  if (type <= AUDIO_EFFECT_NONE || type >= AUDIO_EFFECT_LAST || type != (int)type) {
+    VM_ABORT(vm, "effect must be an AudioEffect");
+    return;
+  }
+  if (bus->effectCount == AUDIO_MAX_EFFECTS) {
+    VM_ABORT(vm, "Too many effects on this bus");
+    return;
+  }
+  uint32_t count = AUDIO_EFFECT_paramCount(type);
+  if (wrenGetListCount(vm, 3) != (int)count) {
+    VM_ABORT(vm, "Wrong number of parameters for this effect");
+    return;
+  }
+  float params[AUDIO_EFFECT_MAX_PARAMS];
+  wrenEnsureSlots(vm, 5);
+  for (uint32_t i = 0; i < count; i++) {
+    wrenGetListElement(vm, 3, i, 4);
+    ASSERT_SLOT_TYPE(vm, 4, NUM, "effect parameter");
+    params[i] = wrenGetSlotDouble(vm, 4);
+  }
+
+  AUDIO_EFFECT* effect = AUDIO_EFFECT_new(type, params, audioEngine->spec.freq);
+  AUDIO_ENGINE_lockBuses(audioEngine);
+  bus->effects[bus->effectCount++] = effect;
+  AUDIO_ENGINE_unlock(audioEngine);
+  wrenSetSlotDouble(vm, 0, bus->effectCount - 1);
+}
+
+internal void AUDIO_BUS_setEffect(WrenVM* vm) {
+  ENGINE* engine = wrenGetUserData(vm);
+  uint32_t index;
+  AUDIO_BUS* bus = AUDIO_BUS_fromSlot(vm, 1, &index);
+  if (bus == NULL) {
+    return;
+  }
+  ASSERT_SLOT_TYPE(vm, 2, NUM, "effect index");
+  ASSERT_SLOT_TYPE(vm, 3, NUM, "parameter index");
+  ASSERT_SLOT_TYPE(vm, 4, NUM, "value");
+  double effect = wrenGetSlotDouble(vm, 2);
+  double param = wrenGetSlotDouble(vm, 3);
+  if (effect < 0 || effect >= bus->effectCount || effect != (uint32_t)effect) {
+    VM_ABORT(vm, "Effect does not exist");
+    return;
+  }
+  if (param < 0 || param >= AUDIO_EFFECT_paramCount(bus->effects[(uint32_t)effect]->type) || param != (uint32_t)param) {
+    VM_ABORT(vm, "Effect parameter does not exist");
+    return;
+  }
+  AUDIO_ENGINE_sendBusCommand(engine->audioEngine, AUDIO_COMMAND_EFFECT_PARAM,
+      index, effect, param, wrenGetSlotDouble(vm, 4));
+}
+
+internal void AUDIO_BUS_clearEffects(WrenVM* vm) {
+  ENGINE* engine = wrenGetUserData(vm);
+  AUDIO_ENGINE* audioEngine = engine->audioEngine;
+  uint32_t index;
+  AUDIO_BUS* bus = AUDIO_BUS_fromSlot(vm, 1, &index);
+  if (bus == NULL) {
+    return;
+  }
+  AUDIO_EFFECT* effects[AUDIO_MAX_EFFECTS];
+  uint32_t count = bus->effectCount;
+  AUDIO_ENGINE_lockBuses(audioEngine);
+  memcpy(effects, bus->effects, sizeof(AUDIO_EFFECT*) * count);
+  bus->effectCount = 0;
+  // Changes still queued for the old chain mustn't land on effects added
+  // in its place, so they are pointed past the end, where they're ignored.
+  AUDIO_COMMAND_QUEUE* queue = &audioEngine->commands;
+  for (uint32_t i = SDL_AtomicGet(&queue->read); i != queue->staged; i++) {
+    AUDIO_COMMAND* command = &queue->commands[i & (queue->size - 1)];
+    if (command->type == AUDIO_COMMAND_EFFECT_PARAM && command->bus == index) {
+      command->effect = AUDIO_MAX_EFFECTS;
+    }
+  }
+  AUDIO_ENGINE_unlock(audioEngine);
+  for (uint32_t i = 0; i < count; i++) {
+    AUDIO_EFFECT_free(effects[i]);
+  }
 }
 
 internal double
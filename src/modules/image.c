@@ -212,11 +212,12 @@ DRAW_COMMAND_draw(WrenVM* vm) {
 }
 
 void IMAGE_allocate(WrenVM* vm) {
-  ASSERT_SLOT_TYPE(vm, 1, STRING, "image");
-  // TODO: We should read this from a "DataBuffer" which is file loaded, rather than loading ourselves.
-  // So that we can defer the file loading to a thread.
   int length;
-  const char* fileBuffer = wrenGetSlotBytes(vm, 1, &length);
+  const char* fileBuffer = DBUFFER_getSlotBytes(vm, 1, &length);
+  if (fileBuffer == NULL) {
+    VM_ABORT(vm, "image was not a String or a ready DataBuffer");
+    return;
+  }
   IMAGE* image = (IMAGE*)wrenSetSlotNewForeign(vm,
       0, 0, sizeof(IMAGE));
 
@@ -1,9 +1,44 @@
-typedef struct {
+typedef struct DBUFFER_t {
   bool ready;
+  // Views into a mapped bundle aren't owned, and mustn't be freed
+  bool owned;
   size_t length;
-  char* data;
+  const char* data;
+  // Every live DataBuffer is linked into |DBUFFER_live|, so a foreign
+  // object can be checked to be one before it is read
+  struct DBUFFER_t* prev;
+  struct DBUFFER_t* next;
 } DBUFFER;
 
+global_variable DBUFFER* DBUFFER_live = NULL;
+
+// Sets up a DataBuffer which has just been created by Wren
+internal void
+DBUFFER_init(DBUFFER* buffer) {
+  buffer->data = NULL;
+  buffer->length = 0;
+  buffer->ready = false;
+  buffer->owned = true;
+  buffer->prev = NULL;
+  buffer->next = DBUFFER_live;
+  if (DBUFFER_live != NULL) {
+    DBUFFER_live->prev = buffer;
+  }
+  DBUFFER_live = buffer;
+}
+
+// Wren can't tell us which class a foreign object belongs to, so the
+// object is looked for among the live DataBuffers.
+internal bool
+DBUFFER_isBuffer(void* foreign) {
+  for (DBUFFER* buffer = DBUFFER_live; buffer != NULL; buffer = buffer->next) {
+    if (buffer == foreign) {
+      return true;
+    }
+  }
+  return false;
+}
+
 typedef struct {
   bool complete;
   bool error;
@@ -19,9 +54,7 @@ ASYNCOP_allocate(WrenVM* vm) {
   wrenEnsureSlots(vm, 2);
   wrenSetSlotHandle(vm, 1, bufferClass);
   DBUFFER* buffer = (DBUFFER*)wrenSetSlotNewForeign(vm, 1, 1, sizeof(DBUFFER));
-  buffer->data = NULL;
-  buffer->length = 0;
-  buffer->ready = false;
+  DBUFFER_init(buffer);
 
   ASYNCOP* op = (ASYNCOP*)wrenSetSlotNewForeign(vm, 0, 0, sizeof(ASYNCOP));
   op->vm = vm;
@@ -45,6 +78,13 @@ ASYNCOP_getComplete(WrenVM* vm) {
   wrenSetSlotBool(vm, 0, op->complete);
 }
 
+internal void
+ASYNCOP_getError(WrenVM* vm) {
+  ASYNCOP* op = (ASYNCOP*)wrenGetSlotForeign(vm, 0);
+  wrenEnsureSlots(vm, 1);
+  wrenSetSlotBool(vm, 0, op->error);
+}
+
 internal void
 ASYNCOP_getResult(WrenVM* vm) {
   ASYNCOP* op = (ASYNCOP*)wrenGetSlotForeign(vm, 0);
@@ -64,17 +104,40 @@ internal void
 DBUFFER_allocate(WrenVM* vm) {
   wrenEnsureSlots(vm, 1);
   DBUFFER* buffer = (DBUFFER*)wrenSetSlotNewForeign(vm, 0, 0, sizeof(DBUFFER));
-  buffer->data = NULL;
-  buffer->length = 0;
-  buffer->ready = false;
+  DBUFFER_init(buffer);
 }
 
 internal void
 DBUFFER_finalize(void* data) {
   DBUFFER* buffer = (DBUFFER*) data;
-  if (buffer->ready && buffer->data != NULL) {
-    free(buffer->data);
+  if (buffer->ready && buffer->owned && buffer->data != NULL) {
+    free((void*)buffer->data);
+  }
+  if (buffer->prev != NULL) {
+    buffer->prev->next = buffer->next;
+  } else {
+    DBUFFER_live = buffer->next;
   }
+  if (buffer->next != NULL) {
+    buffer->next->prev = buffer->prev;
+  }
+}
+
+// Decoders accept either a String of file bytes, or a ready DataBuffer,
+// which may be a view directly into the game bundle.
+internal const char*
+DBUFFER_getSlotBytes(WrenVM* vm, int slot, int* length) {
+  WrenType type = wrenGetSlotType(vm, slot);
+  if (type == WREN_TYPE_STRING) {
+    return wrenGetSlotBytes(vm, slot, length);
+  } else if (type == WREN_TYPE_FOREIGN && DBUFFER_isBuffer(wrenGetSlotForeign(vm, slot))) {
+    DBUFFER* buffer = wrenGetSlotForeign(vm, slot);
+    if (buffer->ready && buffer->data != NULL) {
+      *length = buffer->length;
+      return buffer->data;
+    }
+  }
+  return NULL;
 }
 
 internal void
@@ -104,7 +167,9 @@ typedef struct {
   WrenHandle* bufferHandle;
   char name[256];
   size_t length;
-  char* buffer;
+  bool owned;
+  const char* buffer;
+  ENGINE_WRITE_RESULT writeResult;
 } TASK_DATA;
 
 internal void
@@ -138,7 +203,7 @@ FILESYSTEM_loadEventHandler(void* data) {
 
   // Thread: Async
   ENGINE* engine = (ENGINE*)wrenGetUserData(task->vm);
-  task->buffer = ENGINE_readFile(engine, task->name, &task->length);
+  task->buffer = ENGINE_viewFile(engine, task->name, &task->length, &task->owned);
 
   SDL_Event event;
   SDL_memset(&event, 0, sizeof(event));
@@ -175,7 +240,8 @@ FILESYSTEM_loadSync(WrenVM* vm) {
   ENGINE* engine = (ENGINE*)wrenGetUserData(vm);
 
   size_t length;
-  char* data = ENGINE_readFile(engine, path, &length);
+  bool owned;
+  const char* data = ENGINE_viewFile(engine, path, &length, &owned);
   if (data == NULL) {
     size_t len = 22 + strlen(path);
     char message[len];
@@ -185,7 +251,35 @@ FILESYSTEM_loadSync(WrenVM* vm) {
   }
   wrenEnsureSlots(vm, 1);
   wrenSetSlotBytes(vm, 0, data, length);
-  free(data);
+  if (owned) {
+    free((void*)data);
+  }
+}
+
+internal void
+FILESYSTEM_loadBuffer(WrenVM* vm) {
+  ASSERT_SLOT_TYPE(vm, 1, STRING, "file path");
+  const char* path = wrenGetSlotString(vm, 1);
+  ENGINE* engine = (ENGINE*)wrenGetUserData(vm);
+
+  size_t length;
+  bool owned;
+  const char* data = ENGINE_viewFile(engine, path, &length, &owned);
+  if (data == NULL) {
+    size_t len = 22 + strlen(path);
+    char message[len];
+    snprintf(message, len, "Could not find file: %s", path);
+    VM_ABORT(vm, message);
+    return;
+  }
+  wrenEnsureSlots(vm, 1);
+  wrenSetSlotHandle(vm, 0, bufferClass);
+  DBUFFER* buffer = (DBUFFER*)wrenSetSlotNewForeign(vm, 0, 0, sizeof(DBUFFER));
+  DBUFFER_init(buffer);
+  buffer->data = data;
+  buffer->length = length;
+  buffer->owned = owned;
+  buffer->ready = true;
 }
 
 internal void
@@ -202,8 +296,10 @@ FILESYSTEM_loadEventComplete(SDL_Event* event) {
 
   buffer->data = task->buffer;
   buffer->length = task->length;
+  buffer->owned = task->owned;
   buffer->ready = true;
 
+  op->error = task->buffer == NULL;
   op->complete = true;
 
   // Free resources and handles
@@ -211,3 +307,343 @@ FILESYSTEM_loadEventComplete(SDL_Event* event) {
   free(task);
 }
 
+
+internal void
+FILESYSTEM_saveAsync(WrenVM* vm) {
+  int length;
+  ASSERT_SLOT_TYPE(vm, 1, STRING, "file path");
+  ASSERT_SLOT_TYPE(vm, 2, STRING, "file data");
+  // Thread: main
+  INIT_TO_ZERO(ABC_TASK, task);
+  TASK_DATA* taskData = malloc(sizeof(TASK_DATA));
+
+  const char* path = wrenGetSlotString(vm, 1);
+  strncpy(taskData->name, path, 255);
+  taskData->name[255] = '\0';
+
+  // The string could be collected before the write happens, so we
+  // take a copy for the worker to own.
+  const char* data = wrenGetSlotBytes(vm, 2, &length);
+  char* buffer = malloc(length);
+  memcpy(buffer, data, length);
+  taskData->buffer = buffer;
+  taskData->length = length;
+  taskData->owned = true;
+
+  taskData->vm = vm;
+  taskData->opHandle = wrenGetSlotHandle(vm, 3);
+  taskData->bufferHandle = NULL;
+  taskData->writeResult = ENGINE_WRITE_SUCCESS;
+
+  ENGINE* engine = (ENGINE*)wrenGetUserData(vm);
+  task.type = TASK_WRITE_FILE;
+  task.data = taskData;
+  ABC_FIFO_pushTask(&engine->fifo, task);
+}
+
+internal void
+FILESYSTEM_saveEventHandler(void* data) {
+  TASK_DATA* task = data;
+
+  // Thread: Async
+  ENGINE* engine = (ENGINE*)wrenGetUserData(task->vm);
+  task->writeResult = ENGINE_writeFile(engine, task->name, task->buffer, task->length);
+
+  SDL_Event event;
+  SDL_memset(&event, 0, sizeof(event));
+  event.type = ENGINE_EVENT_TYPE;
+  event.user.code = EVENT_WRITE_FILE;
+  event.user.data1 = task;
+  event.user.data2 = NULL;
+  SDL_PushEvent(&event);
+}
+
+internal void
+FILESYSTEM_saveEventComplete(SDL_Event* event) {
+  // Thread: Main
+  TASK_DATA* task = event->user.data1;
+  WrenVM* vm = task->vm;
+  wrenEnsureSlots(vm, 2);
+
+  wrenSetSlotHandle(vm, 1, task->opHandle);
+  ASYNCOP* op = (ASYNCOP*)wrenGetSlotForeign(vm, 1);
+  op->error = task->writeResult != ENGINE_WRITE_SUCCESS;
+  op->complete = true;
+
+  // Free resources and handles
+  wrenReleaseHandle(vm, task->opHandle);
+  free((void*)task->buffer);
+  free(task);
+}
+
+// FileWriter keeps a file open and collects appends in memory, so games can
+// log every frame without touching the disk each time. The pending data is
+// written out on the worker pool once enough has built up, or once it has
+// been waiting for the interval, even if nothing else is written.
+#define FILE_WRITER_DEFAULT_THRESHOLD (64 * 1024)
+#define FILE_WRITER_DEFAULT_INTERVAL 1000
+
+typedef struct {
+  FILE* file;
+  ABC_FIFO* fifo;
+  // Held by the Wren object, and by each queued flush task
+  SDL_atomic_t refCount;
+  // Set while a background flush is queued, so we only have one at a time
+  SDL_atomic_t flushQueued;
+  // Set while a timer is waiting to flush data left pending
+  SDL_atomic_t timerArmed;
+  SDL_atomic_t error;
+
+  // |lock| guards the pending buffer, |writeLock| guards the file itself.
+  SDL_mutex* lock;
+  SDL_mutex* writeLock;
+  char* pending;
+  size_t pendingLength;
+  size_t pendingCapacity;
+  // Swapped with |pending| while writing, so appends aren't blocked on disk
+  char* flushing;
+  size_t flushingCapacity;
+
+  size_t threshold;
+  uint32_t interval;
+  uint32_t lastFlush;
+} FILE_WRITER;
+
+typedef struct {
+  FILE_WRITER* writer;
+} FILE_WRITER_HANDLE;
+
+internal void
+FILE_WRITER_release(FILE_WRITER* writer) {
+  if (SDL_AtomicDecRef(&writer->refCount)) {
+    if (writer->file != NULL) {
+      fclose(writer->file);
+    }
+    SDL_DestroyMutex(writer->lock);
+    SDL_DestroyMutex(writer->writeLock);
+    free(writer->pending);
+    free(writer->flushing);
+    free(writer);
+  }
+}
+
+// Writes out everything appended so far. Safe to call from any thread.
+internal void
+FILE_WRITER_flush(FILE_WRITER* writer) {
+  SDL_LockMutex(writer->writeLock);
+
+  SDL_LockMutex(writer->lock);
+  char* data = writer->pending;
+  size_t length = writer->pendingLength;
+  size_t capacity = writer->pendingCapacity;
+  writer->pending = writer->flushing;
+  writer->pendingCapacity = writer->flushingCapacity;
+  writer->pendingLength = 0;
+  writer->lastFlush = SDL_GetTicks();
+  SDL_UnlockMutex(writer->lock);
+
+  if (writer->file != NULL && length > 0) {
+    if (fwrite(data, sizeof(char), length, writer->file) != length ||
+        fflush(writer->file) != 0) {
+      SDL_AtomicSet(&writer->error, 1);
+    }
+  }
+
+  writer->flushing = data;
+  writer->flushingCapacity = capacity;
+  SDL_UnlockMutex(writer->writeLock);
+}
+
+internal void
+FILE_WRITER_close(FILE_WRITER* writer) {
+  FILE_WRITER_flush(writer);
+  SDL_LockMutex(writer->writeLock);
+  if (writer->file != NULL) {
+    fclose(writer->file);
+    writer->file = NULL;
+  }
+  SDL_UnlockMutex(writer->writeLock);
+}
+
+internal void
+FILE_WRITER_appendEventHandler(void* data) {
+  // Thread: Async
+  FILE_WRITER* writer = data;
+  SDL_AtomicSet(&writer->flushQueued, 0);
+  FILE_WRITER_flush(writer);
+  FILE_WRITER_release(writer);
+}
+
+internal void
+FILE_WRITER_queueFlush(FILE_WRITER* writer) {
+  if (writer->fifo->shutdown) {
+    FILE_WRITER_flush(writer);
+    return;
+  }
+  if (SDL_AtomicCAS(&writer->flushQueued, 0, 1)) {
+    SDL_AtomicIncRef(&writer->refCount);
+    INIT_TO_ZERO(ABC_TASK, task);
+    task.type = TASK_WRITE_FILE_APPEND;
+    task.data = writer;
+    ABC_FIFO_pushTask(writer->fifo, task);
+  }
+}
+
+internal Uint32
+FILE_WRITER_timerCallback(Uint32 interval, void* data) {
+  // Thread: Timer
+  // Only the main thread may queue tasks, so it is asked to do the flush
+  SDL_Event event;
+  SDL_memset(&event, 0, sizeof(event));
+  event.type = ENGINE_EVENT_TYPE;
+  event.user.code = EVENT_WRITE_FILE_APPEND;
+  event.user.data1 = data;
+  event.user.data2 = NULL;
+  SDL_PushEvent(&event);
+  return 0;
+}
+
+// Makes sure data which has just started to build up is written within the
+// interval, however long it is until the next write.
+internal void
+FILE_WRITER_armTimer(FILE_WRITER* writer) {
+  if (SDL_AtomicCAS(&writer->timerArmed, 0, 1)) {
+    SDL_AtomicIncRef(&writer->refCount);
+    if (SDL_AddTimer(writer->interval, FILE_WRITER_timerCallback, writer) == 0) {
+      SDL_AtomicSet(&writer->timerArmed, 0);
+      FILE_WRITER_release(writer);
+    }
+  }
+}
+
+internal void
+FILE_WRITER_timerEventComplete(SDL_Event* event) {
+  // Thread: Main
+  FILE_WRITER* writer = event->user.data1;
+  SDL_AtomicSet(&writer->timerArmed, 0);
+  if (writer->file != NULL) {
+    FILE_WRITER_queueFlush(writer);
+  }
+  FILE_WRITER_release(writer);
+}
+
+internal void
+FILE_WRITER_allocate(WrenVM* vm) {
+  FILE_WRITER_HANDLE* handle = (FILE_WRITER_HANDLE*)wrenSetSlotNewForeign(vm, 0, 0, sizeof(FILE_WRITER_HANDLE));
+  handle->writer = NULL;
+  ASSERT_SLOT_TYPE(vm, 1, STRING, "file path");
+  size_t threshold = FILE_WRITER_DEFAULT_THRESHOLD;
+  uint32_t interval = FILE_WRITER_DEFAULT_INTERVAL;
+  if (wrenGetSlotCount(vm) > 3) {
+    ASSERT_SLOT_TYPE(vm, 2, NUM, "buffer size");
+    ASSERT_SLOT_TYPE(vm, 3, NUM, "interval");
+    threshold = max(1, wrenGetSlotDouble(vm, 2));
+    interval = max(0, wrenGetSlotDouble(vm, 3));
+  }
+
+  const char* path = wrenGetSlotString(vm, 1);
+  char* base = BASEPATH_get();
+  char* fullPath = malloc(strlen(base)+strlen(path)+1);
+  strcpy(fullPath, base);
+  strcat(fullPath, path);
+  FILE* file = fopen(fullPath, "ab");
+  free(fullPath);
+  if (file == NULL) {
+    size_t len = 22 + strlen(path);
+    char message[len];
+    snprintf(message, len, "Could not open file: %s", path);
+    VM_ABORT(vm, message);
+    return;
+  }
+
+  ENGINE* engine = (ENGINE*)wrenGetUserData(vm);
+  FILE_WRITER* writer = calloc(1, sizeof(FILE_WRITER));
+  writer->file = file;
+  writer->fifo = &engine->fifo;
+  SDL_AtomicSet(&writer->refCount, 1);
+  writer->lock = SDL_CreateMutex();
+  writer->writeLock = SDL_CreateMutex();
+  writer->threshold = threshold;
+  writer->interval = interval;
+  writer->lastFlush = SDL_GetTicks();
+  handle->writer = writer;
+}
+
+internal void
+FILE_WRITER_finalize(void* data) {
+  FILE_WRITER_HANDLE* handle = data;
+  if (handle->writer != NULL) {
+    FILE_WRITER_close(handle->writer);
+    FILE_WRITER_release(handle->writer);
+    handle->writer = NULL;
+  }
+}
+
+internal void
+FILE_WRITER_write(WrenVM* vm) {
+  FILE_WRITER_HANDLE* handle = wrenGetSlotForeign(vm, 0);
+  FILE_WRITER* writer = handle->writer;
+  if (writer == NULL || writer->file == NULL) {
+    VM_ABORT(vm, "FileWriter is closed");
+    return;
+  }
+  ASSERT_SLOT_TYPE(vm, 1, STRING, "data");
+  int length;
+  const char* data = wrenGetSlotBytes(vm, 1, &length);
+
+  SDL_LockMutex(writer->lock);
+  bool wasEmpty = writer->pendingLength == 0;
+  size_t required = writer->pendingLength + length;
+  if (required > writer->pendingCapacity) {
+    size_t capacity = max(writer->pendingCapacity * 2, max(required, 256));
+    char* pending = realloc(writer->pending, capacity);
+    if (pending == NULL) {
+      SDL_UnlockMutex(writer->lock);
+      VM_ABORT(vm, "Could not allocate memory for FileWriter");
+      return;
+    }
+    writer->pending = pending;
+    writer->pendingCapacity = capacity;
+  }
+  memcpy(writer->pending + writer->pendingLength, data, length);
+  writer->pendingLength = required;
+  bool shouldFlush = required >= writer->threshold ||
+    (SDL_GetTicks() - writer->lastFlush) >= writer->interval;
+  SDL_UnlockMutex(writer->lock);
+
+  if (shouldFlush) {
+    FILE_WRITER_queueFlush(writer);
+  } else if (wasEmpty) {
+    FILE_WRITER_armTimer(writer);
+  }
+}
+
+internal void
+FILE_WRITER_flushSync(WrenVM* vm) {
+  FILE_WRITER_HANDLE* handle = wrenGetSlotForeign(vm, 0);
+  if (handle->writer != NULL) {
+    FILE_WRITER_flush(handle->writer);
+  }
+}
+
+internal void
+FILE_WRITER_closeSync(WrenVM* vm) {
+  FILE_WRITER_HANDLE* handle = wrenGetSlotForeign(vm, 0);
+  if (handle->writer != NULL) {
+    FILE_WRITER_close(handle->writer);
+  }
+}
+
+internal void
+FILE_WRITER_getIsOpen(WrenVM* vm) {
+  FILE_WRITER_HANDLE* handle = wrenGetSlotForeign(vm, 0);
+  wrenEnsureSlots(vm, 1);
+  wrenSetSlotBool(vm, 0, handle->writer != NULL && handle->writer->file != NULL);
+}
+
+internal void
+FILE_WRITER_getError(WrenVM* vm) {
+  FILE_WRITER_HANDLE* handle = wrenGetSlotForeign(vm, 0);
+  wrenEnsureSlots(vm, 1);
+  wrenSetSlotBool(vm, 0, handle->writer != NULL && SDL_AtomicGet(&handle->writer->error) != 0);
+}
@@ -40,14 +40,14 @@ VM_bind_foreign_class(WrenVM* vm, const char* module, const char* className) {
     } else if (STRINGS_EQUAL(className, "AsyncOperation")) {
       methods.allocate = ASYNCOP_allocate;
       methods.finalize = ASYNCOP_finalize;
+    } else if (STRINGS_EQUAL(className, "FileWriter")) {
+      methods.allocate = FILE_WRITER_allocate;
+      methods.finalize = FILE_WRITER_finalize;
     }
   } else if (STRINGS_EQUAL(module, "audio")) {
     if (STRINGS_EQUAL(className, "AudioData")) {
       methods.allocate = AUDIO_allocate;
       methods.finalize = AUDIO_finalize;
-    } else if (STRINGS_EQUAL(className, "SystemChannel")) {
-      methods.allocate = AUDIO_CHANNEL_allocate;
-      methods.finalize = AUDIO_CHANNEL_finalize;
     }
   } else if (STRINGS_EQUAL(module, "input")) {
     if (STRINGS_EQUAL(className, "GamePad")) {
@@ -208,30 +208,63 @@ internal WrenVM* VM_create(ENGINE* engine) {
   MAP_addFunction(&engine->moduleMap, "image", "DrawCommand.draw(_,_)", DRAW_COMMAND_draw);
 
   // Audio
-  MAP_addFunction(&engine->moduleMap, "audio", "SystemChannel.enabled=(_)", AUDIO_CHANNEL_setEnabled);
-  MAP_addFunction(&engine->moduleMap, "audio", "SystemChannel.enabled", AUDIO_CHANNEL_getEnabled);
-  MAP_addFunction(&engine->moduleMap, "audio", "SystemChannel.loop=(_)", AUDIO_CHANNEL_setLoop);
-  MAP_addFunction(&engine->moduleMap, "audio", "SystemChannel.loop", AUDIO_CHANNEL_getLoop);
-  MAP_addFunction(&engine->moduleMap, "audio", "SystemChannel.pan=(_)", AUDIO_CHANNEL_setPan);
-  MAP_addFunction(&engine->moduleMap, "audio", "SystemChannel.pan", AUDIO_CHANNEL_getPan);
-  MAP_addFunction(&engine->moduleMap, "audio", "SystemChannel.volume", AUDIO_CHANNEL_getVolume);
-  MAP_addFunction(&engine->moduleMap, "audio", "SystemChannel.volume=(_)", AUDIO_CHANNEL_setVolume);
-  MAP_addFunction(&engine->moduleMap, "audio", "SystemChannel.state=(_)", AUDIO_CHANNEL_setState);
-  MAP_addFunction(&engine->moduleMap, "audio", "SystemChannel.audio=(_)", AUDIO_CHANNEL_setAudio);
-  MAP_addFunction(&engine->moduleMap, "audio", "SystemChannel.state", AUDIO_CHANNEL_getState);
-  MAP_addFunction(&engine->moduleMap, "audio", "SystemChannel.length", AUDIO_CHANNEL_getPosition);
-  MAP_addFunction(&engine->moduleMap, "audio", "SystemChannel.position", AUDIO_CHANNEL_getPosition);
-  MAP_addFunction(&engine->moduleMap, "audio", "SystemChannel.soundId", AUDIO_CHANNEL_getSoundId);
-
   MAP_addFunction(&engine->moduleMap, "audio", "AudioData.length", AUDIO_getLength);
-
-  MAP_addFunction(&engine->moduleMap, "audio", "static AudioEngine.f_update(_)", AUDIO_ENGINE_update);
+  MAP_addFunction(&engine->moduleMap, "audio", "AudioData.compress_()", AUDIO_compress);
+  MAP_addFunction(&engine->moduleMap, "audio", "static AudioData.stream_(_)", AUDIO_stream);
+
+  MAP_addFunction(&engine->moduleMap, "audio", "static AudioEngine.f_update()", AUDIO_ENGINE_update);
+  MAP_addFunction(&engine->moduleMap, "audio", "static AudioEngine.f_play(_,_,_,_,_,_,_)", AUDIO_ENGINE_play);
+  MAP_addFunction(&engine->moduleMap, "audio", "static AudioEngine.f_schedule(_,_)", AUDIO_CHANNEL_schedule);
+  MAP_addFunction(&engine->moduleMap, "audio", "static AudioEngine.f_playSynth(_,_,_,_,_,_)", AUDIO_ENGINE_playSynth);
+  MAP_addFunction(&engine->moduleMap, "audio", "static AudioEngine.f_loadAsync(_,_,_,_)", AUDIO_ENGINE_loadAsync);
+  MAP_addFunction(&engine->moduleMap, "audio", "static AudioEngine.f_setAudio(_,_)", AUDIO_ENGINE_setChannelAudio);
+  MAP_addFunction(&engine->moduleMap, "audio", "static AudioEngine.f_stop(_,_)", AUDIO_ENGINE_stop);
+  MAP_addFunction(&engine->moduleMap, "audio", "static AudioEngine.f_fade(_,_,_)", AUDIO_CHANNEL_fade);
+  MAP_addFunction(&engine->moduleMap, "audio", "static AudioEngine.f_fadeIn(_,_)", AUDIO_CHANNEL_fadeIn);
+  MAP_addFunction(&engine->moduleMap, "audio", "static AudioEngine.f_stopAll()", AUDIO_ENGINE_stopAll);
+  MAP_addFunction(&engine->moduleMap, "audio", "static AudioEngine.f_unload(_)", AUDIO_ENGINE_unload);
+  MAP_addFunction(&engine->moduleMap, "audio", "static AudioEngine.f_state(_)", AUDIO_CHANNEL_getState);
+  MAP_addFunction(&engine->moduleMap, "audio", "static AudioEngine.f_finished(_)", AUDIO_CHANNEL_getFinished);
+  MAP_addFunction(&engine->moduleMap, "audio", "static AudioEngine.f_position(_)", AUDIO_CHANNEL_getPosition);
+  MAP_addFunction(&engine->moduleMap, "audio", "static AudioEngine.f_length(_)", AUDIO_CHANNEL_getLength);
+  MAP_addFunction(&engine->moduleMap, "audio", "static AudioEngine.f_songPosition(_)", AUDIO_CHANNEL_getSongPosition);
+  MAP_addFunction(&engine->moduleMap, "audio", "static AudioEngine.f_setLoop(_,_)", AUDIO_CHANNEL_setLoop);
+  MAP_addFunction(&engine->moduleMap, "audio", "static AudioEngine.f_setVolume(_,_)", AUDIO_CHANNEL_setVolume);
+  MAP_addFunction(&engine->moduleMap, "audio", "static AudioEngine.f_setPan(_,_)", AUDIO_CHANNEL_setPan);
+  MAP_addFunction(&engine->moduleMap, "audio", "static AudioEngine.f_setPriority(_,_)", AUDIO_CHANNEL_setPriority);
+  MAP_addFunction(&engine->moduleMap, "audio", "static AudioEngine.f_setRate(_,_)", AUDIO_CHANNEL_setRate);
+  MAP_addFunction(&engine->moduleMap, "audio", "static AudioEngine.f_setInterpolation(_,_)", AUDIO_CHANNEL_setInterpolation);
+  MAP_addFunction(&engine->moduleMap, "audio", "static AudioEngine.f_setRange(_,_,_)", AUDIO_CHANNEL_setRange);
+  MAP_addFunction(&engine->moduleMap, "audio", "static AudioEngine.f_setPositions(_)", AUDIO_ENGINE_setPositions);
+  MAP_addFunction(&engine->moduleMap, "audio", "static AudioEngine.setListener(_,_)", AUDIO_ENGINE_setListener);
+  MAP_addFunction(&engine->moduleMap, "audio", "static AudioEngine.setAttenuation(_,_)", AUDIO_ENGINE_setAttenuation);
+  MAP_addFunction(&engine->moduleMap, "audio", "static AudioEngine.maxVoices", AUDIO_ENGINE_getMaxVoices);
+  MAP_addFunction(&engine->moduleMap, "audio", "static AudioEngine.maxVoices=(_)", AUDIO_ENGINE_setMaxVoices);
   MAP_addFunction(&engine->moduleMap, "audio", "static AudioEngine.f_captureVariable()", AUDIO_ENGINE_capture);
+  MAP_addFunction(&engine->moduleMap, "audio", "static AudioEngine.sampleRate", AUDIO_ENGINE_getSampleRate);
+  MAP_addFunction(&engine->moduleMap, "audio", "static AudioEngine.clock", AUDIO_ENGINE_getClock);
+  MAP_addFunction(&engine->moduleMap, "audio", "static AudioEngine.bufferSize", AUDIO_ENGINE_getBufferSize);
+  MAP_addFunction(&engine->moduleMap, "audio", "static AudioEngine.format", AUDIO_ENGINE_getFormat);
+  MAP_addFunction(&engine->moduleMap, "audio", "static AudioEngine.channels", AUDIO_ENGINE_getChannels);
+  MAP_addFunction(&engine->moduleMap, "audio", "static AudioEngine.f_configure(_,_,_,_)", AUDIO_ENGINE_configure);
+  MAP_addFunction(&engine->moduleMap, "audio", "static AudioEngine.f_mixerStats()", AUDIO_ENGINE_getMixerStats);
+  MAP_addFunction(&engine->moduleMap, "audio", "static AudioEngine.resetMixerStats()", AUDIO_ENGINE_resetMixerStats);
+  MAP_addFunction(&engine->moduleMap, "audio", "static AudioEngine.startRecording(_)", AUDIO_ENGINE_record);
+  MAP_addFunction(&engine->moduleMap, "audio", "static AudioEngine.stopRecording()", AUDIO_ENGINE_stopRecording);
+  MAP_addFunction(&engine->moduleMap, "audio", "static AudioEngine.isRecording", AUDIO_ENGINE_isRecording);
+  MAP_addFunction(&engine->moduleMap, "audio", "static AudioEngine.f_addBus()", AUDIO_ENGINE_addBus);
+  MAP_addFunction(&engine->moduleMap, "audio", "static AudioEngine.f_setBusVolume(_,_)", AUDIO_BUS_setVolume);
+  MAP_addFunction(&engine->moduleMap, "audio", "static AudioEngine.f_setBusMute(_,_)", AUDIO_BUS_setMute);
+  MAP_addFunction(&engine->moduleMap, "audio", "static AudioEngine.f_addEffect(_,_,_)", AUDIO_BUS_addEffect);
+  MAP_addFunction(&engine->moduleMap, "audio", "static AudioEngine.f_setEffect(_,_,_,_)", AUDIO_BUS_setEffect);
+  MAP_addFunction(&engine->moduleMap, "audio", "static AudioEngine.f_clearEffects(_)", AUDIO_BUS_clearEffects);
 
   // FileSystem
   MAP_addFunction(&engine->moduleMap, "io", "static FileSystem.f_load(_,_)", FILESYSTEM_loadAsync);
   MAP_addFunction(&engine->moduleMap, "io", "static FileSystem.load(_)", FILESYSTEM_loadSync);
+  MAP_addFunction(&engine->moduleMap, "io", "static FileSystem.loadBuffer(_)", FILESYSTEM_loadBuffer);
   MAP_addFunction(&engine->moduleMap, "io", "static FileSystem.save(_,_)", FILESYSTEM_saveSync);
+  MAP_addFunction(&engine->moduleMap, "io", "static FileSystem.f_save(_,_,_)", FILESYSTEM_saveAsync);
 
   // Buffer
   MAP_addFunction(&engine->moduleMap, "io", "static DataBuffer.f_capture()", DBUFFER_capture);
@@ -242,6 +275,14 @@ internal WrenVM* VM_create(ENGINE* engine) {
   // AsyncOperation
   MAP_addFunction(&engine->moduleMap, "io", "AsyncOperation.result", ASYNCOP_getResult);
   MAP_addFunction(&engine->moduleMap, "io", "AsyncOperation.complete", ASYNCOP_getComplete);
+  MAP_addFunction(&engine->moduleMap, "io", "AsyncOperation.error", ASYNCOP_getError);
+
+  // FileWriter
+  MAP_addFunction(&engine->moduleMap, "io", "FileWriter.write(_)", FILE_WRITER_write);
+  MAP_addFunction(&engine->moduleMap, "io", "FileWriter.flush()", FILE_WRITER_flushSync);
+  MAP_addFunction(&engine->moduleMap, "io", "FileWriter.close()", FILE_WRITER_closeSync);
+  MAP_addFunction(&engine->moduleMap, "io", "FileWriter.isOpen", FILE_WRITER_getIsOpen);
+  MAP_addFunction(&engine->moduleMap, "io", "FileWriter.error", FILE_WRITER_getError);
 
   // Input
   MAP_addFunction(&engine->moduleMap, "input", "static Keyboard.isKeyDown(_)", KEYBOARD_isKeyDown);